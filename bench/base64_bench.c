@@ -0,0 +1,118 @@
+/* Base64 throughput: the previous scalar encoder and auth.c decoder against
+   every implementation of the current module this CPU supports.
+   Build with `make bench/base64_bench`. */
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "base64.h"
+
+/* ---- previous code, kept verbatim for comparison ---- */
+
+static const char legacy_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static size_t legacy_encode(const unsigned char *input, size_t input_len, char *out) {
+    size_t i = 0, o = 0;
+    while (i + 2 < input_len) {
+        unsigned v = (input[i] << 16) | (input[i + 1] << 8) | input[i + 2];
+        out[o++] = legacy_table[(v >> 18) & 0x3F];
+        out[o++] = legacy_table[(v >> 12) & 0x3F];
+        out[o++] = legacy_table[(v >> 6) & 0x3F];
+        out[o++] = legacy_table[v & 0x3F];
+        i += 3;
+    }
+    if (i + 1 == input_len) {
+        unsigned v = (input[i] << 16);
+        out[o++] = legacy_table[(v >> 18) & 0x3F];
+        out[o++] = legacy_table[(v >> 12) & 0x3F];
+        out[o++] = '=';
+        out[o++] = '=';
+    } else if (i + 2 == input_len) {
+        unsigned v = (input[i] << 16) | (input[i + 1] << 8);
+        out[o++] = legacy_table[(v >> 18) & 0x3F];
+        out[o++] = legacy_table[(v >> 12) & 0x3F];
+        out[o++] = legacy_table[(v >> 6) & 0x3F];
+        out[o++] = '=';
+    }
+    return o;
+}
+
+static int legacy_decode(const char *in, unsigned char *out, size_t outcap, size_t *outlen) {
+    static int inv_table[256];
+    static int table_initialized = 0;
+    if (!table_initialized) {
+        for (int i = 0; i < 256; i++) inv_table[i] = -1;
+        for (int i = 0; i < 64; i++) inv_table[(unsigned char)legacy_table[i]] = i;
+        table_initialized = 1;
+    }
+    size_t len = strlen(in);
+    size_t o = 0;
+    for (size_t i = 0; i < len && o < outcap; i += 4) {
+        if (i + 3 >= len) break;
+        int c1 = inv_table[(unsigned char)in[i]];
+        int c2 = inv_table[(unsigned char)in[i+1]];
+        int c3 = inv_table[(unsigned char)in[i+2]];
+        int c4 = inv_table[(unsigned char)in[i+3]];
+        if (c1 < 0 || c2 < 0) break;
+        if (o < outcap) out[o++] = (unsigned char)((c1 << 2) | (c2 >> 4));
+        if (c3 >= 0 && o < outcap) out[o++] = (unsigned char)(((c2 & 0xF) << 4) | (c3 >> 2));
+        if (c4 >= 0 && o < outcap) out[o++] = (unsigned char)(((c3 & 0x3) << 6) | c4);
+    }
+    *outlen = o;
+    return 0;
+}
+
+/* ---- harness ---- */
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static volatile size_t g_sink;
+
+/* runs fn for ~0.2s and returns MB/s of raw (decoded) bytes */
+#define MEASURE(expr, raw_len) ({                                   \
+    size_t iters = 0; double t0 = now_sec(), t1;                     \
+    do { for (int r_ = 0; r_ < 64; r_++) { g_sink += (size_t)(expr); } \
+         iters += 64; t1 = now_sec(); } while (t1 - t0 < 0.2);       \
+    (double)(raw_len) * (double)iters / (t1 - t0) / 1e6; })
+
+int main(void) {
+    static const size_t sizes[] = { 32, 1024, 65536 };
+    const char *impls[] = { "scalar", "ssse3", "avx2" };
+    const char *best = base64_impl();
+
+    printf("%-8s %-10s %12s %12s\n", "size", "impl", "encode MB/s", "decode MB/s");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t n = sizes[s];
+        unsigned char *raw = malloc(n);
+        unsigned char *dec = malloc(n + 3);
+        char *enc = malloc(BASE64_ENCODED_LEN(n) + 1);
+        for (size_t i = 0; i < n; i++) raw[i] = (unsigned char)rand();
+        size_t elen = legacy_encode(raw, n, enc);
+        enc[elen] = '\0';
+
+        size_t outlen;
+        double le = MEASURE(legacy_encode(raw, n, enc), n);
+        double ld = MEASURE((legacy_decode(enc, dec, n, &outlen), outlen), n);
+        printf("%-8zu %-10s %12.1f %12.1f\n", n, "legacy", le, ld);
+
+        for (int k = 0; k < 3; k++) {
+            if (base64_use_impl(impls[k]) < 0) continue;
+            double e = MEASURE(base64_encode(raw, n, enc), n);
+            double d = MEASURE(base64_decode(enc, elen, dec, n + 3, 0), n);
+            if (base64_decode(enc, elen, dec, n + 3, 0) != (long)n || memcmp(dec, raw, n) != 0) {
+                fprintf(stderr, "%s: round trip failed\n", impls[k]);
+                return 1;
+            }
+            printf("%-8zu %-10s %12.1f %12.1f\n", n, impls[k], e, d);
+        }
+        base64_use_impl(best);
+        free(raw); free(dec); free(enc);
+    }
+    return 0;
+}
@@ -0,0 +1,524 @@
+/* End-to-end load generator. Start the server first, then:
+
+     ./bench/loadgen [-p port] [-r requests] [-k concurrency] [-c ws_clients]
+                     [-n messages] [-m msgs_per_sec] [-o results.json]
+
+   1. registers and logs in a throwaway user,
+   2. hammers GET /, /static/app.js, /stats and /me with -k parallel clients,
+   3. opens -c authenticated WebSocket clients (connection capacity),
+   4. sends -n chat messages from one client and times their arrival at
+      every client (broadcast latency and delivery throughput).
+
+   Results are printed and written as JSON to -o (default loadgen.json).
+   Build with `make bench`. */
+#define _POSIX_C_SOURCE 200809L
+#define _DARWIN_C_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "json.h"
+#include "util.h"
+
+static int g_port = 8081;
+static char g_sid[256];
+
+/* ---- stats ---- */
+
+typedef struct {
+    uint64_t *v;
+    size_t n, cap;
+} samples;
+
+static void samples_add(samples *s, uint64_t ns) {
+    if (s->n == s->cap) {
+        size_t nc = s->cap ? s->cap * 2 : 1024;
+        uint64_t *nv = (uint64_t*)realloc(s->v, nc * sizeof(*nv));
+        if (!nv) return;
+        s->v = nv; s->cap = nc;
+    }
+    s->v[s->n++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* milliseconds at quantile q of a sorted sample set */
+static double pct_ms(const samples *s, double q) {
+    if (!s->n) return 0;
+    return (double)s->v[(size_t)(q * (double)(s->n - 1))] / 1e6;
+}
+
+static void jw_double(jsonw *w, double d) {
+    char tmp[32];
+    int n = snprintf(tmp, sizeof(tmp), "%.3f", d);
+    jw_raw(w, tmp, (size_t)n);
+}
+
+/* writes count + p50/p90/p99/max in ms; sorts s */
+static void jw_latency(jsonw *w, samples *s) {
+    qsort(s->v, s->n, sizeof(uint64_t), cmp_u64);
+    jw_key(w, "p50_ms"); jw_double(w, pct_ms(s, 0.50));
+    jw_key(w, "p90_ms"); jw_double(w, pct_ms(s, 0.90));
+    jw_key(w, "p99_ms"); jw_double(w, pct_ms(s, 0.99));
+    jw_key(w, "max_ms"); jw_double(w, pct_ms(s, 1.0));
+}
+
+/* ---- sockets ---- */
+
+static int tcp_connect(int nonblock) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    if (nonblock) set_nonblock(fd);
+    struct sockaddr_in a;
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_port = htons((uint16_t)g_port);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*)&a, sizeof(a)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int status_of(const char *resp) {
+    if (strncmp(resp, "HTTP/1.1 ", 9) != 0) return -1;
+    return atoi(resp + 9);
+}
+
+/* blocking request/response for setup; returns the status code */
+static int http_once(const char *req, char *resp, size_t cap) {
+    int fd = tcp_connect(0);
+    if (fd < 0) return -1;
+    size_t len = strlen(req), off = 0;
+    while (off < len) {
+        ssize_t w = send(fd, req + off, len - off, 0);
+        if (w <= 0) { close(fd); return -1; }
+        off += (size_t)w;
+    }
+    size_t got = 0;
+    ssize_t r;
+    while (got + 1 < cap && (r = recv(fd, resp + got, cap - 1 - got, 0)) > 0) got += (size_t)r;
+    resp[got] = '\0';
+    close(fd);
+    return status_of(resp);
+}
+
+static int login(const char *user, const char *pass) {
+    char body[256], req[1024], resp[4096];
+    snprintf(body, sizeof(body), "username=%s&password=%s", user, pass);
+    const char *paths[2] = { "/register", "/login" };
+    int st = 0;
+    for (int i = 0; i < 2; i++) {
+        snprintf(req, sizeof(req),
+            "POST %s HTTP/1.1\r\nHost: 127.0.0.1\r\n"
+            "Content-Type: application/x-www-form-urlencoded\r\n"
+            "Content-Length: %zu\r\n\r\n%s", paths[i], strlen(body), body);
+        st = http_once(req, resp, sizeof(resp));
+    }
+    if (st != 204) return -1;
+    const char *c = strstr(resp, "sid=");
+    if (!c) return -1;
+    c += 4;
+    size_t n = strcspn(c, ";\r\n");
+    if (n >= sizeof(g_sid)) return -1;
+    memcpy(g_sid, c, n);
+    g_sid[n] = '\0';
+    return 0;
+}
+
+/* ---- HTTP phase: closed loop, one request per connection ---- */
+
+typedef struct {
+    int fd;
+    int sent;
+    uint64_t t0;
+    char head[16];
+    size_t head_len;
+} hslot;
+
+typedef struct {
+    const char *path;
+    int ok, errors;
+    double seconds;
+    samples lat;
+} http_result;
+
+static void run_http(http_result *res, int total, int conc) {
+    char req[512];
+    int rlen = snprintf(req, sizeof(req),
+        "GET %s HTTP/1.1\r\nHost: 127.0.0.1\r\nCookie: sid=%s\r\n\r\n", res->path, g_sid);
+    hslot *slots = (hslot*)calloc((size_t)conc, sizeof(hslot));
+    struct pollfd *pfd = (struct pollfd*)calloc((size_t)conc, sizeof(struct pollfd));
+    int started = 0, done = 0;
+    uint64_t begin = now_ns();
+    for (int i = 0; i < conc; i++) slots[i].fd = -1;
+
+    while (done < total) {
+        for (int i = 0; i < conc; i++) {
+            hslot *s = &slots[i];
+            if (s->fd < 0 && started < total) {
+                s->fd = tcp_connect(1);
+                s->sent = 0; s->head_len = 0; s->t0 = now_ns();
+                started++;
+                if (s->fd < 0) { res->errors++; done++; }
+            }
+            pfd[i].fd = s->fd;
+            pfd[i].events = s->fd < 0 ? 0 : s->sent ? POLLIN : POLLOUT;
+            pfd[i].revents = 0;
+        }
+        if (poll(pfd, (nfds_t)conc, 5000) <= 0) break;
+        for (int i = 0; i < conc; i++) {
+            hslot *s = &slots[i];
+            if (s->fd < 0 || !pfd[i].revents) continue;
+            int finished = 0, ok = 0;
+            if (!s->sent) {
+                if (send(s->fd, req, (size_t)rlen, 0) == rlen) s->sent = 1;
+                else finished = 1;
+            } else {
+                char buf[16384];
+                ssize_t r = recv(s->fd, buf, sizeof(buf), 0);
+                if (r > 0) {
+                    size_t take = sizeof(s->head) - 1 - s->head_len;
+                    if (take > (size_t)r) take = (size_t)r;
+                    memcpy(s->head + s->head_len, buf, take);
+                    s->head_len += take;
+                    s->head[s->head_len] = '\0';
+                } else if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    finished = 1;
+                    int st = status_of(s->head);
+                    ok = st >= 200 && st < 300;
+                }
+            }
+            if (finished) {
+                if (ok) { res->ok++; samples_add(&res->lat, now_ns() - s->t0); }
+                else res->errors++;
+                close(s->fd);
+                s->fd = -1;
+                done++;
+            }
+        }
+    }
+    res->seconds = (double)(now_ns() - begin) / 1e9;
+    for (int i = 0; i < conc; i++) if (slots[i].fd >= 0) { close(slots[i].fd); res->errors++; }
+    free(slots);
+    free(pfd);
+}
+
+/* ---- WebSocket phase ---- */
+
+enum { WS_CONNECTING, WS_HANDSHAKE, WS_OPEN, WS_DEAD };
+
+typedef struct {
+    int fd;
+    int state;
+    unsigned char *buf;
+    size_t len, cap;
+    long deliveries;
+} wsclient;
+
+static void ws_buf_append(wsclient *c, const unsigned char *p, size_t n) {
+    if (c->len + n > c->cap) {
+        size_t nc = c->cap ? c->cap : 4096;
+        while (nc < c->len + n) nc *= 2;
+        unsigned char *nb = (unsigned char*)realloc(c->buf, nc);
+        if (!nb) { c->state = WS_DEAD; return; }
+        c->buf = nb; c->cap = nc;
+    }
+    memcpy(c->buf + c->len, p, n);
+    c->len += n;
+}
+
+static void ws_kill(wsclient *c) {
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+    c->state = WS_DEAD;
+}
+
+static const char *find_mark(const char *p, size_t n) {
+    for (size_t i = 0; i + 6 <= n; i++)
+        if (p[i] == 'b' && memcmp(p + i, "bench:", 6) == 0) return p + i;
+    return NULL;
+}
+
+/* pulls complete server frames out of c->buf; "bench:<seq>:<ns>" messages are timed */
+static void ws_consume(wsclient *c, samples *lat) {
+    size_t off = 0;
+    while (c->len - off >= 2) {
+        const unsigned char *h = c->buf + off;
+        uint64_t plen = h[1] & 0x7F;
+        size_t hl = 2;
+        if (plen == 126) {
+            if (c->len - off < 4) break;
+            plen = ((uint64_t)h[2] << 8) | h[3];
+            hl = 4;
+        } else if (plen == 127) {
+            if (c->len - off < 10) break;
+            plen = 0;
+            for (int i = 0; i < 8; i++) plen = (plen << 8) | h[2 + i];
+            hl = 10;
+        }
+        if (c->len - off < hl + plen) break;
+        const char *p = (const char*)h + hl;
+        /* broadcasts are message JSON; the marker sits in "content" */
+        const char *mark = (h[0] & 0x0F) == 0x1 ? find_mark(p, (size_t)plen) : NULL;
+        if (mark) {
+            char tmp[64];
+            size_t left = (size_t)plen - (size_t)(mark - p);
+            size_t n = left < sizeof(tmp) - 1 ? left : sizeof(tmp) - 1;
+            memcpy(tmp, mark, n);
+            tmp[n] = '\0';
+            const char *ts = strchr(tmp + 6, ':');
+            if (ts) {
+                samples_add(lat, now_ns() - strtoull(ts + 1, NULL, 10));
+                c->deliveries++;
+            }
+        }
+        off += hl + (size_t)plen;
+    }
+    memmove(c->buf, c->buf + off, c->len - off);
+    c->len -= off;
+}
+
+static int ws_send_masked(int fd, const char *msg, size_t len) {
+    unsigned char frame[256];
+    if (len > 125) return -1;
+    static const unsigned char mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+    frame[0] = 0x81;
+    frame[1] = 0x80 | (unsigned char)len;
+    memcpy(frame + 2, mask, 4);
+    for (size_t i = 0; i < len; i++) frame[6 + i] = (unsigned char)msg[i] ^ mask[i & 3];
+    return send(fd, frame, 6 + len, 0) == (ssize_t)(6 + len) ? 0 : -1;
+}
+
+/* one poll pass over every live client; returns the number of ready fds */
+static int ws_poll(wsclient *cl, struct pollfd *pfd, int n, const char *hs, size_t hs_len,
+                   samples *lat, int timeout_ms) {
+    for (int i = 0; i < n; i++) {
+        pfd[i].fd = cl[i].state == WS_DEAD ? -1 : cl[i].fd;
+        pfd[i].events = cl[i].state == WS_CONNECTING ? POLLOUT : POLLIN;
+        pfd[i].revents = 0;
+    }
+    int ready = poll(pfd, (nfds_t)n, timeout_ms);
+    if (ready <= 0) return ready;
+    for (int i = 0; i < n; i++) {
+        wsclient *c = &cl[i];
+        if (c->state == WS_DEAD || !pfd[i].revents) continue;
+        if (c->state == WS_CONNECTING) {
+            if (send(c->fd, hs, hs_len, 0) != (ssize_t)hs_len) { ws_kill(c); continue; }
+            c->state = WS_HANDSHAKE;
+            continue;
+        }
+        unsigned char buf[16384];
+        ssize_t r = recv(c->fd, buf, sizeof(buf), 0);
+        if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) { ws_kill(c); continue; }
+        if (r < 0) continue;
+        ws_buf_append(c, buf, (size_t)r);
+        if (c->state == WS_HANDSHAKE) {
+            unsigned char *end = NULL;
+            for (size_t k = 0; k + 3 < c->len; k++)
+                if (memcmp(c->buf + k, "\r\n\r\n", 4) == 0) { end = c->buf + k + 4; break; }
+            if (!end) continue;
+            if (c->len < 12 || memcmp(c->buf, "HTTP/1.1 101", 12) != 0) { ws_kill(c); continue; }
+            size_t hl = (size_t)(end - c->buf);
+            memmove(c->buf, end, c->len - hl);
+            c->len -= hl;
+            c->state = WS_OPEN;
+        }
+        if (c->state == WS_OPEN) ws_consume(c, lat);
+    }
+    return ready;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-p port] [-r requests] [-k concurrency] [-c ws_clients] "
+                    "[-n messages] [-m msgs_per_sec] [-o results.json]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    int requests = 2000, conc = 8, clients = 500, messages = 200, rate = 100;
+    const char *out_path = "loadgen.json";
+    int opt;
+    while ((opt = getopt(argc, argv, "p:r:k:c:n:m:o:h")) != -1) {
+        switch (opt) {
+        case 'p': g_port = atoi(optarg); break;
+        case 'r': requests = atoi(optarg); break;
+        case 'k': conc = atoi(optarg); break;
+        case 'c': clients = atoi(optarg); break;
+        case 'n': messages = atoi(optarg); break;
+        case 'm': rate = atoi(optarg); break;
+        case 'o': out_path = optarg; break;
+        default: usage(argv[0]); return 2;
+        }
+    }
+    if (requests < 1 || conc < 1 || clients < 1 || messages < 0 || rate < 1) { usage(argv[0]); return 2; }
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    char user[32];
+    snprintf(user, sizeof(user), "bench%ld", (long)getpid());
+    if (login(user, "benchpassword") < 0) {
+        fprintf(stderr, "could not register/login on port %d (server running? rate limited?)\n", g_port);
+        return 1;
+    }
+
+    strbuf sb; sb_init(&sb, 4096);
+    jsonw w; jw_init(&w, &sb);
+    jw_object_begin(&w);
+    jw_key(&w, "config");
+    jw_object_begin(&w);
+    jw_key(&w, "port"); jw_int(&w, g_port);
+    jw_key(&w, "requests"); jw_int(&w, requests);
+    jw_key(&w, "concurrency"); jw_int(&w, conc);
+    jw_key(&w, "ws_clients"); jw_int(&w, clients);
+    jw_key(&w, "messages"); jw_int(&w, messages);
+    jw_key(&w, "msgs_per_sec"); jw_int(&w, rate);
+    jw_object_end(&w);
+
+    /* HTTP endpoints */
+    static const char *paths[] = { "/", "/static/app.js", "/stats", "/me" };
+    jw_key(&w, "http");
+    jw_object_begin(&w);
+    for (size_t p = 0; p < sizeof(paths) / sizeof(paths[0]); p++) {
+        http_result res;
+        memset(&res, 0, sizeof(res));
+        res.path = paths[p];
+        run_http(&res, requests, conc);
+        double rps = res.seconds > 0 ? res.ok / res.seconds : 0;
+        jw_key(&w, paths[p]);
+        jw_object_begin(&w);
+        jw_key(&w, "ok"); jw_int(&w, res.ok);
+        jw_key(&w, "errors"); jw_int(&w, res.errors);
+        jw_key(&w, "requests_per_sec"); jw_double(&w, rps);
+        jw_latency(&w, &res.lat);
+        jw_object_end(&w);
+        printf("GET %-16s %6d ok %4d err %9.0f req/s  p50 %.3f ms  p99 %.3f ms\n",
+               paths[p], res.ok, res.errors, rps, pct_ms(&res.lat, 0.5), pct_ms(&res.lat, 0.99));
+        free(res.lat.v);
+    }
+    jw_object_end(&w);
+
+    /* WebSocket connection capacity */
+    char hs[768];
+    int hs_len = snprintf(hs, sizeof(hs),
+        "GET /ws HTTP/1.1\r\nHost: 127.0.0.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n"
+        "Cookie: sid=%s\r\n\r\n", g_sid);
+    wsclient *cl = (wsclient*)calloc((size_t)clients, sizeof(wsclient));
+    struct pollfd *pfd = (struct pollfd*)calloc((size_t)clients, sizeof(struct pollfd));
+    samples lat;
+    memset(&lat, 0, sizeof(lat));
+    uint64_t t_open = now_ns();
+    int opened = 0, pending = 0;
+    for (int i = 0; i < clients; i++) {
+        cl[i].fd = tcp_connect(1);
+        cl[i].state = cl[i].fd < 0 ? WS_DEAD : WS_CONNECTING;
+        /* keep the server's accept backlog from overflowing */
+        if (++pending == 16 || i == clients - 1) {
+            while (ws_poll(cl, pfd, i + 1, hs, (size_t)hs_len, &lat, 2000) > 0) {
+                int busy = 0;
+                for (int k = 0; k <= i; k++) busy += cl[k].state == WS_CONNECTING || cl[k].state == WS_HANDSHAKE;
+                if (!busy) break;
+            }
+            pending = 0;
+        }
+    }
+    for (int i = 0; i < clients; i++) opened += cl[i].state == WS_OPEN;
+    double open_s = (double)(now_ns() - t_open) / 1e9;
+    printf("WebSocket: %d/%d clients connected in %.2f s\n", opened, clients, open_s);
+    jw_key(&w, "websocket");
+    jw_object_begin(&w);
+    jw_key(&w, "requested"); jw_int(&w, clients);
+    jw_key(&w, "connected"); jw_int(&w, opened);
+    jw_key(&w, "connect_seconds"); jw_double(&w, open_s);
+    jw_object_end(&w);
+
+    /* broadcast latency: client 0 talks, everyone listens (including itself) */
+    int sender = -1;
+    for (int i = 0; i < clients; i++) if (cl[i].state == WS_OPEN) { sender = i; break; }
+    long sent = 0;
+    uint64_t t_bc = now_ns(), last_progress = t_bc;
+    if (sender >= 0 && messages > 0) {
+        uint64_t interval = 1000000000ULL / (uint64_t)rate, next = t_bc;
+        long expected = 0, delivered = 0;
+        for (;;) {
+            uint64_t now = now_ns();
+            if (sent < messages && now >= next) {
+                char msg[64];
+                int n = snprintf(msg, sizeof(msg), "bench:%ld:%llu", sent, (unsigned long long)now_ns());
+                if (ws_send_masked(cl[sender].fd, msg, (size_t)n) == 0) sent++;
+                else break;
+                next += interval;
+            }
+            int live = 0;
+            for (int i = 0; i < clients; i++) live += cl[i].state == WS_OPEN;
+            expected = sent * live;
+            long before = delivered;
+            ws_poll(cl, pfd, clients, hs, (size_t)hs_len, &lat, 5);
+            delivered = 0;
+            for (int i = 0; i < clients; i++) delivered += cl[i].deliveries;
+            if (delivered != before) last_progress = now_ns();
+            if (sent == messages && delivered >= expected) break;
+            if (sent == messages && now_ns() - last_progress > 5000000000ULL) break;
+        }
+        last_progress = now_ns();
+    }
+    double bc_s = (double)(last_progress - t_bc) / 1e9;
+    long delivered = 0;
+    int live = 0;
+    for (int i = 0; i < clients; i++) { delivered += cl[i].deliveries; live += cl[i].state == WS_OPEN; }
+    double dps = bc_s > 0 ? delivered / bc_s : 0;
+    jw_key(&w, "broadcast");
+    jw_object_begin(&w);
+    jw_key(&w, "sent"); jw_int(&w, sent);
+    jw_key(&w, "receivers"); jw_int(&w, live);
+    jw_key(&w, "expected"); jw_int(&w, sent * live);
+    jw_key(&w, "delivered"); jw_int(&w, delivered);
+    jw_key(&w, "seconds"); jw_double(&w, bc_s);
+    jw_key(&w, "messages_per_sec"); jw_double(&w, bc_s > 0 ? sent / bc_s : 0);
+    jw_key(&w, "deliveries_per_sec"); jw_double(&w, dps);
+    jw_latency(&w, &lat);
+    jw_object_end(&w);
+    jw_object_end(&w);
+    printf("Broadcast: %ld msgs -> %ld/%ld deliveries, %.0f deliveries/s  p50 %.3f ms  p99 %.3f ms\n",
+           sent, delivered, sent * live, dps, pct_ms(&lat, 0.5), pct_ms(&lat, 0.99));
+
+    for (int i = 0; i < clients; i++) { if (cl[i].fd >= 0) close(cl[i].fd); free(cl[i].buf); }
+    free(cl);
+    free(pfd);
+    free(lat.v);
+
+    int rc = 0;
+    sb_putc(&sb, '\n');
+    FILE *f = fopen(out_path, "w");
+    if (!f || sb.failed || fwrite(sb.data, 1, sb.len, f) != sb.len) {
+        fprintf(stderr, "failed to write %s\n", out_path);
+        rc = 1;
+    } else {
+        printf("results written to %s\n", out_path);
+    }
+    if (f) fclose(f);
+    sb_free(&sb);
+    return rc;
+}
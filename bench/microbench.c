@@ -0,0 +1,314 @@
+/* Micro-benchmarks for the request-path hot spots, linked against the server
+   objects so what is measured is exactly what ships:
+
+     HTTP parsing     parse_http_request, get_header_value, get_cookie_value, form_get_kv
+     WebSocket        ws_read_text (framing + unmasking), compute_ws_accept
+     codecs           base64_encode (every implementation), json_message
+     message log      msglog_append, msglog_read (newest page, older page)
+
+   Each case is warmed up, then timed in REPS batches of ~20ms. The median
+   batch is reported with the spread of the middle half, plus cycles/op and
+   bytes/cycle from the TSC where available (x86). The TSC ticks at a fixed
+   rate, so with turbo enabled cycles are approximate.
+
+   Build with `make bench`, run ./bench/microbench [filter]. */
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+static inline uint64_t cycles(void) { return __rdtsc(); }
+#else
+#define HAVE_TSC 0
+static inline uint64_t cycles(void) { return 0; }
+#endif
+
+#include "auth.h"
+#include "base64.h"
+#include "http.h"
+#include "json.h"
+#include "msglog.h"
+#include "util.h"
+#include "websocket.h"
+
+#define REPS 15
+#define BATCH_NS 20000000ULL
+#define WARMUP_NS 100000000ULL
+
+/* keeps the optimizer from discarding results */
+static volatile uint64_t g_sink;
+
+typedef void (*bench_fn)(void *ctx);
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run(const char *filter, const char *name, size_t bytes, bench_fn fn, void *ctx) {
+    if (filter && !strstr(name, filter)) return;
+
+    /* warm-up doubles as calibration of the batch size */
+    uint64_t iters = 1, t0 = now_ns(), elapsed = 0;
+    while ((elapsed = now_ns() - t0) < WARMUP_NS) {
+        uint64_t b0 = now_ns();
+        for (uint64_t i = 0; i < iters; i++) fn(ctx);
+        if (now_ns() - b0 < BATCH_NS / 4) iters *= 2;
+    }
+    uint64_t b0 = now_ns();
+    for (uint64_t i = 0; i < iters; i++) fn(ctx);
+    uint64_t per = now_ns() - b0;
+    if (per) iters = iters * BATCH_NS / per;
+    if (iters < 1) iters = 1;
+
+    double ns[REPS], cyc[REPS];
+    for (int r = 0; r < REPS; r++) {
+        uint64_t c0 = cycles(), n0 = now_ns();
+        for (uint64_t i = 0; i < iters; i++) fn(ctx);
+        uint64_t n1 = now_ns(), c1 = cycles();
+        ns[r] = (double)(n1 - n0) / (double)iters;
+        cyc[r] = (double)(c1 - c0) / (double)iters;
+    }
+    qsort(ns, REPS, sizeof(double), cmp_double);
+    qsort(cyc, REPS, sizeof(double), cmp_double);
+    double med = ns[REPS / 2];
+    double iqr = ns[3 * REPS / 4] - ns[REPS / 4];
+    double cmed = cyc[REPS / 2];
+
+    printf("%-34s %10.1f ns/op  +/-%5.1f%%", name, med, med > 0 ? 50.0 * iqr / med : 0.0);
+    if (HAVE_TSC) {
+        printf("  %9.1f cyc/op", cmed);
+        if (bytes) printf("  %6.3f B/cyc", (double)bytes / cmed);
+    } else if (bytes) {
+        printf("  %8.1f MB/s", (double)bytes / med * 1e3);
+    }
+    printf("\n");
+}
+
+/* ---- HTTP parsing ---- */
+
+static const char REQUEST[] =
+    "GET /messages?before=1200&limit=50 HTTP/1.1\r\n"
+    "Host: 127.0.0.1:8081\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: theme=dark; lang=en; sid=q1Wv2b7nYk0cR5t8aZ3xL9mP4sD6fH1jK2gU7eB0oI4\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "\r\n";
+
+static const char FORM[] = "username=alice_w&password=correct%20horse%20battery&remember=1";
+
+static void b_parse_request(void *ctx) {
+    char *buf = (char*)ctx;
+    memcpy(buf, REQUEST, sizeof(REQUEST));   /* parsing is destructive */
+    char *m, *p, *k;
+    g_sink += (uint64_t)parse_http_request(buf, &m, &p, &k);
+}
+
+static void b_header(void *ctx) {
+    char out[256];
+    (void)ctx;
+    g_sink += (uint64_t)get_header_value(REQUEST, "Sec-Fetch-Dest", out, sizeof(out));
+}
+
+static void b_cookie(void *ctx) {
+    char out[256];
+    (void)ctx;
+    g_sink += (uint64_t)get_cookie_value(REQUEST, "sid", out, sizeof(out));
+}
+
+static void b_form(void *ctx) {
+    char out[256];
+    (void)ctx;
+    g_sink += (uint64_t)form_get_kv(FORM, "password", out, sizeof(out));
+}
+
+/* ---- WebSocket ---- */
+
+typedef struct {
+    int sv[2];
+    unsigned char frame[16 + 4096];
+    size_t frame_len;
+    ws_rx rx;
+    ws_tx tx;
+} ws_ctx;
+
+static void ws_ctx_init(ws_ctx *c, size_t payload) {
+    static const unsigned char mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+    size_t o = 0;
+    c->frame[o++] = 0x81;
+    if (payload < 126) {
+        c->frame[o++] = 0x80 | (unsigned char)payload;
+    } else {
+        c->frame[o++] = 0x80 | 126;
+        c->frame[o++] = (unsigned char)(payload >> 8);
+        c->frame[o++] = (unsigned char)payload;
+    }
+    memcpy(c->frame + o, mask, 4);
+    o += 4;
+    for (size_t i = 0; i < payload; i++) c->frame[o + i] = (unsigned char)('a' + i % 26) ^ mask[i & 3];
+    c->frame_len = o + payload;
+    memset(&c->rx, 0, sizeof(c->rx));
+    memset(&c->tx, 0, sizeof(c->tx));
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, c->sv) < 0) { perror("socketpair"); exit(1); }
+    /* ws_read_text drains until EAGAIN, like it does on a client socket */
+    fcntl(c->sv[1], F_SETFL, fcntl(c->sv[1], F_GETFL) | O_NONBLOCK);
+}
+
+/* includes the write() that feeds the frame in, measured separately below */
+static void b_ws_read(void *ctx) {
+    ws_ctx *c = (ws_ctx*)ctx;
+    if (write(c->sv[0], c->frame, c->frame_len) < 0) return;
+    unsigned char *msg = NULL;
+    size_t len = 0;
+    while (ws_read_text(c->sv[1], &c->rx, &c->tx, &msg, &len) == 1) g_sink += msg[len / 2];
+}
+
+static void b_socketpair_only(void *ctx) {
+    ws_ctx *c = (ws_ctx*)ctx;
+    unsigned char tmp[16 + 4096];
+    if (write(c->sv[0], c->frame, c->frame_len) < 0) return;
+    g_sink += (uint64_t)recv(c->sv[1], tmp, c->frame_len, 0);
+}
+
+static void b_ws_accept(void *ctx) {
+    char out[64];
+    (void)ctx;
+    compute_ws_accept("dGhlIHNhbXBsZSBub25jZQ==", out);
+    g_sink += (unsigned char)out[0];
+}
+
+/* ---- codecs ---- */
+
+typedef struct {
+    unsigned char *in;
+    size_t len;
+    char *out;
+} b64_ctx;
+
+static void b_base64(void *ctx) {
+    b64_ctx *c = (b64_ctx*)ctx;
+    g_sink += base64_encode(c->in, c->len, c->out);
+}
+
+typedef struct {
+    strbuf sb;
+    jsonw w;
+    const char *content;
+} json_ctx;
+
+static void b_json_message(void *ctx) {
+    json_ctx *c = (json_ctx*)ctx;
+    sb_reset(&c->sb);
+    jw_init(&c->w, &c->sb);
+    json_message(&c->w, 123456, "alice", c->content, 1700000000);
+    g_sink += c->sb.len;
+}
+
+/* ---- message log ---- */
+
+typedef struct {
+    long next_id;
+    long before;
+    const char *content;
+} log_ctx;
+
+static void b_msglog_append(void *ctx) {
+    log_ctx *c = (log_ctx*)ctx;
+    g_sink += (uint64_t)msglog_append(c->next_id, 1, "alice", c->content, 1700000000 + c->next_id / 1000);
+    c->next_id++;
+}
+
+static void count_row(long id, const char *username, const char *content, long ts, void *userdata) {
+    (void)username; (void)ts;
+    *(uint64_t*)userdata += (uint64_t)id + (unsigned char)content[0];
+}
+
+static void b_msglog_read(void *ctx) {
+    log_ctx *c = (log_ctx*)ctx;
+    uint64_t sum = 0;
+    msglog_read(c->before, 0, 100, count_row, &sum);
+    g_sink += sum;
+}
+
+int main(int argc, char **argv) {
+    const char *filter = argc > 1 ? argv[1] : NULL;
+    char reqbuf[sizeof(REQUEST)];
+
+    printf("%-34s %10s %13s %15s\n", "case", "median", "spread(IQR)", HAVE_TSC ? "TSC" : "");
+    run(filter, "parse_http_request (copy+parse)", sizeof(REQUEST) - 1, b_parse_request, reqbuf);
+    run(filter, "get_header_value (last header)", sizeof(REQUEST) - 1, b_header, NULL);
+    run(filter, "get_cookie_value sid", sizeof(REQUEST) - 1, b_cookie, NULL);
+    run(filter, "form_get_kv password", sizeof(FORM) - 1, b_form, NULL);
+
+    size_t ws_sizes[] = { 64, 1024, 4096 };
+    for (size_t i = 0; i < sizeof(ws_sizes) / sizeof(ws_sizes[0]); i++) {
+        ws_ctx c;
+        char name[64];
+        ws_ctx_init(&c, ws_sizes[i]);
+        snprintf(name, sizeof(name), "socketpair write+recv %zuB", ws_sizes[i]);
+        run(filter, name, c.frame_len, b_socketpair_only, &c);
+        snprintf(name, sizeof(name), "ws_read_text %zuB (+write)", ws_sizes[i]);
+        run(filter, name, c.frame_len, b_ws_read, &c);
+        ws_rx_free(&c.rx);
+        ws_tx_free(&c.tx);
+        close(c.sv[0]);
+        close(c.sv[1]);
+    }
+    run(filter, "compute_ws_accept", 0, b_ws_accept, NULL);
+
+    const char *impls[] = { "scalar", "ssse3", "avx2" };
+    const char *def = base64_impl();
+    size_t b64_sizes[] = { 32, 4096 };
+    for (size_t s = 0; s < sizeof(b64_sizes) / sizeof(b64_sizes[0]); s++) {
+        b64_ctx c;
+        c.len = b64_sizes[s];
+        c.in = (unsigned char*)malloc(c.len);
+        c.out = (char*)malloc(BASE64_ENCODED_LEN(c.len) + 1);
+        for (size_t i = 0; i < c.len; i++) c.in[i] = (unsigned char)(i * 131 + 7);
+        for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+            if (base64_use_impl(impls[k]) != 0) continue;
+            char name[64];
+            snprintf(name, sizeof(name), "base64_encode %zuB %s", c.len, impls[k]);
+            run(filter, name, c.len, b_base64, &c);
+        }
+        free(c.in);
+        free(c.out);
+    }
+    base64_use_impl(def);
+
+    json_ctx jc;
+    sb_init(&jc.sb, 8192);
+    jc.content = "hey, is anyone around to review the metrics patch before lunch?";
+    run(filter, "json_message plain 64B", strlen(jc.content), b_json_message, &jc);
+    jc.content = "line one\nline \"two\" with a \\ backslash\tand a tab, then more plain text "
+                 "to make the run long enough that escapes are the exception, not the rule.";
+    run(filter, "json_message escapes 150B", strlen(jc.content), b_json_message, &jc);
+    sb_free(&jc.sb);
+
+    char dir[] = "/tmp/microbench-msglog-XXXXXX";
+    if (mkdtemp(dir) && msglog_open(dir, (size_t)64 << 20, 0, 0) >= 0) {
+        log_ctx lc = { 1, 0, "hey, is anyone around to review the metrics patch before lunch?" };
+        run(filter, "msglog_append 64B", strlen(lc.content), b_msglog_append, &lc);
+        lc.before = 0;
+        run(filter, "msglog_read newest 100", 0, b_msglog_read, &lc);
+        lc.before = lc.next_id / 2;
+        run(filter, "msglog_read before=mid 100", 0, b_msglog_read, &lc);
+        msglog_close();
+        char cmd[64];
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+        if (system(cmd) != 0) fprintf(stderr, "could not remove %s\n", dir);
+    }
+    return 0;
+}
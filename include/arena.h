@@ -0,0 +1,24 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* Bump allocator for per-request scratch memory. Allocations are never
+   freed individually; arena_reset() releases everything at once and keeps
+   the first chunk, so steady-state requests do not touch malloc at all.
+   Requests larger than a chunk get a dedicated chunk freed on reset. */
+
+typedef struct arena_chunk arena_chunk;
+
+typedef struct {
+    arena_chunk *head;     /* newest chunk; the first chunk is last in the list */
+    size_t chunk_size;
+} arena;
+
+void arena_init(arena *a, size_t chunk_size);
+/* 16-byte aligned; returns NULL if out of memory */
+void *arena_alloc(arena *a, size_t n);
+void arena_reset(arena *a);
+void arena_free(arena *a);
+
+#endif
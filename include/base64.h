@@ -3,8 +3,25 @@
 
 #include <stddef.h>
 
-// Base64 encoding function
+// flags for base64_encode_ex / base64_decode
+#define BASE64_URL   1  // '-' and '_' instead of '+' and '/'
+#define BASE64_NOPAD 2  // no '=' padding (and reject it when decoding)
+
+// output sizes (encoded length excludes the terminating NUL)
+#define BASE64_ENCODED_LEN(n) ((((n) + 2) / 3) * 4)
+#define BASE64_DECODED_MAX(n) (((n) / 4) * 3 + 2)
+
+// Base64 encoding function (standard alphabet, padded, no NUL written)
 size_t base64_encode(const unsigned char *input, size_t input_len, char *out);
+size_t base64_encode_ex(const unsigned char *input, size_t input_len, char *out, int flags);
 
-#endif // BASE64_H
+// Strict decoder: rejects characters outside the alphabet, misplaced or missing
+// padding and non-zero trailing bits. Returns the decoded length, or -1.
+long base64_decode(const char *in, size_t in_len, unsigned char *out, size_t out_cap, int flags);
 
+// Implementation picked at startup from CPU features: "avx2", "ssse3" or "scalar"
+const char *base64_impl(void);
+// Forces a slower implementation (for benchmarks); returns 0 if it is available
+int base64_use_impl(const char *name);
+
+#endif // BASE64_H
@@ -0,0 +1,23 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+
+/* Free list of fixed-size buffers. Not thread-safe: each pool belongs to
+   one thread (the event loop). Up to max_free idle buffers are kept;
+   beyond that they go back to malloc. */
+
+typedef struct {
+    size_t size;
+    void *free_list;
+    size_t nfree;
+    size_t max_free;
+} bufpool;
+
+void bufpool_init(bufpool *p, size_t size, size_t max_free);
+/* returns a buffer of p->size bytes, or NULL if out of memory */
+void *bufpool_get(bufpool *p);
+void bufpool_put(bufpool *p, void *buf);
+void bufpool_destroy(bufpool *p);
+
+#endif
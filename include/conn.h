@@ -0,0 +1,75 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/select.h>
+
+#include "export.h"
+#include "metrics.h"
+#include "trace.h"
+#include "websocket.h"
+
+/* Connection registry owned by the event loop (not thread-safe).
+   Slots come from a free list, open connections sit in a dense list for
+   the select() loop, and WebSocket and SSE subscribers each sit in their
+   own dense member list, so accept, close, broadcast and the online count
+   never scan the whole table. Work that outlives the event-loop iteration holds a
+   conn_handle instead of a pointer: the handle carries the slot's
+   generation and stops resolving once the slot is reused. */
+
+#define CONN_MAX FD_SETSIZE
+
+/* CONN_BUSY: waiting on a worker-pool job, not polled for input;
+   CONN_SSE: subscribed to GET /events, only written to;
+   CONN_EXPORT: streaming GET /messages/export, polled for writability */
+typedef enum { CONN_HTTP=0, CONN_WS=1, CONN_BUSY=2, CONN_SSE=3, CONN_EXPORT=4 } ConnType;
+
+typedef struct {
+    int fd;
+    ConnType type;
+    int user_id;              /* for WS */
+    char username[33];        /* for WS */
+    char ip[INET6_ADDRSTRLEN]; /* peer address captured at accept() */
+    metrics_route route;      /* ROUTE_COUNT until a request has been read */
+    trace tr;                 /* request phases; tr.start is when it arrived */
+    char method[8];           /* request line, for the access log */
+    char path[128];
+    ws_rx rx;                 /* WS receive buffer (pooled) */
+    ws_tx tx;                 /* WS frames the socket has not taken yet */
+    export_stream *exp;       /* for CONN_EXPORT */
+    uint64_t io_ns;           /* export: when the socket last took data */
+    /* registry bookkeeping */
+    uint16_t gen;
+    int live_idx;
+    int member_idx;           /* position in the WS or SSE list, -1 if neither */
+} Conn;
+
+/* slot index in the low 16 bits, generation above; 0 is never valid */
+typedef uint32_t conn_handle;
+
+void conn_registry_init(void);
+
+/* takes a free slot for fd and resets it to a fresh HTTP connection;
+   NULL when all CONN_MAX slots are in use */
+Conn *conn_open(int fd);
+/* returns the slot to the free list; the caller closes the fd */
+void conn_release(Conn *c);
+
+/* add c to the WebSocket / SSE member list and set its type to match */
+void conn_ws_join(Conn *c);
+void conn_sse_join(Conn *c);
+
+conn_handle conn_handle_of(const Conn *c);
+/* NULL if the connection behind h has been released since */
+Conn *conn_lookup(conn_handle h);
+
+/* dense lists; safe to release entry i while walking from the end */
+int conn_live_count(void);
+Conn *conn_live_at(int i);
+int conn_ws_count(void);
+Conn *conn_ws_at(int i);
+int conn_sse_count(void);
+Conn *conn_sse_at(int i);
+
+#endif
@@ -5,16 +5,66 @@
 
 int db_init(const char *db_path);
 void db_close(void);
+
+/* opens n read-only connections (at most DB_READERS_MAX) for the lookup and
+   history reads below made off the event loop; with WAL they run alongside
+   the single writer, and a thread that finds all of them busy waits for
+   one. The thread that called db_init always reads through the writer
+   connection, so it never waits. Returns 0 or -1 */
+#define DB_READERS_MAX 16
+int db_open_readers(int n);
+/* whether db_get_messages / db_search_messages may be called off the event
+   loop: there are readers and messages are not in the log */
+int db_messages_threadsafe(void);
+// users are served from an in-memory directory (userdir.h) loaded by db_init
+/* returns 0, -2 if the name is taken, -1 on error */
 int db_create_user(const char *username, const char *password_hash);
 int db_get_user_by_username(const char *username, int*user_id, char *password_hash_out, size_t out_sz);
+/* 1 if a user has exactly this name, else 0 */
+int db_user_exists(const char *username);
+/* other instances register users in the same database: a directory miss
+   is then looked up in the users table (and the user added) instead of
+   being final */
+void db_share_users(void);
 int db_create_session(const char *sid, int user_id, long expires_at);
 int db_get_session_user(const char *sid, int *user_id);
 int db_delete_session(const char *sid);
+
+// background thread that deletes expired sessions in batches
+int db_start_session_sweeper(int interval_sec);
+void db_stop_session_sweeper(void);
 int db_get_username_by_id(int user_id, char *out, size_t out_sz);
 
 // message history
-int db_save_message(int user_id, const char *username, const char *content);
-int db_get_messages(int limit, void (*callback)(const char*, const char*, long, void*), void *userdata);
+/* moves message storage from the messages table to the segmented log in
+   dir (see msglog.h); a new log starts with a copy of the table. Call
+   after db_init; returns 0 or -1 */
+int db_use_message_log(const char *dir, size_t segment_bytes, long retain_sec, size_t retain_bytes);
+/* graceful restart: syncs and closes the log for the process taking over;
+   saving and reading messages fails afterwards */
+void db_release_message_log(void);
+typedef void (*db_message_cb)(long id, const char *username, const char *content, long ts, void *userdata);
+/* returns the new message id, or -1 */
+long db_save_message(int user_id, const char *username, const char *content, long created_at);
+/* keyset pagination on messages.id: before_id > 0 pages backwards (newest first),
+   after_id > 0 pages forwards (oldest first), neither returns the newest page */
+int db_get_messages(long before_id, long after_id, int limit, db_message_cb callback, void *userdata);
+/* newest stored message id, 0 if there are none, -1 on error */
+long db_last_message_id(void);
+/* full-text search ranked by bm25, best match first, over the newest 5000
+   matches; text is plain words (a trailing * on a word matches prefixes).
+   Returns the row count, -1 on error, -2 if SQLite was built without FTS5
+   or messages are in the log */
+int db_search_messages(const char *text, int offset, int limit, db_message_cb callback, void *userdata);
+
+/* cursor over every message stamped in [from_ts, to_ts), oldest first;
+   to_ts 0 means no upper bound. With SQLite it reads a snapshot on a
+   separate read-only connection. */
+typedef struct db_export db_export;
+db_export *db_export_open(long from_ts, long to_ts);
+/* calls callback for the next message: 1, 0 at the end, -1 on error */
+int db_export_next(db_export *x, db_message_cb callback, void *userdata);
+void db_export_close(db_export *x);
 
 // stats
 int db_get_user_count(void);
@@ -0,0 +1,36 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <stddef.h>
+
+/* Body of GET /messages/export: every message in a time range, streamed
+   as HTTP/1.1 chunks of about EXPORT_CHUNK bytes. A chunk is only read
+   from the database once the previous one has been taken by the socket,
+   so memory stays at one chunk (plus one message) per export however
+   many rows there are, and a slow client slows only its own export.
+
+   Formats:
+     ndjson  one JSON object per line, as in /messages
+     binary  "CHATEXP1", then per message: id (8 bytes), timestamp (8),
+             username length (1), content length (4), username, content;
+             integers little-endian */
+
+#define EXPORT_CHUNK (64 * 1024)
+
+typedef enum { EXPORT_NDJSON, EXPORT_BINARY } export_format;
+
+typedef struct export_stream export_stream;
+
+/* NULL if the database cursor cannot be opened */
+export_stream *export_open(long from_ts, long to_ts, export_format fmt);
+void export_close(export_stream *x);
+
+/* the bytes to send next, reading the next chunk when the last one has
+   been sent; *len is 0 once the terminating chunk is out. -1 on error */
+int export_pending(export_stream *x, const char **data, size_t *len);
+/* n bytes of what export_pending returned were sent */
+void export_consumed(export_stream *x, size_t n);
+/* messages read so far */
+long export_rows(const export_stream *x);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <sys/types.h>
+#include "conn.h"
+
+/* Graceful restart. On SIGHUP the running server starts a new copy of its
+   binary (the file at the path it was started from, so a deploy just
+   replaces that file), connected through a Unix datagram socket pair
+   passed as HANDOFF_FD. Over it:
+
+     old -> new   "L" + version, with the listening socket (SCM_RIGHTS)
+     new -> old   "R" once its database is open
+     old -> new   "C" + n + n records, with n connections, up to
+                  HANDOFF_BATCH per datagram; records are type (1),
+                  user id (4, little-endian), username (33), peer ip (46)
+     old -> new   "E" when done
+
+   Both processes hold the listening socket throughout, so the kernel
+   keeps queueing connections and none are refused. Idle connections
+   (HTTP requests not yet read, WebSockets with nothing buffered, SSE
+   subscribers) move to the new process; the old one finishes the rest
+   and exits. Event-loop only. */
+
+#define HANDOFF_VERSION 1
+#define HANDOFF_BATCH 16
+#define HANDOFF_TIMEOUT_SEC 5     /* for each send and receive on the socket pair */
+
+typedef struct {
+    int fd;
+    ConnType type;                /* CONN_HTTP, CONN_WS or CONN_SSE */
+    int user_id;
+    char username[33];
+    char ip[46];
+} handoff_conn;
+
+/* old process: starts argv[0] with the listening socket; returns the
+   control fd to watch for readiness, -1 on failure */
+int handoff_spawn(char **argv, int listen_fd, pid_t *pid);
+/* old process, when the control fd is readable: 1 if the new process is
+   ready, -1 otherwise. A datagram socket does not report the peer going
+   away, so the caller also watches for the process exiting. */
+int handoff_ready(int ctl);
+/* old process: hands over n (<= HANDOFF_BATCH) connections; 0 or -1.
+   The caller still closes its own copies. */
+int handoff_send(int ctl, const handoff_conn *conns, int n);
+int handoff_finish(int ctl);
+
+/* new process: returns the listening socket, -1 on failure */
+int handoff_take_listener(int ctl);
+/* new process: tells the old one to start handing over */
+int handoff_signal_ready(int ctl);
+/* new process: the next batch of connections; returns how many, 0 once
+   the old process has finished, -1 on error */
+int handoff_recv(int ctl, handoff_conn *out);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include "strbuf.h"
+
+/* Most recent chat messages, kept in memory so GET /messages does not hit
+   SQLite. A fixed-size ring of messages already serialized to JSON, in id
+   order; everything newer than the last evicted id is in the ring. The
+   newest page is cached as a complete response body and rebuilt from the
+   serialized messages, without escaping again, after each append.
+   Event-loop only (not thread-safe). */
+
+#define HISTORY_DEFAULT_CAP 1024
+#define HISTORY_PAGE_MAX 100
+
+/* allocates the ring and seeds it from the database; returns 0 or -1 */
+int history_init(size_t capacity);
+void history_free(void);
+
+/* records a message that has just been stored; json is its json_message()
+   form, as broadcast. Ids are taken in increasing order only: an id that
+   is not newer than the last one is left out, and so is everything up to
+   it, since the ring can no longer vouch for that range. Resuming from any
+   id that was already out when it arrived is refused from then on
+   (history_since returns -1), as the client may have skipped it. */
+void history_append(long id, const char *json, size_t len);
+/* empties the ring when messages up to floor may be missing from it, so
+   reads that reach that far go to the database; LONG_MAX keeps everything
+   out until the next reset */
+void history_reset(long floor);
+
+typedef void (*history_cb)(const char *json, size_t len, void *userdata);
+/* calls cb for every message newer than after_id, oldest first, and returns
+   how many there were; -1 (without calling cb) if there are more than max,
+   some of them are no longer in the ring, or an older message arrived
+   after after_id had been sent */
+int history_since(long after_id, int max, history_cb cb, void *userdata);
+
+/* writes the GET /messages response body for this page into out, in the
+   same shape as the database path. Returns 1 if it was served from memory,
+   0 if the page reaches back past the ring (out is left untouched). */
+int history_page(long before_id, long after_id, int limit, strbuf *out);
+
+#endif
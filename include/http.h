@@ -9,6 +9,7 @@ extern const char *NOT_FOUND;
 /* new minimal responses */
 extern const char *UNAUTHORIZED;
 extern const char *NO_CONTENT;
+extern const char *SERVICE_UNAVAILABLE;
 
 /* HTTP request parsing */
 int parse_http_request(char *req, char **method, char **path, char **ws_key);
@@ -17,4 +18,7 @@ int parse_http_request(char *req, char **method, char **path, char **ws_key);
 int get_header_value(const char *req, const char *name, char *out, int out_sz);
 int get_content_length(const char *req);
 
+/* cuts "?query" off path in place; returns the query string or NULL */
+char *split_query(char *path);
+
 #endif
\ No newline at end of file
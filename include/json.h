@@ -0,0 +1,39 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <stddef.h>
+#include "strbuf.h"
+
+/* Streaming JSON writer on top of strbuf: commas and nesting are tracked here,
+   strings are escaped per RFC 8259 (quotes, backslash and all control bytes). */
+
+#define JSON_MAX_DEPTH 16
+
+typedef struct {
+    strbuf *out;
+    unsigned depth;
+    unsigned char has_items[JSON_MAX_DEPTH];
+    int after_key;
+} jsonw;
+
+void jw_init(jsonw *w, strbuf *out);
+void jw_object_begin(jsonw *w);
+void jw_object_end(jsonw *w);
+void jw_array_begin(jsonw *w);
+void jw_array_end(jsonw *w);
+void jw_key(jsonw *w, const char *key);
+void jw_string(jsonw *w, const char *s);
+void jw_string_n(jsonw *w, const char *s, size_t n);
+void jw_int(jsonw *w, long long v);
+void jw_bool(jsonw *w, int v);
+void jw_null(jsonw *w);
+/* already-serialized JSON value (e.g. a cached fragment) */
+void jw_raw(jsonw *w, const char *json, size_t n);
+
+/* escapes s into out without surrounding quotes */
+void json_escape(strbuf *out, const char *s, size_t n);
+
+/* {"id":..,"username":..,"content":..,"timestamp":..} */
+void json_message(jsonw *w, long id, const char *username, const char *content, long ts);
+
+#endif
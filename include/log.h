@@ -0,0 +1,40 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Asynchronous event/access log. Each thread formats records into its own
+   lock-free ring; a background thread drains all rings with batched writes
+   and rotates the file by size. A full ring drops the record (and counts it)
+   rather than blocking the caller.
+
+   Records are logfmt lines: ts=... level=... event=... key=value ... */
+
+typedef enum { LOG_DEBUG = 0, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_OFF } log_level;
+
+/* path NULL logs to stderr. rotate_bytes 0 disables rotation; keep is the
+   number of rotated files (path.1 .. path.keep). Also installs SIGUSR1
+   (more verbose) and SIGUSR2 (less verbose). Returns 0 on success. */
+int log_init(const char *path, size_t rotate_bytes, int keep);
+/* drains everything still buffered and stops the writer thread */
+void log_shutdown(void);
+
+void log_set_level(log_level lvl);
+log_level log_get_level(void);
+/* "debug", "info", "warn", "error" or "off"; returns -1 if unknown */
+int log_level_parse(const char *name);
+
+#define log_enabled(lvl) ((int)(lvl) >= (int)log_get_level())
+
+/* fmt continues the line after "event=<event> " */
+void log_event(log_level lvl, const char *event, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+/* one line per finished HTTP request */
+void log_access(const char *ip, const char *method, const char *path, int status,
+                size_t bytes, uint64_t dur_ns);
+
+/* records dropped because a ring was full */
+uint64_t log_dropped(void);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include "strbuf.h"
+
+/* Prometheus metrics. Every thread records into its own cache-line aligned
+   shard with plain relaxed stores, so recording is a few instructions and
+   never contends; /metrics sums the shards when it is scraped. */
+
+typedef enum {
+    ROUTE_INDEX, ROUTE_STATIC, ROUTE_ME, ROUTE_STATS, ROUTE_MESSAGES,
+    ROUTE_REGISTER, ROUTE_LOGIN, ROUTE_LOGOUT, ROUTE_WS, ROUTE_METRICS,
+    ROUTE_EVENTS, ROUTE_SEARCH, ROUTE_EXPORT, ROUTE_OTHER, ROUTE_COUNT
+} metrics_route;
+
+typedef enum {
+    DBOP_CREATE_USER, DBOP_GET_USER, DBOP_CREATE_SESSION, DBOP_GET_SESSION,
+    DBOP_DELETE_SESSION, DBOP_GET_USERNAME, DBOP_USER_COUNT, DBOP_SAVE_MESSAGE,
+    DBOP_GET_MESSAGES, DBOP_SEARCH_MESSAGES, DBOP_COUNT
+} metrics_dbop;
+
+typedef enum {
+    CTR_BYTES_IN, CTR_BYTES_OUT,
+    CTR_HTTP_ACTIVE, CTR_WS_ACTIVE, CTR_SSE_ACTIVE,   /* gauges: incremented and decremented */
+    CTR_WS_MESSAGES,
+    CTR_EXPORT_MESSAGES,
+    CTR_RELAY_SENT, CTR_RELAY_RECEIVED, CTR_RELAY_DROPPED,
+    CTR_OVERLOADED,                                   /* gauge, 0 or 1 */
+    CTR_SHED_HTTP, CTR_SHED_UPGRADE, CTR_SHED_ACCEPT,
+    CTR_LOGOUT_FAILED,
+    CTR_COUNT
+} metrics_counter;
+
+void metrics_add(metrics_counter c, int64_t v);
+void metrics_request(metrics_route r, uint64_t ns);
+void metrics_db(metrics_dbop op, uint64_t ns);
+void metrics_fanout(uint64_t ns);
+void metrics_pbkdf2_queue(uint64_t ns);
+void metrics_loop_turn(uint64_t ns);
+
+/* Prometheus text exposition format */
+void metrics_render(strbuf *out);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef MSGLOG_H
+#define MSGLOG_H
+
+#include <stddef.h>
+#include "db.h"
+
+/* Append-only message store, an alternative to the SQLite messages table
+   (MESSAGE_STORE=log). Messages go to memory-mapped segment files named
+   after the first id they hold; a full segment is sealed (trimmed, synced,
+   made read-only) and a new one started. Every record carries a CRC-32, so
+   a torn append is detected and cut off when the log is reopened. Each
+   segment keeps a sparse in-memory index of every INDEX_EVERY-th record
+   and its time bounds. Retention drops the oldest segments by age or total
+   size; a partly expired oldest segment is compacted by rewriting what is
+   left of it. Records are in the page cache as soon as they are appended,
+   so they survive a crash of the server; sealed segments and a clean
+   shutdown are synced to disk. Syncing sealed segments and compaction run
+   on a maintenance thread of the log's own; the calls below are event-loop
+   only (not thread-safe). */
+
+/* opens (or creates) the log in dir; segment_bytes is the size of one
+   segment file, retain_sec / retain_bytes limit the age and total size of
+   the log (0 for no limit). Returns 1 if the log was created, 0 if it
+   already existed, -1 on error. */
+int msglog_open(const char *dir, size_t segment_bytes, long retain_sec, size_t retain_bytes);
+void msglog_close(void);
+
+/* id must be greater than msglog_last_id(); returns 0 or -1 */
+int msglog_append(long id, int user_id, const char *username, const char *content, long ts);
+/* newest id ever appended, 0 for a new log */
+long msglog_last_id(void);
+
+/* same paging as db_get_messages; strings point into the mapping and are
+   valid until the next append */
+int msglog_read(long before_id, long after_id, int limit, db_message_cb callback, void *userdata);
+/* up to limit messages with ids >= first_id, oldest first */
+int msglog_read_from(long first_id, int limit, db_message_cb callback, void *userdata);
+/* id of the first message stamped ts or later, 0 if there is none */
+long msglog_first_id_at(long ts);
+
+#endif
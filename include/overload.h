@@ -0,0 +1,29 @@
+#ifndef OVERLOAD_H
+#define OVERLOAD_H
+
+#include <stdint.h>
+
+/* Overload detection for admission control. The event loop reports each
+   turn: how long handling its events took and how full the fullest worker
+   queue is. The server counts as overloaded once the moving average of
+   turn times reaches the lag limit or a queue is OVERLOAD_QUEUE_HIGH full,
+   and stays so for at least OVERLOAD_HOLD_MS and until both are back
+   under half, so the state does not flap. Event-loop only. */
+
+#define OVERLOAD_LAG_MS_DEFAULT 100
+#define OVERLOAD_QUEUE_HIGH 0.75
+#define OVERLOAD_HOLD_MS 1000
+
+/* lag_ms 0 turns detection off */
+void overload_configure(unsigned lag_ms);
+
+/* one loop turn; returns 1 while overloaded */
+int overload_update(uint64_t now, uint64_t turn_ns, double queue_fill);
+int overload_active(void);
+/* whether to take on a new request turn_ns into the current turn: always,
+   unless overloaded, and then only while the turn is within half the lag
+   limit, so the loop keeps doing as much work as it can without turns
+   growing long */
+int overload_admit(uint64_t turn_ns);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stddef.h>
+
+/* Token-bucket rate limiter keyed by arbitrary strings (client IP, username).
+   Buckets refill lazily when touched; the table has a fixed size and recycles
+   the stalest bucket in a probe window when it runs out of room. */
+
+typedef struct ratelimit ratelimit;
+
+ratelimit *ratelimit_create(size_t capacity, double rate_per_sec, double burst);
+void ratelimit_destroy(ratelimit *rl);
+
+/* takes one token; returns 0 if allowed, else whole seconds until the next token */
+int ratelimit_take(ratelimit *rl, const char *key);
+/* the same answer without taking a token, for charging only on failure */
+int ratelimit_peek(ratelimit *rl, const char *key);
+
+#endif
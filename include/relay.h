@@ -0,0 +1,60 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdint.h>
+#include "websocket.h"
+
+/* Chat relay between server instances (RELAY=unix:/path or RELAY=host:port).
+   Each instance keeps one connection to a hub (tools/relayhub), which
+   passes every frame on to all the other instances; an instance fans
+   relayed messages out to its own WebSocket clients and history ring.
+   A message is stored only by the instance that accepted it, so instances
+   are expected to share the database.
+
+   Frame, integers little-endian:
+     length (4)    bytes after this field
+     type (1)      RELAY_MSG
+     hops (1)      bumped by each hub; frames past RELAY_MAX_HOPS are dropped
+     origin (8)    id of the instance that accepted the message
+     seq (8)       per-origin sequence number, from 1
+     id (8), timestamp (8), username length (1), content length (4),
+     username, content
+
+   Frames from this instance's own origin, and seqs already seen from an
+   origin, are dropped, so a message is never looped back or shown twice,
+   whatever path it took. While the hub is unreachable messages are not
+   relayed, and the connection is retried every RELAY_RETRY_SEC. A message
+   that is not relayed (link down, queue full) still takes its seq, so the
+   others can tell that they missed something. Event-loop only (not
+   thread-safe). */
+
+#define RELAY_MSG 1
+#define RELAY_HDR 43                 /* length field through content length */
+#define RELAY_FRAME_MAX (RELAY_HDR + 255 + WS_MAX_FRAME)
+#define RELAY_MAX_HOPS 4
+#define RELAY_RETRY_SEC 2
+#define RELAY_OUT_MAX (4u << 20)     /* messages that would queue past this are dropped */
+
+typedef void (*relay_cb)(long id, const char *username, const char *content, long ts, void *userdata);
+
+/* starts connecting to addr in the background; -1 if addr is invalid */
+int relay_open(const char *addr);
+void relay_close(void);
+
+/* reconnects if it is time to; returns the fd to watch (-1 while down)
+   and sets *want_write while a connect or output is pending */
+int relay_prepare(int *want_write);
+/* handles readiness of that fd, calling cb for each message from another instance */
+void relay_io(int readable, int writable, relay_cb cb, void *userdata);
+
+/* queues a message this instance has just accepted for the others */
+void relay_publish(long id, const char *username, const char *content, long ts);
+
+/* 1 while the hub link is up */
+int relay_up(void);
+/* counts the points at which messages from the others may have been
+   missed: the link dropping or coming back, or an origin's seqs skipping.
+   Nothing arrives at all while the link is down. */
+uint64_t relay_gaps(void);
+
+#endif
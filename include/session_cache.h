@@ -0,0 +1,23 @@
+#ifndef SESSION_CACHE_H
+#define SESSION_CACHE_H
+
+#include <stddef.h>
+
+/* In-memory sid -> user_id cache sitting in front of the sessions table.
+   Open addressing with linear probing; safe to call from any thread. */
+
+int session_cache_init(size_t capacity);
+void session_cache_free(void);
+
+/* insert or refresh an entry; silently drops it if the table is full */
+void session_cache_put(const char *sid, int user_id, long expires_at);
+
+/* returns 1 on hit (sets *user_id), 0 on miss, -1 if cached but expired */
+int session_cache_get(const char *sid, int *user_id);
+
+void session_cache_remove(const char *sid);
+
+/* drop every entry with expires_at < now; returns how many were removed */
+size_t session_cache_evict_expired(long now);
+
+#endif
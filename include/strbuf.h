@@ -0,0 +1,39 @@
+#ifndef STRBUF_H
+#define STRBUF_H
+
+#include <stddef.h>
+
+/* Output buffer used by the JSON writer and text responses.
+   Growable mode reallocs as needed (sb_init_buf starts in borrowed memory); stream mode has a fixed buffer and hands
+   it to flush() whenever it fills up. Errors are sticky in `failed`. */
+
+typedef int (*sb_flush_fn)(void *ctx, const char *data, size_t len);
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    sb_flush_fn flush;   /* NULL in growable mode */
+    void *flush_ctx;
+    int owned;           /* data was malloc'd by us */
+    int failed;
+} strbuf;
+
+void sb_init(strbuf *sb, size_t initial_cap);
+/* growable, starting in caller-provided memory (e.g. an arena); moves to
+   the heap only if it outgrows it */
+void sb_init_buf(strbuf *sb, char *buf, size_t cap);
+void sb_init_stream(strbuf *sb, char *buf, size_t cap, sb_flush_fn flush, void *ctx);
+void sb_free(strbuf *sb);
+void sb_reset(strbuf *sb);
+
+/* makes room for at least n contiguous bytes at data + len; returns 0 on success */
+int sb_reserve(strbuf *sb, size_t n);
+void sb_append(strbuf *sb, const char *s, size_t n);
+void sb_puts(strbuf *sb, const char *s);
+void sb_putc(strbuf *sb, char c);
+void sb_printf(strbuf *sb, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+/* stream mode: pushes buffered bytes to flush(); returns 0 on success */
+int sb_flush(strbuf *sb);
+
+#endif
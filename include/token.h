@@ -0,0 +1,33 @@
+#ifndef TOKEN_H
+#define TOKEN_H
+
+#include <stddef.h>
+
+/* Stateless session tokens: "1.<kid>.<uid>.<exp>.<username>.<mac>" where mac is
+   base64url(HMAC-SHA256(key[kid], everything before the last '.')).
+   The first key added signs new tokens; the others are only accepted for
+   verification, which lets keys be rotated without logging everybody out. */
+
+#define TOKEN_MAX_KEYS 4
+#define TOKEN_MAX_LEN 160
+#define TOKEN_TTL_SEC (7 * 24 * 3600)   /* lifetime of issued tokens; revocations never outlive it */
+#define TOKEN_REVOKED_MAX (1u << 18)    /* revocation table slots, at most 3/4 used */
+
+/* spec is "kid:hexkey[,kid:hexkey...]"; returns number of keys loaded or -1 */
+int token_load_keys(const char *spec);
+/* adds a random signing key (tokens will not survive a restart); returns 0 on success */
+int token_generate_key(void);
+
+/* returns 0 on success */
+int token_issue(int user_id, const char *username, long expires_at, char *out, size_t out_sz);
+
+/* returns 1 if valid and unexpired (fills outputs; uname may be NULL), else 0 */
+int token_verify(const char *token, int *user_id, char *uname, size_t uname_sz);
+
+/* adds a valid token to the revocation list until it expires. Returns 0
+   once the token no longer verifies (tokens that already fail token_verify
+   count), -1 if it could not be stored because the list is full or out of
+   memory; the token then stays valid. */
+int token_revoke(const char *token);
+
+#endif
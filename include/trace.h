@@ -0,0 +1,47 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "util.h"
+
+/* Per-request phase timing. A trace is a start time plus accumulated
+   nanoseconds per phase; trace_phase() charges everything since the
+   previous mark to one phase, so a request costs one clock read per phase.
+   Requests over the slow threshold are logged with their breakdown
+   (event=slow_request); a 1-in-N sample of the rest is logged as event=trace. */
+
+typedef enum {
+    PH_READ, PH_PARSE, PH_AUTH, PH_DB, PH_QUEUE, PH_HASH, PH_BUILD, PH_SEND,
+    PH_DECODE, PH_PERSIST, PH_FANOUT,
+    PH_COUNT
+} trace_phase_id;
+
+typedef struct {
+    uint64_t start;
+    uint64_t mark;                /* end of the last charged phase */
+    uint64_t ns[PH_COUNT];
+} trace;
+
+/* TRACE_SLOW_MS (default 250, 0 disables) and TRACE_SAMPLE (log 1 in N, default 0 = off) */
+void trace_configure(uint64_t slow_ms, unsigned sample_every);
+
+static inline void trace_begin(trace *t) {
+    for (int i = 0; i < PH_COUNT; i++) t->ns[i] = 0;
+    t->start = t->mark = now_ns();
+}
+
+static inline void trace_phase(trace *t, trace_phase_id p) {
+    uint64_t now = now_ns();
+    t->ns[p] += now - t->mark;
+    t->mark = now;
+}
+
+/* charges an interval measured elsewhere (e.g. on a worker thread) */
+static inline void trace_add(trace *t, trace_phase_id p, uint64_t ns) {
+    t->ns[p] += ns;
+}
+
+/* closes the trace and logs it if it was slow or sampled */
+void trace_end(trace *t, const char *method, const char *path, int status);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef USERDIR_H
+#define USERDIR_H
+
+#include <stddef.h>
+
+/* In-memory copy of the users table: every user's id, name and password
+   hash, indexed by id and by name (two open-addressing tables
+   with linear probing over one dense array). Users are only ever added, so
+   there are no tombstones. Safe to call from any thread. */
+
+int userdir_init(void);
+void userdir_free(void);
+
+/* returns 0, -2 if the id or the name is already there, -1 if out of
+   memory. Names compare exactly, as users.username does in SQL. */
+int userdir_add(int id, const char *username, const char *password_hash);
+
+/* return 0 and fill the outputs (either may be NULL), or -1 if unknown */
+int userdir_find_name(const char *username, int *id, char *hash_out, size_t hash_sz);
+int userdir_find_id(int id, char *username_out, size_t out_sz);
+
+size_t userdir_count(void);
+
+#endif
@@ -3,10 +3,14 @@
 
 #include <fcntl.h>
 #include <signal.h>
+#include <stdint.h>
 
 // Nonblocking helper
 int set_nonblock(int fd);
 
+// Monotonic clock in nanoseconds, for measuring durations
+uint64_t now_ns(void);
+
 // Signal handling
 extern volatile sig_atomic_t g_stop;
 void on_sigint(int sig);
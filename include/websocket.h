@@ -7,11 +7,48 @@
 // WebSocket handshake
 void compute_ws_accept(const char *client_key, char *accept_out);
 
+#define WS_MAX_FRAME (1u << 20)   // larger frames close the connection
+#define WS_RX_POOL_BUF 4096       // pooled receive buffer; bigger frames use malloc
+
+// Per-connection receive buffer. Holds no memory while nothing is pending.
+typedef struct {
+	unsigned char *buf;
+	size_t len;
+	size_t cap;
+	size_t consumed;     // size of the frame returned by the last ws_read_text
+	unsigned char saved; // byte replaced by that frame's NUL terminator
+} ws_rx;
+
+// Per-connection send queue: whatever the socket could not take yet, sent in
+// order as it becomes writable. Holds no memory while empty.
+#define WS_TX_MAX (4u << 20)      // a client this far behind is disconnected
+typedef struct {
+	char *buf;
+	size_t len;
+	size_t cap;
+	size_t off;          // bytes of buf already sent
+} ws_tx;
+
 // WebSocket frame handling
 int ws_send_text(int fd, const char *msg, size_t len);
+
+/* Sends a text frame through tx: written straight away while nothing is
+   queued, the part the socket does not take is queued. Returns 0, or -1 on
+   a socket error or once more than WS_TX_MAX would be queued. Event loop only. */
+int ws_send_queued(int fd, ws_tx *tx, const char *msg, size_t len);
+/* sends what is queued; returns 1 while some is left, 0 once empty, -1 on error */
+int ws_tx_flush(int fd, ws_tx *tx);
+static inline int ws_tx_pending(const ws_tx *tx) { return tx->len > tx->off; }
+void ws_tx_free(ws_tx *tx);
 int ws_read_and_echo(int fd);
 
-int ws_read_text(int fd, unsigned char **out, size_t *len_out);
+/* Reads the next text frame, refilling rx from fd as needed. Returns 1 with
+   *out pointing into rx (unmasked, NUL-terminated, valid until the next call),
+   0 when more data is needed, -1 on close or error. Several frames may arrive
+   in one read, so call again until it stops returning 1. Pings are answered
+   through tx, the connection's send queue. Event loop only. */
+int ws_read_text(int fd, ws_rx *rx, ws_tx *tx, unsigned char **out, size_t *len_out);
+void ws_rx_free(ws_rx *rx);
 
 #endif // WEBSOCKET_H
 
@@ -0,0 +1,24 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+/* Bounded pool of worker threads for CPU-heavy jobs.
+   work() runs on a pool thread; done() runs on whichever thread calls
+   workpool_complete(), normally the event loop when notify_fd is readable. */
+
+typedef struct workpool workpool;
+typedef void (*work_fn)(void *arg);
+
+workpool *workpool_create(int nthreads, int max_queue);
+/* finishes queued jobs, joins threads, then runs remaining done() callbacks */
+void workpool_destroy(workpool *wp);
+
+/* returns 0 if queued, -1 if the queue is full or the pool is stopping */
+int workpool_submit(workpool *wp, work_fn work, work_fn done, void *arg);
+
+int workpool_notify_fd(const workpool *wp);
+/* runs done() for every finished job; returns how many completed */
+int workpool_complete(workpool *wp);
+/* jobs waiting for a thread (not counting ones already running) */
+int workpool_queue_depth(workpool *wp);
+
+#endif
@@ -0,0 +1,63 @@
+#include "arena.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+    arena_chunk *next;
+    size_t cap;
+    size_t used;
+    _Alignas(ARENA_ALIGN) unsigned char data[];
+};
+
+static arena_chunk *chunk_new(size_t cap, arena_chunk *next) {
+    arena_chunk *c = (arena_chunk*)malloc(sizeof(arena_chunk) + cap);
+    if (!c) return NULL;
+    c->next = next;
+    c->cap = cap;
+    c->used = 0;
+    return c;
+}
+
+void arena_init(arena *a, size_t chunk_size) {
+    a->head = NULL;
+    a->chunk_size = chunk_size;
+}
+
+void *arena_alloc(arena *a, size_t n) {
+    if (n > SIZE_MAX - ARENA_ALIGN) return NULL;
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    arena_chunk *c = a->head;
+    if (!c || c->cap - c->used < n) {
+        size_t cap = n > a->chunk_size ? n : a->chunk_size;
+        c = chunk_new(cap, a->head);
+        if (!c) return NULL;
+        a->head = c;
+    }
+    void *p = c->data + c->used;
+    c->used += n;
+    return p;
+}
+
+void arena_reset(arena *a) {
+    while (a->head && a->head->next) {
+        arena_chunk *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+    /* a lone oversized chunk is not worth keeping */
+    if (a->head && a->head->cap > a->chunk_size) {
+        free(a->head);
+        a->head = NULL;
+    }
+    if (a->head) a->head->used = 0;
+}
+
+void arena_free(arena *a) {
+    while (a->head) {
+        arena_chunk *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+}
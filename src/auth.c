@@ -17,25 +17,6 @@
 #include <openssl/rand.h>
 #endif
 
-static int b64url_from_bytes(const unsigned char *in, size_t in_len, char *out, size_t out_sz) {
-    /* Base64 URL-safe without padding. For 32 bytes input we need <= 44 chars. */
-    char tmp[64];
-    size_t n = base64_encode(in, in_len, tmp);
-    tmp[n] = '\0';
-    size_t o = 0;
-    for (size_t i = 0; i < n; i++) {
-        char c = tmp[i];
-        if (c == '+') c = '-';
-        else if (c == '/') c = '_';
-        else if (c == '=') continue; /* strip padding */
-        if (o + 1 >= out_sz) return -1;
-        out[o++] = c;
-    }
-    if (o >= out_sz) return -1;
-    out[o] = '\0';
-    return 0;
-}
-
 int validate_username(const char *username) {
     if (!username) return -1;
     size_t n = strlen(username);
@@ -65,7 +46,10 @@ static int random_bytes(unsigned char *buf, size_t len) {
 int generate_session_id(char *out, size_t out_sz) {
     unsigned char rnd[32];
     if (random_bytes(rnd, sizeof(rnd)) < 0) return -1;
-    return b64url_from_bytes(rnd, sizeof(rnd), out, out_sz);
+    if (out_sz < BASE64_ENCODED_LEN(sizeof(rnd)) + 1) return -1;
+    size_t n = base64_encode_ex(rnd, sizeof(rnd), out, BASE64_URL | BASE64_NOPAD);
+    out[n] = '\0';
+    return 0;
 }
 
 int hash_password_pbkdf2(const char *password, char *out, size_t out_sz) {
@@ -97,40 +81,6 @@ static int constant_time_eq(const unsigned char *a, const unsigned char *b, size
     return v == 0;
 }
 
-/* Simple base64 decoder for password verification */
-static int base64_decode_simple(const char *in, unsigned char *out, size_t outcap, size_t *outlen) {
-    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    static int inv_table[256];
-    static int table_initialized = 0;
-    
-    if (!table_initialized) {
-        for (int i = 0; i < 256; i++) inv_table[i] = -1;
-        for (int i = 0; i < 64; i++) inv_table[(unsigned char)table[i]] = i;
-        table_initialized = 1;
-    }
-    
-    size_t len = strlen(in);
-    size_t o = 0;
-    
-    for (size_t i = 0; i < len && o < outcap; i += 4) {
-        if (i + 3 >= len) break;
-        
-        int c1 = inv_table[(unsigned char)in[i]];
-        int c2 = inv_table[(unsigned char)in[i+1]];
-        int c3 = inv_table[(unsigned char)in[i+2]];
-        int c4 = inv_table[(unsigned char)in[i+3]];
-        
-        if (c1 < 0 || c2 < 0) break;
-        
-        if (o < outcap) out[o++] = (unsigned char)((c1 << 2) | (c2 >> 4));
-        if (c3 >= 0 && o < outcap) out[o++] = (unsigned char)(((c2 & 0xF) << 4) | (c3 >> 2));
-        if (c4 >= 0 && o < outcap) out[o++] = (unsigned char)(((c3 & 0x3) << 6) | c4);
-    }
-    
-    *outlen = o;
-    return 0;
-}
-
 int verify_password_pbkdf2(const char *password, const char *stored) {
     /* Parse: pbkdf2$sha256$iter=NNN$salt_b64$dk_b64 */
     /* Note: prefix length is 19, not 20 */
@@ -145,27 +95,14 @@ int verify_password_pbkdf2(const char *password, const char *stored) {
     if (!sep) return -1;
     const char *dk_b64 = sep + 1;
 
-    /* Copy base64 substrings into temporary, null-terminated buffers */
     size_t salt_len = (size_t)(sep - salt_b64);
-    if (salt_len == 0 || salt_len >= 64) return -1;
-    char salt_copy[64];
-    memcpy(salt_copy, salt_b64, salt_len);
-    salt_copy[salt_len] = '\0';
-
     size_t dk_len = strlen(dk_b64);
-    if (dk_len == 0 || dk_len >= 64) return -1;
-    char dk_copy[64];
-    memcpy(dk_copy, dk_b64, dk_len);
-    dk_copy[dk_len] = '\0';
 
-    /* Decode salt and stored dk */
+    /* Decode salt and stored dk (strict: padded standard alphabet) */
     unsigned char salt[16], stored_dk[32];
-    size_t salt_decoded_len, dk_decoded_len;
-    
-    if (base64_decode_simple(salt_copy, salt, sizeof(salt), &salt_decoded_len) < 0) return -1;
+    long salt_decoded_len = base64_decode(salt_b64, salt_len, salt, sizeof(salt), 0);
     if (salt_decoded_len != 16) return -1;
-    
-    if (base64_decode_simple(dk_copy, stored_dk, sizeof(stored_dk), &dk_decoded_len) < 0) return -1;
+    long dk_decoded_len = base64_decode(dk_b64, dk_len, stored_dk, sizeof(stored_dk), 0);
     if (dk_decoded_len != 32) return -1;
 
     /* Recompute PBKDF2 with same parameters */
@@ -181,14 +118,6 @@ int verify_password_pbkdf2(const char *password, const char *stored) {
 
     /* Constant-time comparison */
     int ok_cmp = constant_time_eq(computed_dk, stored_dk, 32) ? 1 : 0;
-    if (!ok_cmp) {
-        printf("[verify] iter=%ld salt_len=%zu dk_len=%zu decoded_salt=%zu decoded_dk=%zu\n",
-            iter, salt_len, dk_len, salt_decoded_len, dk_decoded_len);
-        printf("[verify] stored_dk[0..3]=%02x%02x%02x%02x computed[0..3]=%02x%02x%02x%02x\n",
-            stored_dk[0], stored_dk[1], stored_dk[2], stored_dk[3],
-            computed_dk[0], computed_dk[1], computed_dk[2], computed_dk[3]);
-        fflush(stdout);
-    }
     return ok_cmp;
 }
 
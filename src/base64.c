@@ -1,31 +1,313 @@
+#include <stdint.h>
+#include <string.h>
 #include "base64.h"
 
-// Simple Base64 encoder
-static const char base64_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+#if defined(__x86_64__) || defined(__i386__)
+#define BASE64_X86 1
+#include <immintrin.h>
+#endif
 
-size_t base64_encode(const unsigned char *input, size_t input_len, char *out) {
+enum { IMPL_SCALAR = 0, IMPL_SSSE3 = 1, IMPL_AVX2 = 2 };
+static const char *impl_names[] = { "scalar", "ssse3", "avx2" };
+
+static int g_detected = IMPL_SCALAR;
+static int g_impl = IMPL_SCALAR;
+
+static const char std_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char url_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+/* reverse tables, 0xFF marks bytes outside the alphabet (including '=') */
+static uint8_t std_rev[256];
+static uint8_t url_rev[256];
+
+/* resolved once before main() so every thread sees the same tables and impl */
+__attribute__((constructor))
+static void base64_init(void) {
+    memset(std_rev, 0xFF, sizeof(std_rev));
+    memset(url_rev, 0xFF, sizeof(url_rev));
+    for (int i = 0; i < 64; i++) {
+        std_rev[(unsigned char)std_table[i]] = (uint8_t)i;
+        url_rev[(unsigned char)url_table[i]] = (uint8_t)i;
+    }
+#if BASE64_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) g_detected = IMPL_AVX2;
+    else if (__builtin_cpu_supports("ssse3")) g_detected = IMPL_SSSE3;
+#endif
+    g_impl = g_detected;
+}
+
+const char *base64_impl(void) {
+    return impl_names[g_impl];
+}
+
+int base64_use_impl(const char *name) {
+    for (int i = 0; i <= g_detected; i++) {
+        if (strcmp(name, impl_names[i]) == 0) { g_impl = i; return 0; }
+    }
+    return -1;
+}
+
+/* ---- scalar ---- */
+
+static size_t encode_scalar(const unsigned char *in, size_t len, char *out, const char *table) {
     size_t i = 0, o = 0;
-    while (i + 2 < input_len) {
-        unsigned v = (input[i] << 16) | (input[i + 1] << 8) | input[i + 2];
-        out[o++] = base64_table[(v >> 18) & 0x3F];
-        out[o++] = base64_table[(v >> 12) & 0x3F];
-        out[o++] = base64_table[(v >> 6) & 0x3F];
-        out[o++] = base64_table[v & 0x3F];
+    while (i + 2 < len) {
+        unsigned v = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+        out[o++] = table[(v >> 18) & 0x3F];
+        out[o++] = table[(v >> 12) & 0x3F];
+        out[o++] = table[(v >> 6) & 0x3F];
+        out[o++] = table[v & 0x3F];
         i += 3;
     }
+    return o;
+}
+
+/* decodes whole quads from in[0..len) (len % 4 == 0); returns -1 on a bad char */
+static long decode_scalar(const char *in, size_t len, unsigned char *out, const uint8_t *rev) {
+    size_t o = 0;
+    for (size_t i = 0; i < len; i += 4) {
+        uint32_t a = rev[(unsigned char)in[i]], b = rev[(unsigned char)in[i + 1]];
+        uint32_t c = rev[(unsigned char)in[i + 2]], d = rev[(unsigned char)in[i + 3]];
+        if ((a | b | c | d) & 0x80) return -1;
+        uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+        out[o++] = (unsigned char)(v >> 16);
+        out[o++] = (unsigned char)(v >> 8);
+        out[o++] = (unsigned char)v;
+    }
+    return (long)o;
+}
+
+/* ---- SSSE3 / AVX2 ----
+   Encoding follows Wojciech Muła's "Base64 encoding with SIMD instructions":
+   shuffle 3-byte groups into 32-bit lanes, extract the four 6-bit indices with
+   mulhi/mullo, then map indices to ASCII with a 16-entry offset table.
+   Decoding classifies bytes by range (so any 62/63 alphabet works), adds the
+   per-range offset and packs 4x6 bits back to 3 bytes with maddubs/madd. */
+
+#if BASE64_X86
+
+__attribute__((target("ssse3")))
+static inline __m128i enc_lookup_128(__m128i idx, __m128i shift_lut) {
+    __m128i r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+    __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+    r = _mm_or_si128(r, _mm_and_si128(less, _mm_set1_epi8(13)));
+    return _mm_add_epi8(_mm_shuffle_epi8(shift_lut, r), idx);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i enc_indices_128(__m128i in) {
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("ssse3")))
+static size_t encode_ssse3(const unsigned char *in, size_t len, char *out, const char *table) {
+    const __m128i shift_lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, (char)(table[62] - 62), (char)(table[63] - 63),
+        'A', 0, 0);
+    size_t i = 0, o = 0;
+    /* each step consumes 12 bytes but loads 16 */
+    while (i + 16 <= len) {
+        __m128i idx = enc_indices_128(_mm_loadu_si128((const __m128i*)(in + i)));
+        _mm_storeu_si128((__m128i*)(out + o), enc_lookup_128(idx, shift_lut));
+        i += 12;
+        o += 16;
+    }
+    return o + encode_scalar(in + i, len - i - (len - i) % 3, out + o, table);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i dec_values_128(__m128i c, __m128i c62, __m128i c63, __m128i off62, __m128i off63, int *bad) {
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('A' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), c));
+    __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('a' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), c));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), c));
+    __m128i is62 = _mm_cmpeq_epi8(c, c62);
+    __m128i is63 = _mm_cmpeq_epi8(c, c63);
+    __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, _mm_or_si128(is62, is63)));
+    *bad = _mm_movemask_epi8(valid) != 0xFFFF;
+    __m128i shift = _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-65)), _mm_and_si128(lower, _mm_set1_epi8(-71))),
+        _mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(4)),
+            _mm_or_si128(_mm_and_si128(is62, off62), _mm_and_si128(is63, off63))));
+    return _mm_add_epi8(c, shift);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i dec_pack_128(__m128i v) {
+    __m128i merged = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+    __m128i packed = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+    return _mm_shuffle_epi8(packed, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+/* decodes whole quads; returns bytes written or -1 */
+__attribute__((target("ssse3")))
+static long decode_ssse3(const char *in, size_t len, unsigned char *out, const char *table, const uint8_t *rev) {
+    const __m128i c62 = _mm_set1_epi8(table[62]), c63 = _mm_set1_epi8(table[63]);
+    const __m128i off62 = _mm_set1_epi8((char)(62 - table[62])), off63 = _mm_set1_epi8((char)(63 - table[63]));
+    size_t i = 0, o = 0;
+    while (i + 16 <= len) {
+        int bad;
+        __m128i v = dec_values_128(_mm_loadu_si128((const __m128i*)(in + i)), c62, c63, off62, off63, &bad);
+        if (bad) return -1;
+        __m128i r = dec_pack_128(v);
+        _mm_storel_epi64((__m128i*)(out + o), r);
+        uint32_t tail = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(r, 8));
+        memcpy(out + o + 8, &tail, 4);
+        i += 16;
+        o += 12;
+    }
+    long rest = decode_scalar(in + i, len - i, out + o, rev);
+    return rest < 0 ? -1 : (long)o + rest;
+}
+
+__attribute__((target("avx2")))
+static size_t encode_avx2(const unsigned char *in, size_t len, char *out, const char *table) {
+    const __m256i shift_lut = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, (char)(table[62] - 62), (char)(table[63] - 63),
+        'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, (char)(table[62] - 62), (char)(table[63] - 63),
+        'A', 0, 0);
+    const __m256i shuf = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    size_t i = 0, o = 0;
+    /* two 12-byte groups per step, one per 128-bit lane; the second load reads 16 */
+    while (i + 28 <= len) {
+        __m256i v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(in + i))),
+            _mm_loadu_si128((const __m128i*)(in + i + 12)), 1);
+        v = _mm256_shuffle_epi8(v, shuf);
+        __m256i t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+        __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        __m256i t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+        __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        __m256i idx = _mm256_or_si256(t1, t3);
+        __m256i r = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+        __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+        r = _mm256_or_si256(r, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        r = _mm256_add_epi8(_mm256_shuffle_epi8(shift_lut, r), idx);
+        _mm256_storeu_si256((__m256i*)(out + o), r);
+        i += 24;
+        o += 32;
+    }
+    return o + encode_ssse3(in + i, len - i - (len - i) % 3, out + o, table);
+}
+
+__attribute__((target("avx2")))
+static long decode_avx2(const char *in, size_t len, unsigned char *out, const char *table, const uint8_t *rev) {
+    const __m256i c62 = _mm256_set1_epi8(table[62]), c63 = _mm256_set1_epi8(table[63]);
+    const __m256i off62 = _mm256_set1_epi8((char)(62 - table[62])), off63 = _mm256_set1_epi8((char)(63 - table[63]));
+    const __m256i shuf = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    size_t i = 0, o = 0;
+    while (i + 32 <= len) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)(in + i));
+        __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), c));
+        __m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), c));
+        __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+        __m256i is62 = _mm256_cmpeq_epi8(c, c62);
+        __m256i is63 = _mm256_cmpeq_epi8(c, c63);
+        __m256i valid = _mm256_or_si256(_mm256_or_si256(upper, lower), _mm256_or_si256(digit, _mm256_or_si256(is62, is63)));
+        if ((uint32_t)_mm256_movemask_epi8(valid) != 0xFFFFFFFFu) return -1;
+        __m256i shift = _mm256_or_si256(
+            _mm256_or_si256(_mm256_and_si256(upper, _mm256_set1_epi8(-65)), _mm256_and_si256(lower, _mm256_set1_epi8(-71))),
+            _mm256_or_si256(_mm256_and_si256(digit, _mm256_set1_epi8(4)),
+                _mm256_or_si256(_mm256_and_si256(is62, off62), _mm256_and_si256(is63, off63))));
+        __m256i v = _mm256_add_epi8(c, shift);
+        __m256i merged = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+        __m256i packed = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+        packed = _mm256_shuffle_epi8(packed, shuf);
+        /* 12 bytes in each lane -> 24 contiguous bytes */
+        packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+        _mm_storeu_si128((__m128i*)(out + o), _mm256_castsi256_si128(packed));
+        _mm_storel_epi64((__m128i*)(out + o + 16), _mm256_extracti128_si256(packed, 1));
+        i += 32;
+        o += 24;
+    }
+    long rest = decode_ssse3(in + i, len - i, out + o, table, rev);
+    return rest < 0 ? -1 : (long)o + rest;
+}
+
+#endif /* BASE64_X86 */
+
+/* ---- public API ---- */
+
+size_t base64_encode(const unsigned char *input, size_t input_len, char *out) {
+    return base64_encode_ex(input, input_len, out, 0);
+}
+
+size_t base64_encode_ex(const unsigned char *input, size_t input_len, char *out, int flags) {
+    const char *table = (flags & BASE64_URL) ? url_table : std_table;
+    size_t whole = input_len - input_len % 3;
+    size_t o;
+#if BASE64_X86
+    if (g_impl == IMPL_AVX2) o = encode_avx2(input, whole, out, table);
+    else if (g_impl == IMPL_SSSE3) o = encode_ssse3(input, whole, out, table);
+    else
+#endif
+    o = encode_scalar(input, whole, out, table);
+
+    size_t i = whole;
     if (i + 1 == input_len) {
         unsigned v = (input[i] << 16);
-        out[o++] = base64_table[(v >> 18) & 0x3F];
-        out[o++] = base64_table[(v >> 12) & 0x3F];
-        out[o++] = '=';
-        out[o++] = '=';
+        out[o++] = table[(v >> 18) & 0x3F];
+        out[o++] = table[(v >> 12) & 0x3F];
+        if (!(flags & BASE64_NOPAD)) { out[o++] = '='; out[o++] = '='; }
     } else if (i + 2 == input_len) {
         unsigned v = (input[i] << 16) | (input[i + 1] << 8);
-        out[o++] = base64_table[(v >> 18) & 0x3F];
-        out[o++] = base64_table[(v >> 12) & 0x3F];
-        out[o++] = base64_table[(v >> 6) & 0x3F];
-        out[o++] = '=';
+        out[o++] = table[(v >> 18) & 0x3F];
+        out[o++] = table[(v >> 12) & 0x3F];
+        out[o++] = table[(v >> 6) & 0x3F];
+        if (!(flags & BASE64_NOPAD)) out[o++] = '=';
     }
     return o;
 }
 
+long base64_decode(const char *in, size_t in_len, unsigned char *out, size_t out_cap, int flags) {
+    const char *table = (flags & BASE64_URL) ? url_table : std_table;
+    const uint8_t *rev = (flags & BASE64_URL) ? url_rev : std_rev;
+
+    /* split into whole quads handled in bulk and a final partial group */
+    size_t tail;
+    if (flags & BASE64_NOPAD) {
+        tail = in_len % 4;
+        if (tail == 1) return -1;
+    } else {
+        if (in_len % 4) return -1;
+        tail = 0;
+        if (in_len >= 4 && in[in_len - 1] == '=') tail = in[in_len - 2] == '=' ? 2 : 3;
+    }
+    size_t bulk = in_len - (tail ? ((flags & BASE64_NOPAD) ? tail : 4) : 0);
+    size_t need = bulk / 4 * 3 + (tail ? tail - 1 : 0);
+    if (need > out_cap) return -1;
+
+    long o;
+#if BASE64_X86
+    if (g_impl == IMPL_AVX2) o = decode_avx2(in, bulk, out, table, rev);
+    else if (g_impl == IMPL_SSSE3) o = decode_ssse3(in, bulk, out, table, rev);
+    else
+#endif
+    o = decode_scalar(in, bulk, out, rev);
+    if (o < 0) return -1;
+
+    if (tail) {
+        const char *t = in + bulk;
+        uint32_t a = rev[(unsigned char)t[0]], b = rev[(unsigned char)t[1]];
+        if ((a | b) & 0x80) return -1;
+        if (tail == 2) {
+            if (b & 0x0F) return -1;   /* non-canonical trailing bits */
+            out[o++] = (unsigned char)((a << 2) | (b >> 4));
+        } else {
+            uint32_t c = rev[(unsigned char)t[2]];
+            if ((c & 0x80) || (c & 0x03)) return -1;
+            out[o++] = (unsigned char)((a << 2) | (b >> 4));
+            out[o++] = (unsigned char)((b << 4) | (c >> 2));
+        }
+    }
+    return o;
+}
@@ -0,0 +1,37 @@
+#include "bufpool.h"
+#include <stdlib.h>
+
+void bufpool_init(bufpool *p, size_t size, size_t max_free) {
+    /* idle buffers hold the free-list link in their first bytes */
+    p->size = size < sizeof(void*) ? sizeof(void*) : size;
+    p->free_list = NULL;
+    p->nfree = 0;
+    p->max_free = max_free;
+}
+
+void *bufpool_get(bufpool *p) {
+    void *b = p->free_list;
+    if (b) {
+        p->free_list = *(void**)b;
+        p->nfree--;
+        return b;
+    }
+    return malloc(p->size);
+}
+
+void bufpool_put(bufpool *p, void *buf) {
+    if (!buf) return;
+    if (p->nfree >= p->max_free) { free(buf); return; }
+    *(void**)buf = p->free_list;
+    p->free_list = buf;
+    p->nfree++;
+}
+
+void bufpool_destroy(bufpool *p) {
+    while (p->free_list) {
+        void *next = *(void**)p->free_list;
+        free(p->free_list);
+        p->free_list = next;
+    }
+    p->nfree = 0;
+}
@@ -0,0 +1,89 @@
+#include "conn.h"
+#include <string.h>
+
+/* member lists, indexed by group() */
+enum { GROUP_WS, GROUP_SSE, GROUP_COUNT };
+
+static Conn g_slots[CONN_MAX];
+static int g_free[CONN_MAX];      /* stack of free slot indexes */
+static int g_nfree;
+static Conn *g_live[CONN_MAX];
+static int g_nlive;
+static Conn *g_members[GROUP_COUNT][CONN_MAX];
+static int g_nmembers[GROUP_COUNT];
+
+static int group(const Conn *c) {
+    return c->type == CONN_SSE ? GROUP_SSE : GROUP_WS;
+}
+
+void conn_registry_init(void) {
+    g_nlive = 0;
+    for (int g = 0; g < GROUP_COUNT; g++) g_nmembers[g] = 0;
+    g_nfree = CONN_MAX;
+    for (int i = 0; i < CONN_MAX; i++) {
+        g_slots[i].fd = -1;
+        g_slots[i].gen = 1;
+        /* lowest slots handed out first */
+        g_free[i] = CONN_MAX - 1 - i;
+    }
+}
+
+Conn *conn_open(int fd) {
+    if (g_nfree == 0) return NULL;
+    Conn *c = &g_slots[g_free[--g_nfree]];
+    uint16_t gen = c->gen;
+    memset(c, 0, sizeof(*c));
+    c->gen = gen;
+    c->fd = fd;
+    c->type = CONN_HTTP;
+    c->route = ROUTE_COUNT;
+    c->member_idx = -1;
+    c->live_idx = g_nlive;
+    g_live[g_nlive++] = c;
+    return c;
+}
+
+void conn_release(Conn *c) {
+    if (c->member_idx >= 0) {
+        int g = group(c);
+        Conn *last = g_members[g][--g_nmembers[g]];
+        g_members[g][c->member_idx] = last;
+        last->member_idx = c->member_idx;
+        c->member_idx = -1;
+    }
+    Conn *last = g_live[--g_nlive];
+    g_live[c->live_idx] = last;
+    last->live_idx = c->live_idx;
+    c->fd = -1;
+    if (++c->gen == 0) c->gen = 1;   /* keeps handle 0 invalid */
+    g_free[g_nfree++] = (int)(c - g_slots);
+}
+
+static void join(Conn *c, ConnType type) {
+    if (c->member_idx >= 0) return;
+    c->type = type;
+    int g = group(c);
+    c->member_idx = g_nmembers[g];
+    g_members[g][g_nmembers[g]++] = c;
+}
+
+void conn_ws_join(Conn *c) { join(c, CONN_WS); }
+void conn_sse_join(Conn *c) { join(c, CONN_SSE); }
+
+conn_handle conn_handle_of(const Conn *c) {
+    return ((conn_handle)c->gen << 16) | (conn_handle)(c - g_slots);
+}
+
+Conn *conn_lookup(conn_handle h) {
+    uint32_t slot = h & 0xFFFF;
+    if (slot >= CONN_MAX) return NULL;
+    Conn *c = &g_slots[slot];
+    return c->fd >= 0 && c->gen == (uint16_t)(h >> 16) ? c : NULL;
+}
+
+int conn_live_count(void) { return g_nlive; }
+Conn *conn_live_at(int i) { return g_live[i]; }
+int conn_ws_count(void) { return g_nmembers[GROUP_WS]; }
+Conn *conn_ws_at(int i) { return g_members[GROUP_WS][i]; }
+int conn_sse_count(void) { return g_nmembers[GROUP_SSE]; }
+Conn *conn_sse_at(int i) { return g_members[GROUP_SSE][i]; }
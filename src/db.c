@@ -1,10 +1,83 @@
 #include "db.h"
+#include "log.h"
+#include "metrics.h"
+#include "msglog.h"
+#include "session_cache.h"
+#include "userdir.h"
+#include "util.h"
+#include <limits.h>
+#include <pthread.h>
 #include <sqlite3.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 static sqlite3 *g_db = NULL;
+static char g_db_path[512];
+static int g_fts = 0;   /* messages_fts is usable (SQLite built with FTS5) */
+static int g_msglog = 0; /* messages are kept in the segmented log, not the messages table */
+static int g_users_complete = 0; /* every user is in the directory, so a miss there is final */
+static int g_users_shared = 0;   /* other processes register users in this database too */
+
+// expired-session sweeper (runs on its own thread with its own connection)
+#define SWEEP_BATCH 500
+static pthread_t g_sweeper;
+static int g_sweeper_running = 0;
+static int g_sweeper_stop = 0;
+static int g_sweep_interval = 60;
+static pthread_mutex_t g_sweep_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_sweep_cond = PTHREAD_COND_INITIALIZER;
+
+// read-only connections for lookups and history reads; under WAL they read
+// a snapshot while g_db, the only writer, keeps inserting
+static sqlite3 *g_readers[DB_READERS_MAX];
+static int g_nreaders = 0;
+static sqlite3 *g_idle[DB_READERS_MAX];
+static int g_nidle = 0;
+static pthread_mutex_t g_read_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_read_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t g_loop_thread;   /* the one that called db_init; it owns g_db */
+
+/* takes an idle reader, waiting for one if all are busy. The event loop
+   never waits: it reads through g_db, which only it uses for writing, so
+   its lookups do not queue behind the worker pool's history reads. */
+static sqlite3 *reader_get(void) {
+    if (!g_nreaders || pthread_equal(pthread_self(), g_loop_thread)) return g_db;
+    pthread_mutex_lock(&g_read_lock);
+    while (g_nidle == 0) pthread_cond_wait(&g_read_cond, &g_read_lock);
+    sqlite3 *db = g_idle[--g_nidle];
+    pthread_mutex_unlock(&g_read_lock);
+    return db;
+}
+
+/* gives a reader back; any other connection is ignored */
+static void reader_put(sqlite3 *db) {
+    for (int i = 0; i < g_nreaders; i++) {
+        if (g_readers[i] != db) continue;
+        pthread_mutex_lock(&g_read_lock);
+        g_idle[g_nidle++] = db;
+        pthread_cond_signal(&g_read_cond);
+        pthread_mutex_unlock(&g_read_lock);
+        return;
+    }
+}
+
+/* prepares sql on a reader, which db_finalize() gives back */
+static int prepare_read(const char *sql, sqlite3_stmt **st) {
+    sqlite3 *db = reader_get();
+    if (sqlite3_prepare_v2(db, sql, -1, st, NULL) == SQLITE_OK) return 0;
+    reader_put(db);
+    return -1;
+}
+
+/* finalizes a statement and records how long it took since t0 */
+static void db_finalize(sqlite3_stmt *st, metrics_dbop op, uint64_t t0) {
+    sqlite3 *db = sqlite3_db_handle(st);
+    sqlite3_finalize(st);
+    reader_put(db);
+    metrics_db(op, now_ns() - t0);
+}
 
 static int db_exec(const char *sql) {
     sqlite3_stmt *stmt = NULL;
@@ -16,11 +89,65 @@ static int db_exec(const char *sql) {
     return ok;
 }
 
+static int table_exists(const char *name) {
+    sqlite3_stmt *st = NULL;
+    if (sqlite3_prepare_v2(g_db, "SELECT 1 FROM sqlite_master WHERE name = ?;", -1, &st, NULL) != SQLITE_OK) return 0;
+    sqlite3_bind_text(st, 1, name, -1, SQLITE_STATIC);
+    int found = sqlite3_step(st) == SQLITE_ROW;
+    sqlite3_finalize(st);
+    return found;
+}
+
+/* full-text index over messages.content; an external-content table, so the
+   text is stored once and the triggers keep the index in step with writes */
+static int fts_init(void) {
+    static const char *schema[] = {
+        "CREATE VIRTUAL TABLE IF NOT EXISTS messages_fts USING fts5("
+            "content, content='messages', content_rowid='id');",
+        "CREATE TRIGGER IF NOT EXISTS messages_fts_ai AFTER INSERT ON messages BEGIN "
+            "INSERT INTO messages_fts(rowid, content) VALUES (new.id, new.content); END;",
+        "CREATE TRIGGER IF NOT EXISTS messages_fts_ad AFTER DELETE ON messages BEGIN "
+            "INSERT INTO messages_fts(messages_fts, rowid, content) VALUES ('delete', old.id, old.content); END;",
+        "CREATE TRIGGER IF NOT EXISTS messages_fts_au AFTER UPDATE OF content ON messages BEGIN "
+            "INSERT INTO messages_fts(messages_fts, rowid, content) VALUES ('delete', old.id, old.content); "
+            "INSERT INTO messages_fts(rowid, content) VALUES (new.id, new.content); END;",
+    };
+    int existed = table_exists("messages_fts");
+    for (size_t i = 0; i < sizeof(schema) / sizeof(schema[0]); i++)
+        if (db_exec(schema[i]) < 0) return -1;
+    /* databases from before the index: fill it from the existing rows once */
+    if (!existed && db_exec("INSERT INTO messages_fts(messages_fts) VALUES ('rebuild');") < 0) return -1;
+    return 0;
+}
+
+/* fills the user directory from the users table */
+static int userdir_load(void) {
+    static const char *sql = "SELECT id, username, password_hash FROM users ORDER BY id;";
+    if (userdir_init() < 0) return -1;
+    sqlite3_stmt *st = NULL;
+    if (sqlite3_prepare_v2(g_db, sql, -1, &st, NULL) != SQLITE_OK) return -1;
+    int rc, out = 0;
+    while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+        const unsigned char *name = sqlite3_column_text(st, 1);
+        const unsigned char *hash = sqlite3_column_text(st, 2);
+        if (!name || !hash) continue;
+        /* -2 cannot happen with the UNIQUE column, but if it does the
+           directory is missing a user and misses must check the table */
+        if (userdir_add(sqlite3_column_int(st, 0), (const char*)name, (const char*)hash) != 0) out = -1;
+    }
+    sqlite3_finalize(st);
+    return rc == SQLITE_DONE ? out : -1;
+}
+
 int db_init(const char *db_path) {
     if (sqlite3_open(db_path, &g_db) != SQLITE_OK) {
         fprintf(stderr, "Failed to open database: %s\n", sqlite3_errmsg(g_db));
         return -1;
     }
+    snprintf(g_db_path, sizeof(g_db_path), "%s", db_path);
+    g_loop_thread = pthread_self();
+    sqlite3_busy_timeout(g_db, 250);   /* the sweeper may briefly hold the write lock */
+    if (session_cache_init(4096) < 0) return -1;
     db_exec("PRAGMA foreign_keys = ON");
     db_exec("PRAGMA journal_mode = WAL");
     const char *schema_users =
@@ -52,21 +179,161 @@ int db_init(const char *db_path) {
 		");";
 	// index on timestamp so we can quickly grab recent messages
 	const char *idx_messages = "CREATE INDEX IF NOT EXISTS idx_messages_created ON messages(created_at DESC);";
+	// index on expiry so the sweeper can delete expired sessions in batches
+	const char *idx_sessions = "CREATE INDEX IF NOT EXISTS idx_sessions_expires ON sessions(expires_at);";
 	
 	if (db_exec(schema_users) < 0) return -1;
 	if (db_exec(schema_sessions) < 0) return -1;
 	if (db_exec(schema_messages) < 0) return -1;
 	if (db_exec(idx_messages) < 0) return -1;
+	if (db_exec(idx_sessions) < 0) return -1;
+	g_fts = fts_init() == 0;
+	if (!g_fts) log_event(LOG_WARN, "fts_unavailable", "err=\"%s\"", sqlite3_errmsg(g_db));
+	g_users_complete = userdir_load() == 0 && !g_users_shared;
+	if (!g_users_complete) log_event(LOG_WARN, "userdir_incomplete", "users=%zu", userdir_count());
 	return 0;
 }
 
+/* copies the messages table into a newly created log, keeping the ids */
+static int msglog_import(void) {
+    static const char *sql =
+        "SELECT id, user_id, username, content, created_at FROM messages ORDER BY id;";
+    sqlite3_stmt *st = NULL;
+    if (sqlite3_prepare_v2(g_db, sql, -1, &st, NULL) != SQLITE_OK) return -1;
+    long rows = 0;
+    int rc;
+    while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+        const unsigned char *username = sqlite3_column_text(st, 2);
+        const unsigned char *content = sqlite3_column_text(st, 3);
+        if (!username || !content) continue;
+        if (msglog_append((long)sqlite3_column_int64(st, 0), sqlite3_column_int(st, 1), (const char*)username,
+                          (const char*)content, (long)sqlite3_column_int64(st, 4)) < 0) break;
+        rows++;
+    }
+    sqlite3_finalize(st);
+    if (rc != SQLITE_DONE) return -1;
+    if (rows) log_event(LOG_INFO, "msglog_import", "rows=%ld", rows);
+    return 0;
+}
+
+int db_use_message_log(const char *dir, size_t segment_bytes, long retain_sec, size_t retain_bytes) {
+    int created = msglog_open(dir, segment_bytes, retain_sec, retain_bytes);
+    if (created < 0) return -1;
+    if (created && msglog_import() < 0) {
+        msglog_close();
+        return -1;
+    }
+    g_msglog = 1;
+    return 0;
+}
+
+void db_release_message_log(void) {
+    if (g_msglog) msglog_close();   /* g_msglog stays set, so message calls fail from here on */
+}
+
+int db_open_readers(int n) {
+    if (n > DB_READERS_MAX) n = DB_READERS_MAX;
+    for (int i = g_nreaders; i < n; i++) {
+        sqlite3 *db = NULL;
+        if (sqlite3_open_v2(g_db_path, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+            log_event(LOG_ERROR, "reader_open_failed", "err=\"%s\"", sqlite3_errmsg(db));
+            sqlite3_close(db);
+            return -1;
+        }
+        sqlite3_busy_timeout(db, 1000);
+        g_readers[g_nreaders++] = db;
+        g_idle[g_nidle++] = db;
+    }
+    return 0;
+}
+
+int db_messages_threadsafe(void) {
+    return g_nreaders > 0 && !g_msglog;
+}
+
 void db_close(void) {
+    db_stop_session_sweeper();
+    for (int i = 0; i < g_nreaders; i++) sqlite3_close(g_readers[i]);
+    g_nreaders = g_nidle = 0;
+    if (g_msglog) { msglog_close(); g_msglog = 0; }
     if (g_db) { sqlite3_close(g_db); g_db = NULL; }
+    session_cache_free();
+    userdir_free();
+    g_users_complete = g_users_shared = 0;
+}
+
+static void *sweeper_main(void *arg) {
+    (void)arg;
+    sqlite3 *db = NULL;
+    if (sqlite3_open_v2(g_db_path, &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+        log_event(LOG_ERROR, "sweeper_failed", "err=\"%s\"", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+    sqlite3_busy_timeout(db, 1000);
+    static const char *sql =
+        "DELETE FROM sessions WHERE id IN "
+        "(SELECT id FROM sessions WHERE expires_at < ? LIMIT ?);";
+    sqlite3_stmt *st = NULL;
+    if (sqlite3_prepare_v2(db, sql, -1, &st, NULL) != SQLITE_OK) {
+        sqlite3_close(db);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_sweep_lock);
+    while (!g_sweeper_stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += g_sweep_interval;
+        pthread_cond_timedwait(&g_sweep_cond, &g_sweep_lock, &until);
+        if (g_sweeper_stop) break;
+        pthread_mutex_unlock(&g_sweep_lock);
+
+        /* delete in small batches so the write lock is never held for long */
+        long now = (long)time(NULL);
+        int removed;
+        do {
+            sqlite3_bind_int64(st, 1, (sqlite3_int64)now);
+            sqlite3_bind_int(st, 2, SWEEP_BATCH);
+            int rc = sqlite3_step(st);
+            removed = (rc == SQLITE_DONE) ? sqlite3_changes(db) : 0;
+            sqlite3_reset(st);
+        } while (removed == SWEEP_BATCH && !g_sweeper_stop);
+        session_cache_evict_expired(now);
+
+        pthread_mutex_lock(&g_sweep_lock);
+    }
+    pthread_mutex_unlock(&g_sweep_lock);
+
+    sqlite3_finalize(st);
+    sqlite3_close(db);
+    return NULL;
+}
+
+int db_start_session_sweeper(int interval_sec) {
+    if (g_sweeper_running) return 0;
+    g_sweep_interval = interval_sec > 0 ? interval_sec : 60;
+    g_sweeper_stop = 0;
+    if (pthread_create(&g_sweeper, NULL, sweeper_main, NULL) != 0) return -1;
+    g_sweeper_running = 1;
+    return 0;
+}
+
+void db_stop_session_sweeper(void) {
+    if (!g_sweeper_running) return;
+    pthread_mutex_lock(&g_sweep_lock);
+    g_sweeper_stop = 1;
+    pthread_cond_signal(&g_sweep_cond);
+    pthread_mutex_unlock(&g_sweep_lock);
+    pthread_join(g_sweeper, NULL);
+    g_sweeper_running = 0;
 }
 
 int db_create_user(const char *username, const char *password_hash) {
     static const char *sql = "INSERT INTO users (username, password_hash, created_at) VALUES (?, ?, ?);";
 	sqlite3_stmt *st = NULL;
+	uint64_t t0 = now_ns();
+	if (db_user_exists(username)) return -2;
 	if (sqlite3_prepare_v2(g_db, sql, -1, &st, NULL) != SQLITE_OK) return -1;
 	sqlite3_bind_text(st, 1, username, -1, SQLITE_TRANSIENT);
 	sqlite3_bind_text(st, 2, password_hash, -1, SQLITE_TRANSIENT);
@@ -76,78 +343,109 @@ int db_create_user(const char *username, const char *password_hash) {
 	if (rc != SQLITE_DONE) {
 		if (rc == SQLITE_CONSTRAINT) out = -2;
 		else out = -1;
+	} else if (userdir_add((int)sqlite3_last_insert_rowid(g_db), username, password_hash) == -1) {
+		g_users_complete = 0;   /* write-through failed; misses must check the table */
 	}
-	sqlite3_finalize(st);
+	db_finalize(st, DBOP_CREATE_USER, t0);
 	return out;
 }
 
+void db_share_users(void) {
+    g_users_shared = 1;
+    g_users_complete = 0;
+}
+
+int db_user_exists(const char *username) {
+    if (userdir_find_name(username, NULL, NULL, 0) == 0) return 1;
+    if (g_users_complete) return 0;
+    int uid;
+    char hash[256];
+    return db_get_user_by_username(username, &uid, hash, sizeof(hash)) == 0;
+}
+
 int db_get_user_by_username(const char *username, int*user_id, char *password_hash_out, size_t out_sz) {
     static const char *sql = "SELECT id, password_hash FROM users WHERE username = ?;";
     sqlite3_stmt *st = NULL;
-    if (sqlite3_prepare_v2(g_db, sql, -1, &st, NULL) != SQLITE_OK) return -1;
+    uint64_t t0 = now_ns();
+    if (userdir_find_name(username, user_id, password_hash_out, out_sz) == 0) return 0;
+    if (g_users_complete) return -1;
+    if (prepare_read(sql, &st) < 0) return -1;
     sqlite3_bind_text(st, 1, username, -1, SQLITE_TRANSIENT);
     int rc = sqlite3_step(st);
-    if (rc != SQLITE_ROW) { sqlite3_finalize(st); return -1; }
+    if (rc != SQLITE_ROW) { db_finalize(st, DBOP_GET_USER, t0); return -1; }
     *user_id = sqlite3_column_int(st, 0);
     const unsigned char *ph = sqlite3_column_text(st, 1);
-    if (!ph) { sqlite3_finalize(st); return -1; }
+    if (!ph) { db_finalize(st, DBOP_GET_USER, t0); return -1; }
     snprintf(password_hash_out, out_sz, "%s", (const char*)ph);
-    sqlite3_finalize(st);
+    userdir_add(*user_id, username, (const char*)ph);
+    db_finalize(st, DBOP_GET_USER, t0);
     return 0;
 }
 
 int db_create_session(const char *sid, int user_id, long expires_at) {
     static const char *sql = "INSERT INTO sessions (id, user_id, created_at, expires_at) VALUES (?, ?, ?, ?);";
     sqlite3_stmt *st = NULL;
+    uint64_t t0 = now_ns();
     if (sqlite3_prepare_v2(g_db, sql, -1, &st, NULL) != SQLITE_OK) return -1;
     sqlite3_bind_text(st, 1, sid, -1, SQLITE_TRANSIENT);
     sqlite3_bind_int(st, 2, user_id);
     sqlite3_bind_int64(st, 3, (sqlite3_int64)time(NULL));
     sqlite3_bind_int64(st, 4, (sqlite3_int64)expires_at);
     int rc = sqlite3_step(st);
-    sqlite3_finalize(st);
-    return (rc == SQLITE_DONE) ? 0 : -1;
+    db_finalize(st, DBOP_CREATE_SESSION, t0);
+    if (rc != SQLITE_DONE) return -1;
+    session_cache_put(sid, user_id, expires_at);   /* write-through */
+    return 0;
 }
 
 int db_get_session_user(const char *sid, int *user_id) {
+    int hit = session_cache_get(sid, user_id);
+    if (hit == 1) return 1;
+    if (hit < 0) return 0;   /* expired; the sweeper removes the row */
     static const char *sql = "SELECT user_id, expires_at FROM sessions WHERE id = ?;";
     sqlite3_stmt *st = NULL;
-    if (sqlite3_prepare_v2(g_db, sql, -1, &st, NULL) != SQLITE_OK) return -1;
+    uint64_t t0 = now_ns();
+    if (prepare_read(sql, &st) < 0) return -1;
 	sqlite3_bind_text(st, 1, sid, -1, SQLITE_TRANSIENT);
 	int rc = sqlite3_step(st);
-    if (rc != SQLITE_ROW) { sqlite3_finalize(st); return 0; }
+    if (rc != SQLITE_ROW) { db_finalize(st, DBOP_GET_SESSION, t0); return 0; }
     int uid = sqlite3_column_int(st, 0);
     long exp = (long)sqlite3_column_int64(st, 1);
-	sqlite3_finalize(st);
-	if (exp < (long)time(NULL)) {
-		db_delete_session(sid);
-		return 0;
-	}
+	db_finalize(st, DBOP_GET_SESSION, t0);
+	if (exp < (long)time(NULL)) return 0;   /* left for the sweeper */
+	session_cache_put(sid, uid, exp);
 	*user_id = uid;
 	return 1;
 }
 
 int db_delete_session(const char *sid) {
+    session_cache_remove(sid);
     static const char *sql = "DELETE FROM sessions WHERE id = ?;";
     sqlite3_stmt *st = NULL;
+    uint64_t t0 = now_ns();
     if (sqlite3_prepare_v2(g_db, sql, -1, &st, NULL) != SQLITE_OK) return -1;
     sqlite3_bind_text(st, 1, sid, -1, SQLITE_TRANSIENT);
     int rc = sqlite3_step(st);
-    sqlite3_finalize(st);
+    db_finalize(st, DBOP_DELETE_SESSION, t0);
     return (rc == SQLITE_DONE) ? 0 : -1;
 }
 
 int db_get_username_by_id(int user_id, char *out, size_t out_sz) {
-    static const char *sql = "SELECT username FROM users WHERE id = ?;";
+    static const char *sql = "SELECT username, password_hash FROM users WHERE id = ?;";
     sqlite3_stmt *st = NULL;
-    if (sqlite3_prepare_v2(g_db, sql, -1, &st, NULL) != SQLITE_OK) return -1;
+    uint64_t t0 = now_ns();
+    if (userdir_find_id(user_id, out, out_sz) == 0) return 0;
+    if (g_users_complete) return -1;
+    if (prepare_read(sql, &st) < 0) return -1;
     sqlite3_bind_int(st, 1, user_id);
     int rc = sqlite3_step(st);
-    if (rc != SQLITE_ROW) { sqlite3_finalize(st); return -1; }
+    if (rc != SQLITE_ROW) { db_finalize(st, DBOP_GET_USERNAME, t0); return -1; }
     const unsigned char *u = sqlite3_column_text(st, 0);
-    if (!u) { sqlite3_finalize(st); return -1; }
+    const unsigned char *ph = sqlite3_column_text(st, 1);
+    if (!u || !ph) { db_finalize(st, DBOP_GET_USERNAME, t0); return -1; }
     snprintf(out, out_sz, "%s", (const char*)u);
-    sqlite3_finalize(st);
+    userdir_add(user_id, (const char*)u, (const char*)ph);
+    db_finalize(st, DBOP_GET_USERNAME, t0);
     return 0;
 }
 
@@ -155,49 +453,251 @@ int db_get_username_by_id(int user_id, char *out, size_t out_sz) {
 int db_get_user_count(void) {
     static const char *sql = "SELECT COUNT(*) FROM users;";
     sqlite3_stmt *st = NULL;
-    if (sqlite3_prepare_v2(g_db, sql, -1, &st, NULL) != SQLITE_OK) return -1;
+    uint64_t t0 = now_ns();
+    if (g_users_complete) return (int)userdir_count();
+    if (prepare_read(sql, &st) < 0) return -1;
     int rc = sqlite3_step(st);
-    if (rc != SQLITE_ROW) { sqlite3_finalize(st); return -1; }
+    if (rc != SQLITE_ROW) { db_finalize(st, DBOP_USER_COUNT, t0); return -1; }
     int count = sqlite3_column_int(st, 0);
-    sqlite3_finalize(st);
+    db_finalize(st, DBOP_USER_COUNT, t0);
     return count;
 }
 
 // save a chat message to the database
-int db_save_message(int user_id, const char *username, const char *content) {
+long db_save_message(int user_id, const char *username, const char *content, long created_at) {
     static const char *sql = "INSERT INTO messages (user_id, username, content, created_at) VALUES (?, ?, ?, ?);";
     sqlite3_stmt *st = NULL;
+    uint64_t t0 = now_ns();
+    if (g_msglog) {
+        long id = msglog_last_id() + 1;
+        if (msglog_append(id, user_id, username, content, created_at) < 0) id = -1;
+        metrics_db(DBOP_SAVE_MESSAGE, now_ns() - t0);
+        return id;
+    }
     if (sqlite3_prepare_v2(g_db, sql, -1, &st, NULL) != SQLITE_OK) return -1;
     sqlite3_bind_int(st, 1, user_id);
     sqlite3_bind_text(st, 2, username, -1, SQLITE_TRANSIENT);
     sqlite3_bind_text(st, 3, content, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int64(st, 4, (sqlite3_int64)time(NULL));
+    sqlite3_bind_int64(st, 4, (sqlite3_int64)created_at);
     int rc = sqlite3_step(st);
-    sqlite3_finalize(st);
-    return (rc == SQLITE_DONE) ? 0 : -1;
+    long id = rc == SQLITE_DONE ? (long)sqlite3_last_insert_rowid(g_db) : -1;
+    db_finalize(st, DBOP_SAVE_MESSAGE, t0);
+    return id;
 }
 
-// fetch recent messages (newest first)
-// callback is called for each message: callback(username, content, timestamp, userdata)
-int db_get_messages(int limit, void (*callback)(const char*, const char*, long, void*), void *userdata) {
-    static const char *sql = "SELECT username, content, created_at FROM messages ORDER BY created_at DESC LIMIT ?;";
+// fetch a page of messages using the primary key as the cursor
+// callback is called for each message: callback(id, username, content, timestamp, userdata)
+int db_get_messages(long before_id, long after_id, int limit, db_message_cb callback, void *userdata) {
+    static const char *sql_newest =
+        "SELECT id, username, content, created_at FROM messages ORDER BY id DESC LIMIT ?;";
+    static const char *sql_before =
+        "SELECT id, username, content, created_at FROM messages WHERE id < ? ORDER BY id DESC LIMIT ?;";
+    static const char *sql_after =
+        "SELECT id, username, content, created_at FROM messages WHERE id > ? ORDER BY id ASC LIMIT ?;";
+    const char *sql = before_id > 0 ? sql_before : after_id > 0 ? sql_after : sql_newest;
     sqlite3_stmt *st = NULL;
-    if (sqlite3_prepare_v2(g_db, sql, -1, &st, NULL) != SQLITE_OK) return -1;
-    sqlite3_bind_int(st, 1, limit);
+    uint64_t t0 = now_ns();
+    if (g_msglog) {
+        int count = msglog_read(before_id, after_id, limit, callback, userdata);
+        metrics_db(DBOP_GET_MESSAGES, now_ns() - t0);
+        return count;
+    }
+    if (prepare_read(sql, &st) < 0) return -1;
+    int p = 1;
+    if (before_id > 0) sqlite3_bind_int64(st, p++, (sqlite3_int64)before_id);
+    else if (after_id > 0) sqlite3_bind_int64(st, p++, (sqlite3_int64)after_id);
+    sqlite3_bind_int(st, p, limit);
     
     int count = 0;
     while (sqlite3_step(st) == SQLITE_ROW) {
-        const unsigned char *username = sqlite3_column_text(st, 0);
-        const unsigned char *content = sqlite3_column_text(st, 1);
-        long timestamp = (long)sqlite3_column_int64(st, 2);
+        long id = (long)sqlite3_column_int64(st, 0);
+        const unsigned char *username = sqlite3_column_text(st, 1);
+        const unsigned char *content = sqlite3_column_text(st, 2);
+        long timestamp = (long)sqlite3_column_int64(st, 3);
         
         if (username && content && callback) {
-            callback((const char*)username, (const char*)content, timestamp, userdata);
+            callback(id, (const char*)username, (const char*)content, timestamp, userdata);
             count++;
         }
     }
     
-    sqlite3_finalize(st);
+    db_finalize(st, DBOP_GET_MESSAGES, t0);
     return count;
 }
-    
\ No newline at end of file
+
+long db_last_message_id(void) {
+    static const char *sql = "SELECT MAX(id) FROM messages;";
+    sqlite3_stmt *st = NULL;
+    uint64_t t0 = now_ns();
+    if (g_msglog) return msglog_last_id();
+    if (prepare_read(sql, &st) < 0) return -1;
+    long id = sqlite3_step(st) == SQLITE_ROW ? (long)sqlite3_column_int64(st, 0) : -1;
+    db_finalize(st, DBOP_GET_MESSAGES, t0);
+    return id;
+}
+
+struct db_export {
+    sqlite3 *db;          /* own read-only connection; NULL with the message log */
+    sqlite3_stmt *st;
+    long next_id;         /* message log: next id to read, up to last_id */
+    long last_id;
+    long to_ts;
+    long last_ts;         /* SQL: key of the last row returned, (last_ts, last_id) */
+    int batch_rows;       /* rows the current batch has returned */
+};
+
+/* rows per read transaction; between batches the export holds no snapshot,
+   so a long export does not keep WAL checkpoints from finishing */
+#define EXPORT_BATCH 1000
+
+/* Walks idx_messages_created in (created_at, id) order, keyed on the last
+   row returned, so a wall-clock step back cannot hide rows in the range and
+   each batch picks up exactly where the previous one stopped. */
+db_export *db_export_open(long from_ts, long to_ts) {
+    static const char *sql =
+        "SELECT id, username, content, created_at FROM messages "
+        "WHERE created_at >= ?1 AND created_at < ?2 "
+        "AND (created_at > ?1 OR id > ?3) "
+        "ORDER BY created_at, id LIMIT ?4;";
+    db_export *x = (db_export*)calloc(1, sizeof(*x));
+    if (!x) return NULL;
+    x->to_ts = to_ts > 0 ? to_ts : LONG_MAX;
+    if (g_msglog) {
+        x->next_id = from_ts > 0 ? msglog_first_id_at(from_ts) : 1;
+        x->last_id = x->next_id > 0 ? msglog_last_id() : 0;
+        return x;
+    }
+    /* a connection of its own, so reads never wait on, or hold up, writes
+       on the main connection (WAL) */
+    if (sqlite3_open_v2(g_db_path, &x->db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(x->db, sql, -1, &x->st, NULL) != SQLITE_OK) {
+        db_export_close(x);
+        return NULL;
+    }
+    /* batches see rows written after the export started; stop at that second */
+    if (to_ts <= 0) x->to_ts = (long)time(NULL) + 1;
+    x->last_ts = from_ts;
+    x->last_id = 0;
+    sqlite3_bind_int64(x->st, 1, (sqlite3_int64)x->last_ts);
+    sqlite3_bind_int64(x->st, 2, (sqlite3_int64)x->to_ts);
+    sqlite3_bind_int64(x->st, 3, 0);
+    sqlite3_bind_int(x->st, 4, EXPORT_BATCH);
+    return x;
+}
+
+struct export_row {
+    db_export *x;
+    db_message_cb callback;
+    void *userdata;
+    int emitted;
+};
+
+static void export_log_row(long id, const char *username, const char *content, long ts, void *userdata) {
+    struct export_row *r = (struct export_row*)userdata;
+    if (ts >= r->x->to_ts) { r->x->next_id = r->x->last_id + 1; return; }
+    r->x->next_id = id + 1;
+    r->callback(id, username, content, ts, r->userdata);
+    r->emitted = 1;
+}
+
+int db_export_next(db_export *x, db_message_cb callback, void *userdata) {
+    if (!x->db) {
+        if (x->next_id <= 0 || x->next_id > x->last_id) return 0;
+        struct export_row r = { x, callback, userdata, 0 };
+        if (msglog_read_from(x->next_id, 1, export_log_row, &r) == 0) return 0;
+        return r.emitted;
+    }
+    int rc = sqlite3_step(x->st);
+    if (rc == SQLITE_DONE) {
+        /* resetting ends the read transaction; a full batch means there may
+           be more, read in a fresh one from the last key */
+        sqlite3_reset(x->st);
+        if (x->batch_rows < EXPORT_BATCH) return 0;
+        x->batch_rows = 0;
+        sqlite3_bind_int64(x->st, 1, (sqlite3_int64)x->last_ts);
+        sqlite3_bind_int64(x->st, 3, (sqlite3_int64)x->last_id);
+        rc = sqlite3_step(x->st);
+        if (rc == SQLITE_DONE) { sqlite3_reset(x->st); return 0; }
+    }
+    if (rc != SQLITE_ROW) return -1;
+    x->batch_rows++;
+    x->last_id = (long)sqlite3_column_int64(x->st, 0);
+    x->last_ts = (long)sqlite3_column_int64(x->st, 3);
+    const unsigned char *username = sqlite3_column_text(x->st, 1);
+    const unsigned char *content = sqlite3_column_text(x->st, 2);
+    callback((long)sqlite3_column_int64(x->st, 0), username ? (const char*)username : "",
+             content ? (const char*)content : "", (long)sqlite3_column_int64(x->st, 3), userdata);
+    return 1;
+}
+
+void db_export_close(db_export *x) {
+    if (!x) return;
+    if (x->st) sqlite3_finalize(x->st);
+    if (x->db) sqlite3_close(x->db);
+    free(x);
+}
+
+/* Turns free text into an FTS5 query: each whitespace-separated term is
+   quoted so operators and punctuation in it are literal, a trailing '*'
+   keeps prefix matching, and the terms are ANDed. Returns the term count. */
+static int fts_query(const char *text, char *out, size_t out_sz) {
+    size_t o = 0;
+    int terms = 0;
+    const char *p = text;
+    while (*p) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (!*p) break;
+        const char *end = p;
+        while (*end && *end != ' ' && *end != '\t') end++;
+        int prefix = end - p > 1 && end[-1] == '*';
+        const char *stop = prefix ? end - 1 : end;
+        /* worst case every byte is a doubled quote, plus quotes, '*' and space */
+        if (o + 2 * (size_t)(stop - p) + 5 > out_sz) break;
+        if (terms) out[o++] = ' ';
+        out[o++] = '"';
+        for (const char *q = p; q < stop; q++) {
+            if (*q == '"') out[o++] = '"';
+            out[o++] = *q;
+        }
+        out[o++] = '"';
+        if (prefix) out[o++] = '*';
+        terms++;
+        p = end;
+    }
+    out[o] = '\0';
+    return terms;
+}
+
+/* bm25 is computed for every candidate, so a common word would score the
+   whole table; only the newest SEARCH_CANDIDATES matches are ranked */
+#define SEARCH_CANDIDATES 5000
+
+int db_search_messages(const char *text, int offset, int limit, db_message_cb callback, void *userdata) {
+    static const char *sql =
+        "SELECT m.id, m.username, m.content, m.created_at FROM ("
+            "SELECT rowid, rank FROM messages_fts WHERE messages_fts MATCH ?1 "
+            "ORDER BY rowid DESC LIMIT ?4) f "
+        "JOIN messages m ON m.id = f.rowid ORDER BY f.rank, m.id DESC LIMIT ?2 OFFSET ?3;";
+    if (!g_fts || g_msglog) return -2;
+    char query[1024];
+    if (fts_query(text, query, sizeof(query)) == 0) return 0;
+    sqlite3_stmt *st = NULL;
+    uint64_t t0 = now_ns();
+    if (prepare_read(sql, &st) < 0) return -1;
+    sqlite3_bind_text(st, 1, query, -1, SQLITE_STATIC);
+    sqlite3_bind_int(st, 2, limit);
+    sqlite3_bind_int(st, 3, offset);
+    sqlite3_bind_int(st, 4, SEARCH_CANDIDATES);
+    int count = 0, rc;
+    while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+        const unsigned char *username = sqlite3_column_text(st, 1);
+        const unsigned char *content = sqlite3_column_text(st, 2);
+        if (username && content && callback) {
+            callback((long)sqlite3_column_int64(st, 0), (const char*)username, (const char*)content,
+                     (long)sqlite3_column_int64(st, 3), userdata);
+            count++;
+        }
+    }
+    db_finalize(st, DBOP_SEARCH_MESSAGES, t0);
+    return rc == SQLITE_DONE ? count : -1;
+}
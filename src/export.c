@@ -0,0 +1,110 @@
+#include "export.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "db.h"
+#include "json.h"
+#include "strbuf.h"
+
+#define CHUNK_HDR 8   /* six hex digits and CRLF, patched in once the chunk is full */
+
+static const char BINARY_MAGIC[8] = { 'C', 'H', 'A', 'T', 'E', 'X', 'P', '1' };
+
+struct export_stream {
+    db_export *cur;
+    export_format fmt;
+    strbuf sb;            /* the chunk being sent */
+    size_t off;           /* bytes of it already sent */
+    int started;
+    int finished;         /* the terminating chunk is in sb */
+    long rows;
+};
+
+export_stream *export_open(long from_ts, long to_ts, export_format fmt) {
+    export_stream *x = (export_stream*)calloc(1, sizeof(*x));
+    if (!x) return NULL;
+    x->cur = db_export_open(from_ts, to_ts);
+    if (!x->cur) { free(x); return NULL; }
+    x->fmt = fmt;
+    sb_init(&x->sb, EXPORT_CHUNK + 1024);
+    return x;
+}
+
+void export_close(export_stream *x) {
+    if (!x) return;
+    db_export_close(x->cur);
+    sb_free(&x->sb);
+    free(x);
+}
+
+static void put_le(strbuf *sb, uint64_t v, int bytes) {
+    char b[8];
+    for (int i = 0; i < bytes; i++) b[i] = (char)(v >> (8 * i));
+    sb_append(sb, b, (size_t)bytes);
+}
+
+static void ndjson_row(long id, const char *username, const char *content, long ts, void *userdata) {
+    export_stream *x = (export_stream*)userdata;
+    jsonw w; jw_init(&w, &x->sb);
+    json_message(&w, id, username, content, ts);
+    sb_putc(&x->sb, '\n');
+}
+
+static void binary_row(long id, const char *username, const char *content, long ts, void *userdata) {
+    export_stream *x = (export_stream*)userdata;
+    size_t ulen = strlen(username), clen = strlen(content);
+    if (ulen > 255) ulen = 255;
+    put_le(&x->sb, (uint64_t)id, 8);
+    put_le(&x->sb, (uint64_t)ts, 8);
+    put_le(&x->sb, ulen, 1);
+    put_le(&x->sb, clen, 4);
+    sb_append(&x->sb, username, ulen);
+    sb_append(&x->sb, content, clen);
+}
+
+/* reads rows until the chunk is full or the cursor ends */
+static int refill(export_stream *x) {
+    sb_reset(&x->sb);
+    x->off = 0;
+    sb_append(&x->sb, "000000\r\n", CHUNK_HDR);
+    if (!x->started && x->fmt == EXPORT_BINARY) sb_append(&x->sb, BINARY_MAGIC, sizeof(BINARY_MAGIC));
+    x->started = 1;
+    db_message_cb row = x->fmt == EXPORT_BINARY ? binary_row : ndjson_row;
+    int r = 1;
+    while (x->sb.len < EXPORT_CHUNK && (r = db_export_next(x->cur, row, x)) == 1) x->rows++;
+    if (r < 0 || x->sb.failed) return -1;
+    size_t payload = x->sb.len - CHUNK_HDR;
+    if (payload > 0xFFFFFF) return -1;
+    if (payload) {
+        char hdr[CHUNK_HDR + 1];
+        snprintf(hdr, sizeof(hdr), "%06zx\r\n", payload);
+        memcpy(x->sb.data, hdr, CHUNK_HDR);
+        sb_append(&x->sb, "\r\n", 2);
+    } else {
+        sb_reset(&x->sb);
+    }
+    if (r == 0) {
+        sb_append(&x->sb, "0\r\n\r\n", 5);
+        x->finished = 1;
+    }
+    return x->sb.failed ? -1 : 0;
+}
+
+int export_pending(export_stream *x, const char **data, size_t *len) {
+    if (x->off == x->sb.len) {
+        if (x->finished) { *len = 0; return 0; }
+        if (refill(x) < 0) return -1;
+    }
+    *data = x->sb.data + x->off;
+    *len = x->sb.len - x->off;
+    return 0;
+}
+
+void export_consumed(export_stream *x, size_t n) {
+    x->off += n;
+}
+
+long export_rows(const export_stream *x) {
+    return x->rows;
+}
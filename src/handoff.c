@@ -0,0 +1,160 @@
+#include "handoff.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define REC_SIZE (1 + 4 + 33 + 46)
+
+/* one datagram with up to HANDOFF_BATCH descriptors attached */
+static int send_msg(int ctl, const void *data, size_t len, const int *fds, int nfds) {
+    struct iovec iov = { (void*)data, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    union { char buf[CMSG_SPACE(HANDOFF_BATCH * sizeof(int))]; struct cmsghdr align; } ctrl;
+    if (nfds > 0) {
+        memset(&ctrl, 0, sizeof(ctrl));
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = CMSG_SPACE((size_t)nfds * sizeof(int));
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN((size_t)nfds * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, (size_t)nfds * sizeof(int));
+    }
+    ssize_t w;
+    do { w = sendmsg(ctl, &msg, 0); } while (w < 0 && errno == EINTR);
+    return w == (ssize_t)len ? 0 : -1;
+}
+
+/* returns the datagram length (0 if the peer is gone), -1 on error */
+static ssize_t recv_msg(int ctl, void *data, size_t cap, int *fds, int *nfds) {
+    struct iovec iov = { data, cap };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    union { char buf[CMSG_SPACE(HANDOFF_BATCH * sizeof(int))]; struct cmsghdr align; } ctrl;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    ssize_t r;
+    do { r = recvmsg(ctl, &msg, 0); } while (r < 0 && errno == EINTR);
+    *nfds = 0;
+    if (r < 0) return -1;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        int n = (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        for (int i = 0; i < n; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+            if (*nfds < HANDOFF_BATCH) fds[(*nfds)++] = fd; else close(fd);
+        }
+    }
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        for (int i = 0; i < *nfds; i++) close(fds[i]);
+        *nfds = 0;
+        return -1;
+    }
+    return r;
+}
+
+static void set_timeouts(int fd) {
+    struct timeval tv = { HANDOFF_TIMEOUT_SEC, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+int handoff_spawn(char **argv, int listen_fd, pid_t *pid) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0) return -1;
+    char env[16];
+    snprintf(env, sizeof(env), "%d", sv[1]);
+    setenv("HANDOFF_FD", env, 1);   /* set before fork: only exec-safe calls in the child */
+    pid_t p = fork();
+    if (p == 0) {
+        for (int fd = 3; fd < FD_SETSIZE; fd++)
+            if (fd != sv[1]) close(fd);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    unsetenv("HANDOFF_FD");
+    close(sv[1]);
+    if (p < 0) { close(sv[0]); return -1; }
+    set_timeouts(sv[0]);
+    unsigned char hello[2] = { 'L', HANDOFF_VERSION };
+    if (send_msg(sv[0], hello, sizeof(hello), &listen_fd, 1) < 0) { close(sv[0]); return -1; }
+    *pid = p;
+    return sv[0];
+}
+
+int handoff_ready(int ctl) {
+    unsigned char b[8];
+    int fds[HANDOFF_BATCH], nfds;
+    ssize_t r = recv_msg(ctl, b, sizeof(b), fds, &nfds);
+    for (int i = 0; i < nfds; i++) close(fds[i]);
+    return (r == 1 && b[0] == 'R') ? 1 : -1;
+}
+
+int handoff_send(int ctl, const handoff_conn *conns, int n) {
+    unsigned char buf[2 + HANDOFF_BATCH * REC_SIZE];
+    int fds[HANDOFF_BATCH];
+    if (n < 1 || n > HANDOFF_BATCH) return -1;
+    buf[0] = 'C';
+    buf[1] = (unsigned char)n;
+    for (int i = 0; i < n; i++) {
+        unsigned char *p = buf + 2 + i * REC_SIZE;
+        uint32_t uid = (uint32_t)conns[i].user_id;
+        p[0] = (unsigned char)conns[i].type;
+        for (int k = 0; k < 4; k++) p[1 + k] = (unsigned char)(uid >> (8 * k));
+        memcpy(p + 5, conns[i].username, 33);
+        memcpy(p + 38, conns[i].ip, 46);
+        p[37] = p[83] = '\0';
+        fds[i] = conns[i].fd;
+    }
+    return send_msg(ctl, buf, 2 + (size_t)n * REC_SIZE, fds, n);
+}
+
+int handoff_finish(int ctl) {
+    return send_msg(ctl, "E", 1, NULL, 0);
+}
+
+int handoff_take_listener(int ctl) {
+    unsigned char b[8];
+    int fds[HANDOFF_BATCH], nfds;
+    set_timeouts(ctl);
+    ssize_t r = recv_msg(ctl, b, sizeof(b), fds, &nfds);
+    if (r == 2 && b[0] == 'L' && b[1] == HANDOFF_VERSION && nfds == 1) return fds[0];
+    for (int i = 0; i < nfds; i++) close(fds[i]);
+    return -1;
+}
+
+int handoff_signal_ready(int ctl) {
+    return send_msg(ctl, "R", 1, NULL, 0);
+}
+
+int handoff_recv(int ctl, handoff_conn *out) {
+    unsigned char buf[2 + HANDOFF_BATCH * REC_SIZE];
+    int fds[HANDOFF_BATCH], nfds;
+    ssize_t r = recv_msg(ctl, buf, sizeof(buf), fds, &nfds);
+    if (r == 1 && buf[0] == 'E' && nfds == 0) return 0;
+    int n = (r >= 2 && buf[0] == 'C') ? buf[1] : -1;
+    if (n < 1 || n != nfds || r != 2 + (ssize_t)n * REC_SIZE) {
+        for (int i = 0; i < nfds; i++) close(fds[i]);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        const unsigned char *p = buf + 2 + i * REC_SIZE;
+        out[i].fd = fds[i];
+        out[i].type = (ConnType)p[0];
+        out[i].user_id = (int)((uint32_t)p[1] | (uint32_t)p[2] << 8 | (uint32_t)p[3] << 16 | (uint32_t)p[4] << 24);
+        memcpy(out[i].username, p + 5, 33);
+        memcpy(out[i].ip, p + 38, 46);
+    }
+    return n;
+}
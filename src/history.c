@@ -0,0 +1,172 @@
+#include "history.h"
+#include <limits.h>
+#include <stdlib.h>
+#include "db.h"
+#include "json.h"
+
+typedef struct {
+    long id;
+    strbuf json;          /* serialized message; capacity is reused when the slot is */
+} entry;
+
+static entry *g_ring = NULL;
+static size_t g_cap, g_count;
+static size_t g_head;     /* slot of the next append */
+static long g_floor;      /* newest id that is stored but not in the ring, 0 if none */
+static long g_late_upto;  /* newest id already out when an older one arrived late, 0 if none */
+static strbuf g_newest;   /* cached body of the default page */
+static int g_newest_valid;
+
+/* k-th entry, oldest first */
+static entry *at(size_t k) {
+    return &g_ring[(g_head + g_cap - g_count + k) % g_cap];
+}
+
+/* first position whose id is >= id */
+static size_t lower_bound(long id) {
+    size_t lo = 0, hi = g_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (at(mid)->id < id) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+static void set_json(entry *e, long id, const char *username, const char *content, long ts) {
+    e->id = id;
+    sb_reset(&e->json);
+    jsonw w; jw_init(&w, &e->json);
+    json_message(&w, id, username, content, ts);
+}
+
+struct seed { size_t n; };
+
+/* rows arrive newest first and fill the ring from its last slot down */
+static void seed_row(long id, const char *username, const char *content, long ts, void *userdata) {
+    struct seed *s = (struct seed*)userdata;
+    if (s->n == g_cap) { g_floor = id; return; }
+    set_json(&g_ring[g_cap - 1 - s->n], id, username, content, ts);
+    s->n++;
+}
+
+int history_init(size_t capacity) {
+    if (capacity <= HISTORY_PAGE_MAX) capacity = HISTORY_PAGE_MAX + 1;
+    g_ring = (entry*)calloc(capacity, sizeof(entry));
+    if (!g_ring) return -1;
+    g_cap = capacity;
+    for (size_t i = 0; i < g_cap; i++) sb_init(&g_ring[i].json, 128);
+    sb_init(&g_newest, 16384);
+    g_count = g_head = 0;
+    g_floor = 0;
+    g_late_upto = 0;
+    g_newest_valid = 0;
+    struct seed s = { 0 };
+    /* one extra row tells whether older messages exist */
+    if (db_get_messages(0, 0, (int)g_cap + 1, seed_row, &s) < 0) {
+        history_free();
+        return -1;
+    }
+    g_count = s.n;
+    return 0;
+}
+
+void history_free(void) {
+    if (!g_ring) return;
+    for (size_t i = 0; i < g_cap; i++) sb_free(&g_ring[i].json);
+    free(g_ring);
+    g_ring = NULL;
+    sb_free(&g_newest);
+    g_cap = g_count = g_head = 0;
+}
+
+void history_append(long id, const char *json, size_t len) {
+    if (!g_ring) return;
+    long newest = g_count ? at(g_count - 1)->id : g_floor;
+    /* a client may have seen up to newest without this one; it has to
+       resync rather than resume from anything up to there */
+    if (id <= newest && newest != LONG_MAX && newest > g_late_upto) g_late_upto = newest;
+    if (id <= g_floor) return;
+    g_newest_valid = 0;
+    if (g_count && id <= at(g_count - 1)->id) {
+        /* out of order: only ids above it are known complete; what is
+           older is left to the database */
+        while (g_count && at(0)->id <= id) g_count--;
+        g_floor = id;
+        return;
+    }
+    entry *e = &g_ring[g_head];
+    if (g_count == g_cap) g_floor = e->id;
+    else g_count++;
+    g_head = (g_head + 1) % g_cap;
+    e->id = id;
+    sb_reset(&e->json);
+    sb_append(&e->json, json, len);
+}
+
+void history_reset(long floor) {
+    if (!g_ring) return;
+    g_count = 0;
+    g_floor = floor;
+    g_newest_valid = 0;
+}
+
+int history_since(long after_id, int max, history_cb cb, void *userdata) {
+    if (!g_ring || after_id < g_floor || (g_late_upto && after_id <= g_late_upto)) return -1;
+    size_t lo = lower_bound(after_id + 1);
+    if (g_count - lo > (size_t)max) return -1;
+    for (size_t k = lo; k < g_count; k++)
+        if (at(k)->json.failed) return -1;
+    for (size_t k = lo; k < g_count; k++) cb(at(k)->json.data, at(k)->json.len, userdata);
+    return (int)(g_count - lo);
+}
+
+/* n entries from position first, walking up (asc) or down */
+static int write_page(strbuf *out, size_t first, size_t n, int asc, int has_more) {
+    for (size_t i = 0; i < n; i++)
+        if (at(asc ? first + i : first - i)->json.failed) return -1;
+    jsonw w; jw_init(&w, out);
+    jw_object_begin(&w);
+    jw_key(&w, "messages");
+    jw_array_begin(&w);
+    for (size_t i = 0; i < n; i++) {
+        const entry *e = at(asc ? first + i : first - i);
+        jw_raw(&w, e->json.data, e->json.len);
+    }
+    jw_array_end(&w);
+    jw_key(&w, "order"); jw_string(&w, asc ? "asc" : "desc");
+    jw_key(&w, "has_more"); jw_bool(&w, has_more);
+    long lo = n ? at(asc ? first : first - n + 1)->id : 0;
+    long hi = n ? at(asc ? first + n - 1 : first)->id : 0;
+    jw_key(&w, "before");
+    if (n) jw_int(&w, lo); else jw_null(&w);
+    jw_key(&w, "after");
+    if (n) jw_int(&w, hi); else jw_null(&w);
+    jw_object_end(&w);
+    return 0;
+}
+
+int history_page(long before_id, long after_id, int limit, strbuf *out) {
+    if (!g_ring || limit < 1) return 0;
+    size_t lim = (size_t)limit;
+    if (after_id > 0) {
+        if (after_id < g_floor) return 0;
+        size_t lo = lower_bound(after_id + 1);
+        size_t avail = g_count - lo;
+        size_t n = avail < lim ? avail : lim;
+        return write_page(out, lo, n, 1, avail > lim) == 0;
+    }
+    /* positions [0, end) are older than before_id */
+    size_t end = before_id > 0 ? lower_bound(before_id) : g_count;
+    if (end < lim && g_floor != 0) return 0;
+    size_t n = end < lim ? end : lim;
+    int has_more = end > lim || g_floor != 0;
+    if (before_id > 0 || limit != HISTORY_PAGE_MAX)
+        return write_page(out, end - 1, n, 0, has_more) == 0;
+    if (!g_newest_valid) {
+        sb_reset(&g_newest);
+        if (write_page(&g_newest, end - 1, n, 0, has_more) < 0 || g_newest.failed) return 0;
+        g_newest_valid = 1;
+    }
+    sb_append(out, g_newest.data, g_newest.len);
+    return 1;
+}
@@ -28,6 +28,12 @@ const char *NO_CONTENT =
 "Connection: close\r\n"
 "Content-Length: 0\r\n\r\n";
 
+const char *SERVICE_UNAVAILABLE =
+"HTTP/1.1 503 Service Unavailable\r\n"
+"Retry-After: 1\r\n"
+"Connection: close\r\n"
+"Content-Length: 0\r\n\r\n";
+
 int parse_http_request(char *req, char **method, char **path, char **ws_key) {
 	*method = strtok(req, " \t\r\n");
 	*path = strtok(NULL, " \t\r\n");
@@ -69,4 +75,11 @@ int get_content_length(const char *req) {
 	char buf[32];
 	if (!get_header_value(req, "Content-Length", buf, sizeof(buf))) return -1;
 	return atoi(buf);
-}
\ No newline at end of file
+}
+
+char *split_query(char *path) {
+	char *q = strchr(path, '?');
+	if (!q) return NULL;
+	*q++ = '\0';
+	return q;
+}
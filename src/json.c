@@ -0,0 +1,164 @@
+#include "json.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+void jw_init(jsonw *w, strbuf *out) {
+    memset(w, 0, sizeof(*w));
+    w->out = out;
+}
+
+/* comma before every value except the first in its container or right after a key */
+static void before_value(jsonw *w) {
+    if (w->after_key) { w->after_key = 0; return; }
+    if (w->depth > 0) {
+        if (w->has_items[w->depth - 1]) sb_putc(w->out, ',');
+        w->has_items[w->depth - 1] = 1;
+    }
+}
+
+static void open_container(jsonw *w, char c) {
+    before_value(w);
+    sb_putc(w->out, c);
+    if (w->depth < JSON_MAX_DEPTH) w->has_items[w->depth] = 0;
+    else w->out->failed = 1;
+    w->depth++;
+}
+
+static void close_container(jsonw *w, char c) {
+    if (w->depth > 0) w->depth--;
+    sb_putc(w->out, c);
+}
+
+void jw_object_begin(jsonw *w) { open_container(w, '{'); }
+void jw_object_end(jsonw *w) { close_container(w, '}'); }
+void jw_array_begin(jsonw *w) { open_container(w, '['); }
+void jw_array_end(jsonw *w) { close_container(w, ']'); }
+
+void jw_key(jsonw *w, const char *key) {
+    before_value(w);
+    sb_putc(w->out, '"');
+    json_escape(w->out, key, strlen(key));
+    sb_append(w->out, "\":", 2);
+    w->after_key = 1;
+}
+
+void jw_string_n(jsonw *w, const char *s, size_t n) {
+    before_value(w);
+    sb_putc(w->out, '"');
+    json_escape(w->out, s, n);
+    sb_putc(w->out, '"');
+}
+
+void jw_string(jsonw *w, const char *s) {
+    jw_string_n(w, s, strlen(s));
+}
+
+void jw_int(jsonw *w, long long v) {
+    before_value(w);
+    char tmp[24];
+    int n = snprintf(tmp, sizeof(tmp), "%lld", v);
+    sb_append(w->out, tmp, (size_t)n);
+}
+
+void jw_bool(jsonw *w, int v) {
+    before_value(w);
+    if (v) sb_append(w->out, "true", 4);
+    else sb_append(w->out, "false", 5);
+}
+
+void jw_null(jsonw *w) {
+    before_value(w);
+    sb_append(w->out, "null", 4);
+}
+
+void jw_raw(jsonw *w, const char *json, size_t n) {
+    before_value(w);
+    sb_append(w->out, json, n);
+}
+
+static inline int needs_escape(unsigned char c) {
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+/* length of the leading run of bytes that can be copied verbatim */
+static size_t safe_prefix(const char *s, size_t n) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i ctl = _mm_set1_epi8(0x1F);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        /* unsigned v <= 0x1F  <=>  min(v, 0x1F) == v */
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v),
+            _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask) return i + (size_t)__builtin_ctz((unsigned)mask);
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t bslash = vdupq_n_u8('\\');
+    const uint8x16_t space = vdupq_n_u8(0x20);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)(s + i));
+        uint8x16_t hit = vorrq_u8(vcltq_u8(v, space), vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, bslash)));
+        if (vmaxvq_u8(hit)) break;   /* pinpoint it with the scalar loop below */
+    }
+#else
+    /* SWAR: 8 bytes at a time */
+    const uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t v;
+        memcpy(&v, s + i, 8);
+        uint64_t lt20 = (v - ones * 0x20) & ~v;
+        uint64_t xq = v ^ (ones * '"'), xb = v ^ (ones * '\\');
+        uint64_t eq = ((xq - ones) & ~xq) | ((xb - ones) & ~xb);
+        if ((lt20 | eq) & highs) break;
+    }
+#endif
+    while (i < n && !needs_escape((unsigned char)s[i])) i++;
+    return i;
+}
+
+void json_escape(strbuf *out, const char *s, size_t n) {
+    static const char hex[] = "0123456789abcdef";
+    size_t i = 0;
+    while (i < n) {
+        size_t run = safe_prefix(s + i, n - i);
+        if (run) { sb_append(out, s + i, run); i += run; }
+        if (i >= n) break;
+        unsigned char c = (unsigned char)s[i++];
+        char esc[6] = { '\\', 0, 0, 0, 0, 0 };
+        size_t elen = 2;
+        switch (c) {
+        case '"':  esc[1] = '"'; break;
+        case '\\': esc[1] = '\\'; break;
+        case '\b': esc[1] = 'b'; break;
+        case '\f': esc[1] = 'f'; break;
+        case '\n': esc[1] = 'n'; break;
+        case '\r': esc[1] = 'r'; break;
+        case '\t': esc[1] = 't'; break;
+        default:
+            esc[1] = 'u'; esc[2] = '0'; esc[3] = '0';
+            esc[4] = hex[c >> 4]; esc[5] = hex[c & 0xF];
+            elen = 6;
+        }
+        sb_append(out, esc, elen);
+    }
+}
+
+void json_message(jsonw *w, long id, const char *username, const char *content, long ts) {
+    jw_object_begin(w);
+    jw_key(w, "id"); jw_int(w, id);
+    jw_key(w, "username"); jw_string(w, username);
+    jw_key(w, "content"); jw_string(w, content);
+    jw_key(w, "timestamp"); jw_int(w, ts);
+    jw_object_end(w);
+}
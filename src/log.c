@@ -0,0 +1,298 @@
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_SLOTS 512            /* per thread; power of two */
+#define REC_TEXT 240
+#define BATCH_BYTES 65536
+#define DRAIN_INTERVAL_MS 20
+
+typedef struct {
+    int64_t ts_ns;                /* wall clock, formatted by the writer */
+    uint32_t len;
+    uint32_t level;
+    char text[REC_TEXT];
+} log_rec;
+
+/* single producer (the owning thread), single consumer (the writer thread) */
+typedef struct log_ring {
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+    struct log_ring *next;
+    log_rec recs[RING_SLOTS];
+} log_ring;
+
+static const char *level_names[] = { "debug", "info", "warn", "error", "off" };
+
+static volatile sig_atomic_t g_level = LOG_INFO;
+static int g_running = 0;
+static log_ring *g_rings = NULL;
+static pthread_mutex_t g_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local log_ring *t_ring = NULL;
+static uint64_t g_dropped = 0;
+
+static pthread_t g_writer;
+static int g_writer_stop = 0;
+static int g_fd = 2;
+static char g_path[512];
+static size_t g_rotate_bytes = 0;
+static int g_keep = 0;
+static size_t g_file_bytes = 0;
+
+void log_set_level(log_level lvl) {
+    if (lvl < LOG_DEBUG) lvl = LOG_DEBUG;
+    if (lvl > LOG_OFF) lvl = LOG_OFF;
+    g_level = lvl;
+}
+
+log_level log_get_level(void) {
+    return (log_level)g_level;
+}
+
+int log_level_parse(const char *name) {
+    for (int i = 0; i <= LOG_OFF; i++)
+        if (strcmp(name, level_names[i]) == 0) return i;
+    return -1;
+}
+
+static void on_sigusr(int sig) {
+    int lvl = g_level + (sig == SIGUSR1 ? -1 : 1);
+    if (lvl >= LOG_DEBUG && lvl <= LOG_OFF) g_level = lvl;
+}
+
+uint64_t log_dropped(void) {
+    return __atomic_load_n(&g_dropped, __ATOMIC_RELAXED);
+}
+
+static log_ring *my_ring(void) {
+    if (t_ring) return t_ring;
+    log_ring *r = (log_ring*)calloc(1, sizeof(*r));
+    if (!r) return NULL;
+    pthread_mutex_lock(&g_rings_lock);
+    r->next = g_rings;
+    g_rings = r;
+    pthread_mutex_unlock(&g_rings_lock);
+    t_ring = r;
+    return r;
+}
+
+static int64_t wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* keeps one record on one line whatever the caller passed in */
+static void sanitize(char *s, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        if ((unsigned char)s[i] < 0x20 || s[i] == 0x7f) s[i] = '?';
+}
+
+static size_t format_prefix(char *out, size_t cap, int64_t ts_ns, unsigned level) {
+    time_t sec = (time_t)(ts_ns / 1000000000LL);
+    struct tm tm;
+    gmtime_r(&sec, &tm);
+    int n = snprintf(out, cap, "ts=%04d-%02d-%02dT%02d:%02d:%02d.%03dZ level=%s ",
+        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+        (int)(ts_ns / 1000000 % 1000), level_names[level]);
+    return n > 0 ? (size_t)n : 0;
+}
+
+static void vlog(log_level lvl, const char *event, const char *fmt, va_list ap) {
+    if (!__atomic_load_n(&g_running, __ATOMIC_ACQUIRE)) {
+        /* before log_init / after log_shutdown: write synchronously */
+        char line[REC_TEXT + 64];
+        size_t n = format_prefix(line, sizeof(line), wall_ns(), lvl);
+        int m = snprintf(line + n, sizeof(line) - n, "event=%s ", event);
+        if (m > 0) n += (size_t)m < sizeof(line) - n ? (size_t)m : sizeof(line) - n - 1;
+        m = vsnprintf(line + n, sizeof(line) - n, fmt, ap);
+        if (m > 0) n += (size_t)m < sizeof(line) - n ? (size_t)m : sizeof(line) - n - 1;
+        sanitize(line, n);
+        fprintf(stderr, "%.*s\n", (int)n, line);
+        return;
+    }
+    log_ring *r = my_ring();
+    if (!r) return;
+    uint32_t head = r->head;
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head - tail == RING_SLOTS) {
+        __atomic_fetch_add(&g_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    log_rec *rec = &r->recs[head & (RING_SLOTS - 1)];
+    rec->ts_ns = wall_ns();
+    rec->level = (uint32_t)lvl;
+    size_t n = 0;
+    int m = snprintf(rec->text, REC_TEXT, "event=%s ", event);
+    if (m > 0) n = (size_t)m < REC_TEXT ? (size_t)m : REC_TEXT - 1;
+    m = vsnprintf(rec->text + n, REC_TEXT - n, fmt, ap);
+    if (m > 0) n += (size_t)m < REC_TEXT - n ? (size_t)m : REC_TEXT - n - 1;
+    sanitize(rec->text, n);
+    rec->len = (uint32_t)n;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void log_event(log_level lvl, const char *event, const char *fmt, ...) {
+    if ((int)lvl < g_level) return;
+    va_list ap;
+    va_start(ap, fmt);
+    vlog(lvl, event, fmt, ap);
+    va_end(ap);
+}
+
+static void log_emit(log_level lvl, const char *event, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vlog(lvl, event, fmt, ap);
+    va_end(ap);
+}
+
+void log_access(const char *ip, const char *method, const char *path, int status,
+                size_t bytes, uint64_t dur_ns) {
+    if ((int)LOG_INFO < g_level) return;
+    log_emit(LOG_INFO, "access", "ip=%s method=%s path=%.96s status=%d bytes=%zu dur_us=%llu",
+        ip && ip[0] ? ip : "-", method && method[0] ? method : "-", path && path[0] ? path : "-",
+        status, bytes, (unsigned long long)(dur_ns / 1000));
+}
+
+/* ---- writer thread ---- */
+
+static int open_log_file(void) {
+    int fd = open(g_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) return -1;
+    struct stat st;
+    g_file_bytes = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+    return fd;
+}
+
+/* path.(keep-1) -> path.keep, ..., path -> path.1, then reopen path */
+static void rotate(void) {
+    char from[600], to[600];
+    for (int i = g_keep - 1; i >= 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", g_path, i);
+        snprintf(to, sizeof(to), "%s.%d", g_path, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", g_path);
+    rename(g_path, to);
+    int fd = open_log_file();
+    if (fd < 0) return;   /* keep appending to the renamed file */
+    close(g_fd);
+    g_fd = fd;
+}
+
+static void write_batch(const char *buf, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t w = write(g_fd, buf + off, len - off);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        off += (size_t)w;
+    }
+    g_file_bytes += len;
+    if (g_path[0] && g_rotate_bytes && g_keep > 0 && g_file_bytes >= g_rotate_bytes) rotate();
+}
+
+/* moves every pending record into batch, flushing whenever it fills; returns records drained */
+static size_t drain_all(char *batch, size_t *blen) {
+    size_t drained = 0;
+    pthread_mutex_lock(&g_rings_lock);
+    log_ring *rings = g_rings;
+    pthread_mutex_unlock(&g_rings_lock);
+    /* rings are only ever prepended, so this snapshot stays valid */
+    for (log_ring *r = rings; r; r = r->next) {
+        uint32_t tail = r->tail;
+        uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        while (tail != head) {
+            const log_rec *rec = &r->recs[tail & (RING_SLOTS - 1)];
+            if (*blen + REC_TEXT + 64 > BATCH_BYTES) {
+                write_batch(batch, *blen);
+                *blen = 0;
+            }
+            *blen += format_prefix(batch + *blen, BATCH_BYTES - *blen, rec->ts_ns, rec->level);
+            memcpy(batch + *blen, rec->text, rec->len);
+            *blen += rec->len;
+            batch[(*blen)++] = '\n';
+            tail++;
+            drained++;
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+    return drained;
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    char *batch = (char*)malloc(BATCH_BYTES);
+    if (!batch) return NULL;
+    uint64_t reported_drops = 0;
+    for (;;) {
+        int stopping = __atomic_load_n(&g_writer_stop, __ATOMIC_ACQUIRE);
+        size_t blen = 0;
+        drain_all(batch, &blen);
+        uint64_t drops = log_dropped();
+        if (drops != reported_drops) {
+            blen += format_prefix(batch + blen, BATCH_BYTES - blen, wall_ns(), LOG_WARN);
+            blen += (size_t)snprintf(batch + blen, BATCH_BYTES - blen,
+                "event=log_dropped count=%llu\n", (unsigned long long)(drops - reported_drops));
+            reported_drops = drops;
+        }
+        if (blen) write_batch(batch, blen);
+        if (stopping) break;
+        struct timespec ts = { 0, DRAIN_INTERVAL_MS * 1000000L };
+        nanosleep(&ts, NULL);
+    }
+    free(batch);
+    return NULL;
+}
+
+int log_init(const char *path, size_t rotate_bytes, int keep) {
+    if (g_running) return 0;
+    g_path[0] = '\0';
+    g_fd = 2;
+    if (path && path[0]) {
+        snprintf(g_path, sizeof(g_path), "%s", path);
+        g_fd = open_log_file();
+        if (g_fd < 0) { g_fd = 2; g_path[0] = '\0'; return -1; }
+    }
+    g_rotate_bytes = rotate_bytes;
+    g_keep = keep;
+    g_writer_stop = 0;
+    if (pthread_create(&g_writer, NULL, writer_main, NULL) != 0) {
+        if (g_fd != 2) close(g_fd);
+        g_fd = 2;
+        return -1;
+    }
+    signal(SIGUSR1, on_sigusr);
+    signal(SIGUSR2, on_sigusr);
+    __atomic_store_n(&g_running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void log_shutdown(void) {
+    if (!g_running) return;
+    __atomic_store_n(&g_running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_writer_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(g_writer, NULL);
+    pthread_mutex_lock(&g_rings_lock);
+    while (g_rings) {
+        log_ring *next = g_rings->next;
+        free(g_rings);
+        g_rings = next;
+    }
+    pthread_mutex_unlock(&g_rings_lock);
+    t_ring = NULL;
+    if (g_fd != 2) close(g_fd);
+    g_fd = 2;
+}
@@ -1,6 +1,7 @@
 #define _DARWIN_C_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <signal.h>
 #include <stdio.h>
@@ -11,6 +12,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <time.h>
 
@@ -18,15 +20,30 @@
 #include "websocket.h"
 #include "util.h"
 #include "db.h"
+#include "arena.h"
 #include "auth.h"
+#include "conn.h"
+#include "export.h"
+#include "handoff.h"
+#include "history.h"
+#include "json.h"
+#include "log.h"
+#include "metrics.h"
+#include "overload.h"
+#include "ratelimit.h"
+#include "relay.h"
+#include "token.h"
+#include "trace.h"
+#include "workpool.h"
 
-typedef enum { CONN_HTTP=0, CONN_WS=1 } ConnType;
-typedef struct {
-	int fd;
-	ConnType type;
-	int user_id;              /* for WS */
-	char username[33];        /* for WS */
-} Conn;
+/* per-request scratch (read buffer, header copy, body, response JSON);
+   reset before each request, so the common path never calls malloc */
+#define REQ_BUF_SIZE 8192
+#define REQ_ARENA_CHUNK (64 * 1024)
+static arena g_req_arena;
+
+/* response status and size per fd, filled in by conn_send() for the access log */
+static struct { int status; size_t bytes; } g_resp[FD_SETSIZE];
 
 static int read_remaining(int fd, char *buf, int already_have, int total_need) {
     int off = already_have;
@@ -37,28 +54,52 @@ static int read_remaining(int fd, char *buf, int already_have, int total_need) {
         if (rdy <= 0) return -1; /* timeout or error */
         ssize_t got = recv(fd, buf + off, (size_t)(total_need - off), 0);
         if (got <= 0) return -1;
+        metrics_add(CTR_BYTES_IN, got);
         off += (int)got;
     }
     return 0;
 }
 
-static void send_simple(int fd, const char *status, const char *ctype, const char *body) {
+static ssize_t conn_send(int fd, const void *data, size_t len) {
+	ssize_t n = send(fd, data, len, 0);
+	if (n > 0) {
+		metrics_add(CTR_BYTES_OUT, n);
+		if (!g_resp[fd].status && len > 12 && memcmp(data, "HTTP/1.1 ", 9) == 0)
+			g_resp[fd].status = atoi((const char*)data + 9);
+		g_resp[fd].bytes += (size_t)n;
+	}
+	return n;
+}
+
+static void send_response(int fd, const char *status, const char *ctype, const char *body, size_t blen) {
 	char hdr[512];
-	int blen = (int)strlen(body);
 	int n = snprintf(hdr, sizeof(hdr),
 		"HTTP/1.1 %s\r\n"
 		"Content-Type: %s\r\n"
-		"Content-Length: %d\r\n"
+		"Content-Length: %zu\r\n"
 		"Connection: close\r\n"
 		"\r\n", status, ctype, blen);
-	send(fd, hdr, (size_t)n, 0);
-	if (blen) send(fd, body, (size_t)blen, 0);
+	conn_send(fd, hdr, (size_t)n);
+	if (blen) conn_send(fd, body, blen);
+}
+
+static void send_simple(int fd, const char *status, const char *ctype, const char *body) {
+	send_response(fd, status, ctype, body, strlen(body));
 }
 
 static void send_json(int fd, const char *status, const char *json) {
 	send_simple(fd, status, "application/json; charset=utf-8", json ? json : "");
 }
 
+/* sends a finished JSON document, or 500 if building it ran out of memory */
+static void send_json_buf(int fd, const char *status, const strbuf *sb) {
+	if (sb->failed) {
+		send_simple(fd, "500 Internal Server Error", "text/plain; charset=utf-8", "");
+		return;
+	}
+	send_response(fd, status, "application/json; charset=utf-8", sb->data, sb->len);
+}
+
 static void set_cookie_and_no_content(int fd, const char *name, const char *value, int max_age) {
 	char hdr[512];
 	int n = snprintf(hdr, sizeof(hdr),
@@ -66,43 +107,451 @@ static void set_cookie_and_no_content(int fd, const char *name, const char *valu
 		"Set-Cookie: %s=%s; HttpOnly; SameSite=Lax; Path=/; Max-Age=%d\r\n"
 		"Connection: close\r\n"
 		"Content-Length: 0\r\n\r\n", name, value, max_age);
-	send(fd, hdr, (size_t)n, 0);
+	conn_send(fd, hdr, (size_t)n);
+}
+
+/* token buckets guarding the PBKDF2 endpoints: per client IP and per username */
+static ratelimit *g_ip_limit = NULL;
+static ratelimit *g_user_limit = NULL;
+
+static void send_too_many(int fd, int retry_after) {
+	char hdr[256];
+	int n = snprintf(hdr, sizeof(hdr),
+		"HTTP/1.1 429 Too Many Requests\r\n"
+		"Retry-After: %d\r\n"
+		"Connection: close\r\n"
+		"Content-Length: 0\r\n\r\n", retry_after);
+	conn_send(fd, hdr, (size_t)n);
+}
+
+/* Admission control. New connections get a 503 when no slot is free; new
+   requests get one when they arrive late in a turn while the loop is
+   overloaded (overload.h), and WebSocket and /events requests also once
+   only CONN_HEADROOM slots are left for short requests. Established chat
+   connections are never shed. */
+#define ACCEPT_BATCH 64
+#define CONN_HEADROOM 64
+
+/* for a connection that never got a slot: whatever the client already sent
+   is read first, so closing does not reset the 503 away */
+static void refuse_conn(int fd) {
+	char junk[1024];
+	metrics_add(CTR_SHED_ACCEPT, 1);
+	if (send(fd, SERVICE_UNAVAILABLE, strlen(SERVICE_UNAVAILABLE), MSG_DONTWAIT) > 0)
+		while (recv(fd, junk, sizeof(junk), MSG_DONTWAIT) > 0) {}
+	close(fd);
+}
+
+/* SESSION_MODE=token: the sid cookie is a signed token instead of a sessions row */
+static int g_token_sessions = 0;
+
+/* resolves the sid cookie to a user; fills uname (empty if unknown) when non-NULL.
+   returns 1 if authenticated, else 0 */
+static int authenticate(const char *req, int *uid, char *uname, size_t uname_sz) {
+	char sid[256] = {0};
+	if (uname && uname_sz) uname[0] = '\0';
+	if (!get_cookie_value(req, "sid", sid, sizeof(sid)) || !sid[0]) return 0;
+	if (g_token_sessions) return token_verify(sid, uid, uname, uname_sz);
+	if (db_get_session_user(sid, uid) != 1) return 0;
+	if (uname && db_get_username_by_id(*uid, uname, uname_sz) != 0) uname[0] = '\0';
+	return 1;
+}
+
+/* Counts behind /stats and the /events stream, kept up to date as users
+   register and WebSockets open and close, so neither touches SQLite.
+   Changes are pushed to SSE subscribers at most once per STATS_PUSH_MS;
+   when nothing changed nothing is sent. */
+#define STATS_PUSH_MS 1000
+static int g_total_users = 0;
+static int g_pushed_users = -1, g_pushed_online = -1;
+static uint64_t g_stats_next_ns = 0;
+/* with RELAY the other instances register users too; the count is then
+   re-read from the shared table this often */
+#define USERS_REFRESH_SEC 10
+static uint64_t g_users_next_ns = 0;
+
+/* PBKDF2 runs on the worker pool so logins never stall the event loop */
+#define AUTH_QUEUE_MAX 64
+static workpool *g_auth_pool = NULL;
+
+typedef enum { AUTH_REGISTER, AUTH_LOGIN } AuthKind;
+typedef struct {
+	AuthKind kind;
+	conn_handle conn;     /* resolved again when the job comes back */
+	int user_id;
+	char username[64];
+	char password[256];
+	char hash[256];       /* login: stored hash in; register: new hash out */
+	int result;
+	uint64_t queued_ns;   /* submitted */
+	uint64_t start_ns;    /* picked up by a worker */
+	uint64_t end_ns;      /* hash finished */
+} AuthJob;
+
+/* History pages older than the ring and searches run on reader threads, each
+   on its own read-only connection, so a slow read neither stalls the loop
+   nor waits behind message inserts. */
+#define READ_QUEUE_MAX 256
+static workpool *g_read_pool = NULL;
+
+typedef enum { READ_HISTORY, READ_SEARCH } ReadKind;
+typedef struct {
+	ReadKind kind;
+	conn_handle conn;
+	long before_id, after_id; /* history */
+	char q[256];              /* search */
+	int offset, limit;
+	int result;               /* rows, or < 0 on error */
+	strbuf out;               /* response body, built on the worker */
+	uint64_t queued_ns;
+	uint64_t start_ns;
+	uint64_t end_ns;
+} ReadJob;
+
+/* Bulk history exports: at most EXPORT_MAX at once, each written at most
+   EXPORT_SLICE bytes per loop turn so one fast reader cannot crowd out chat;
+   an export whose client stops reading for EXPORT_STALL_SEC is dropped. */
+#define EXPORT_MAX 4
+#define EXPORT_SLICE (256 * 1024)
+#define EXPORT_STALL_SEC 60
+static int g_exports = 0;
+
+static void close_conn(Conn *c) {
+	if (c->type == CONN_EXPORT) {
+		metrics_add(CTR_EXPORT_MESSAGES, export_rows(c->exp));
+		export_close(c->exp);
+		c->exp = NULL;
+		g_exports--;
+	}
+	if (c->type == CONN_WS) {
+		ws_rx_free(&c->rx);
+		ws_tx_free(&c->tx);
+		metrics_add(CTR_WS_ACTIVE, -1);
+		log_event(LOG_INFO, "ws_close", "fd=%d uid=%d user=%s", c->fd, c->user_id, c->username);
+	} else if (c->type == CONN_SSE) {
+		metrics_add(CTR_SSE_ACTIVE, -1);
+	} else {
+		if (c->route != ROUTE_COUNT) {
+			/* every handler ends by sending, so the tail since the last mark is the send */
+			trace_phase(&c->tr, PH_SEND);
+			uint64_t dur = now_ns() - c->tr.start;
+			metrics_request(c->route, dur);
+			log_access(c->ip, c->method, c->path, g_resp[c->fd].status, g_resp[c->fd].bytes, dur);
+			trace_end(&c->tr, c->method, c->path, g_resp[c->fd].status);
+		}
+		metrics_add(CTR_HTTP_ACTIVE, -1);
+	}
+	close(c->fd);
+	conn_release(c);
 }
 
-// count active websocket connections
-static int count_online_ws(Conn *conns) {
-	int count = 0;
-	for (int i = 0; i < FD_SETSIZE; i++) {
-		if (conns[i].fd >= 0 && conns[i].type == CONN_WS) count++;
+static void auth_work(void *arg) {
+	AuthJob *job = (AuthJob*)arg;
+	job->start_ns = now_ns();
+	metrics_pbkdf2_queue(job->start_ns - job->queued_ns);
+	if (job->kind == AUTH_LOGIN) job->result = verify_password_pbkdf2(job->password, job->hash);
+	else job->result = hash_password_pbkdf2(job->password, job->hash, sizeof(job->hash));
+	job->end_ns = now_ns();
+}
+
+/* runs on the event loop once the worker has finished hashing */
+static void auth_done(void *arg) {
+	AuthJob *job = (AuthJob*)arg;
+	Conn *c = conn_lookup(job->conn);
+	if (!c) { free(job); return; }
+	int fd = c->fd;
+	trace *tr = &c->tr;
+	uint64_t now = now_ns();
+	/* waiting for a worker plus the hand-back through the completion pipe */
+	trace_add(tr, PH_QUEUE, (job->start_ns - job->queued_ns) + (now - job->end_ns));
+	trace_add(tr, PH_HASH, job->end_ns - job->start_ns);
+	tr->mark = now;
+	if (job->kind == AUTH_REGISTER) {
+		int r = job->result < 0 ? -1 : db_create_user(job->username, job->hash);
+		trace_phase(tr, PH_DB);
+		if (r == -2) {
+			send_json(fd, "409 Conflict", "{\"error\":\"username_taken\"}");
+		} else if (r == 0) {
+			g_total_users++;
+			send_simple(fd, "201 Created", "text/plain; charset=utf-8", "ok");
+		} else {
+			conn_send(fd, BAD_REQUEST, strlen(BAD_REQUEST));
+		}
+	} else if (job->result != 1) {
+		log_event(LOG_WARN, "login_failed", "ip=%s user=%s reason=bad_password", c->ip, job->username);
+		char limit_key[INET6_ADDRSTRLEN + 64];
+		snprintf(limit_key, sizeof(limit_key), "%s|%s", c->ip, job->username);
+		ratelimit_take(g_user_limit, limit_key);
+		conn_send(fd, UNAUTHORIZED, strlen(UNAUTHORIZED));
+	} else {
+		char sid[TOKEN_MAX_LEN];
+		long ttl = TOKEN_TTL_SEC;
+		int rc;
+		if (g_token_sessions) {
+			rc = token_issue(job->user_id, job->username, time(NULL)+ttl, sid, sizeof(sid));
+		} else {
+			rc = generate_session_id(sid, sizeof(sid));
+			if (rc == 0) rc = db_create_session(sid, job->user_id, time(NULL)+ttl);
+		}
+		trace_phase(tr, g_token_sessions ? PH_AUTH : PH_DB);
+		if (rc < 0) {
+			conn_send(fd, BAD_REQUEST, strlen(BAD_REQUEST));
+		} else {
+			set_cookie_and_no_content(fd, "sid", sid, (int)ttl);
+		}
 	}
-	return count;
+	close_conn(c);
+	free(job);
 }
 
-// helper for building JSON message array
+/* hands the job to the pool and parks the connection; on a full queue answers 503 */
+static void submit_auth_job(Conn *c, AuthJob *job) {
+	job->conn = conn_handle_of(c);
+	job->queued_ns = now_ns();
+	c->tr.mark = job->queued_ns;
+	if (workpool_submit(g_auth_pool, auth_work, auth_done, job) < 0) {
+		conn_send(c->fd, SERVICE_UNAVAILABLE, strlen(SERVICE_UNAVAILABLE));
+		close_conn(c);
+		free(job);
+		return;
+	}
+	c->type = CONN_BUSY;
+}
+
+static void stats_json(strbuf *sb) {
+	jsonw w; jw_init(&w, sb);
+	jw_object_begin(&w);
+	jw_key(&w, "total_users"); jw_int(&w, g_total_users);
+	jw_key(&w, "online_users"); jw_int(&w, conn_ws_count());
+	jw_object_end(&w);
+}
+
+static void stats_event(strbuf *sb) {
+	sb_puts(sb, "event: stats\ndata: ");
+	stats_json(sb);
+	sb_puts(sb, "\n\n");
+}
+
+static void refresh_user_count(uint64_t now) {
+	if (now < g_users_next_ns) return;
+	g_users_next_ns = now + (uint64_t)USERS_REFRESH_SEC * 1000000000;
+	int users = db_get_user_count();
+	if (users >= 0) g_total_users = users;
+}
+
+/* pushes the counts to every /events subscriber if they moved since the last
+   push; returns ms until a coalesced push is due, or -1 if none is pending */
+static long stats_push(uint64_t now) {
+	int online = conn_ws_count();
+	if (online == g_pushed_online && g_total_users == g_pushed_users) return -1;
+	if (conn_sse_count() == 0) {
+		/* new subscribers get the current counts when they connect */
+		g_pushed_online = online; g_pushed_users = g_total_users;
+		return -1;
+	}
+	if (now < g_stats_next_ns) return (long)((g_stats_next_ns - now) / 1000000) + 1;
+	char buf[128];
+	strbuf sb; sb_init_buf(&sb, buf, sizeof(buf));
+	stats_event(&sb);
+	for (int i = conn_sse_count() - 1; i >= 0; i--) {
+		Conn *c = conn_sse_at(i);
+		if (conn_send(c->fd, sb.data, sb.len) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) close_conn(c);
+	}
+	sb_free(&sb);
+	g_pushed_online = online; g_pushed_users = g_total_users;
+	g_stats_next_ns = now + (uint64_t)STATS_PUSH_MS * 1000000;
+	return -1;
+}
+
+/* sends the next slice of an export; 0 once it is finished or failed */
+static int export_pump(Conn *c) {
+	size_t sent = 0;
+	while (sent < EXPORT_SLICE) {
+		const char *data;
+		size_t len;
+		if (export_pending(c->exp, &data, &len) < 0) {
+			log_event(LOG_ERROR, "export_failed", "fd=%d rows=%ld", c->fd, export_rows(c->exp));
+			return 0;
+		}
+		if (len == 0) return 0;
+		ssize_t n = conn_send(c->fd, data, len);
+		if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+		export_consumed(c->exp, (size_t)n);
+		c->io_ns = now_ns();
+		sent += (size_t)n;
+		if ((size_t)n < len) break;   /* socket buffer full: wait for writability */
+	}
+	return 1;
+}
+
+/* Replay for /ws?since=<id>: a reconnecting client gets the messages it
+   missed from the history ring, queued on its connection and sent as the
+   socket takes them. Past WS_REPLAY_MAX, or further back than the ring
+   reaches, it is told to reload history over HTTP instead, so replay never
+   reads the database on the event loop. */
+#define WS_REPLAY_MAX 1000
+static const char WS_RESYNC[] = "{\"resync\":true}";
+
+/* sends to one WebSocket; a client that cannot keep up is shut down and
+   closed when the loop next sees it readable, then reconnects with since= */
+static void ws_deliver(Conn *c, const char *json, size_t len) {
+	if (ws_send_queued(c->fd, &c->tx, json, len) == 0) return;
+	if (ws_tx_pending(&c->tx))
+		log_event(LOG_WARN, "ws_slow_client", "fd=%d uid=%d queued=%zu", c->fd, c->user_id, c->tx.len - c->tx.off);
+	ws_tx_free(&c->tx);
+	shutdown(c->fd, SHUT_RDWR);
+}
+
+static void replay_frame(const char *json, size_t len, void *userdata) {
+	ws_deliver((Conn*)userdata, json, len);
+}
+
+static void ws_replay(Conn *c, long since) {
+	if (history_since(since, WS_REPLAY_MAX, replay_frame, c) >= 0) return;
+	ws_deliver(c, WS_RESYNC, sizeof(WS_RESYNC) - 1);
+}
+
+/* deep OFFSETs make SQLite rank and skip every earlier match */
+#define SEARCH_OFFSET_MAX 1000
+
+// collects one page of history into a JSON array
 struct msg_builder {
-	char *buf;
-	int offset;
-	int first;
+	jsonw *w;
+	int count;
+	int limit;       /* rows past the limit only mark has_more */
+	int has_more;
+	long min_id;
+	long max_id;
 };
 
-static void append_message_json(const char *username, const char *content, long ts, void *userdata) {
+static void append_message_json(long id, const char *username, const char *content, long ts, void *userdata) {
 	struct msg_builder *mb = (struct msg_builder*)userdata;
-	if (!mb->first) mb->offset += sprintf(mb->buf + mb->offset, ",");
-	mb->first = 0;
-	
-	// basic JSON escaping for quotes and backslashes
-	char esc[4096] = {0};
-	const char *p = content;
-	char *out = esc;
-	while (*p && (out - esc) < 4000) {
-		if (*p == '"' || *p == '\\') *out++ = '\\';
-		*out++ = *p++;
-	}
-	*out = '\0';
-	
-	mb->offset += sprintf(mb->buf + mb->offset,
-		"{\"username\":\"%s\",\"content\":\"%s\",\"timestamp\":%ld}",
-		username, esc, ts);
+	if (mb->count == mb->limit) { mb->has_more = 1; return; }
+	mb->count++;
+	if (mb->min_id == 0 || id < mb->min_id) mb->min_id = id;
+	if (id > mb->max_id) mb->max_id = id;
+	json_message(mb->w, id, username, content, ts);
+}
+
+/* hands a message to every local WebSocket and the history ring; used for
+   messages accepted here and for those relayed from other instances */
+static void deliver_message(long id, const char *username, const char *content, long ts, void *userdata) {
+	(void)userdata;
+	// serialize once: the same JSON is broadcast and kept for replay
+	char jbuf[512];
+	strbuf js; sb_init_buf(&js, jbuf, sizeof(jbuf));
+	jsonw w; jw_init(&w, &js);
+	json_message(&w, id > 0 ? id : 0, username, content, ts);
+	if (!js.failed) {
+		if (id > 0) history_append(id, js.data, js.len);
+		uint64_t fan_t0 = now_ns();
+		for (int k = 0; k < conn_ws_count(); k++)
+			ws_deliver(conn_ws_at(k), js.data, js.len);
+		metrics_fanout(now_ns() - fan_t0);
+	}
+	sb_free(&js);
+}
+
+/* The history ring only holds relayed messages while none can have been
+   missed. At each gap the relay reports, everything stored so far is left
+   to the database; while the hub link is down, everything is. */
+static uint64_t g_relay_gaps = 0;
+
+static void relay_check_history(void) {
+	uint64_t gaps = relay_gaps();
+	if (gaps == g_relay_gaps) return;
+	g_relay_gaps = gaps;
+	long last = relay_up() ? db_last_message_id() : -1;
+	history_reset(last >= 0 ? last : LONG_MAX);
+	if (last >= 0) log_event(LOG_INFO, "history_reset", "floor=%ld", last);
+}
+
+/* builds the response body; runs on a reader thread */
+static void read_work(void *arg) {
+	ReadJob *job = (ReadJob*)arg;
+	job->start_ns = now_ns();
+	jsonw w; jw_init(&w, &job->out);
+	struct msg_builder mb = { &w, 0, job->limit, 0, 0, 0 };
+	jw_object_begin(&w);
+	jw_key(&w, "messages");
+	jw_array_begin(&w);
+	if (job->kind == READ_SEARCH) {
+		job->result = db_search_messages(job->q, job->offset, job->limit + 1, append_message_json, &mb);
+		jw_array_end(&w);
+		jw_key(&w, "has_more"); jw_bool(&w, mb.has_more);
+		jw_key(&w, "next_offset");
+		if (mb.has_more) jw_int(&w, job->offset + mb.count); else jw_null(&w);
+	} else {
+		// one extra row tells us whether another page exists
+		job->result = db_get_messages(job->before_id, job->after_id, job->limit + 1, append_message_json, &mb);
+		jw_array_end(&w);
+		jw_key(&w, "order"); jw_string(&w, job->after_id > 0 ? "asc" : "desc");
+		jw_key(&w, "has_more"); jw_bool(&w, mb.has_more);
+		jw_key(&w, "before");
+		if (mb.count > 0) jw_int(&w, mb.min_id); else jw_null(&w);
+		jw_key(&w, "after");
+		if (mb.count > 0) jw_int(&w, mb.max_id); else jw_null(&w);
+	}
+	jw_object_end(&w);
+	job->end_ns = now_ns();
+}
+
+/* runs on the event loop once the page is built */
+static void read_done(void *arg) {
+	ReadJob *job = (ReadJob*)arg;
+	Conn *c = conn_lookup(job->conn);
+	if (c) {
+		uint64_t now = now_ns();
+		trace_add(&c->tr, PH_QUEUE, (job->start_ns - job->queued_ns) + (now - job->end_ns));
+		trace_add(&c->tr, PH_DB, job->end_ns - job->start_ns);   /* includes encoding each row */
+		c->tr.mark = now;
+		if (job->kind == READ_SEARCH && job->result < 0)
+			send_json(c->fd, "503 Service Unavailable", "{\"error\":\"search_unavailable\"}");
+		else
+			send_json_buf(c->fd, "200 OK", &job->out);
+		close_conn(c);
+	}
+	sb_free(&job->out);
+	free(job);
+}
+
+/* hands the read to a reader thread and parks the connection; the message
+   log is event-loop only, so with it the read is done here and now */
+static void submit_read_job(Conn *c, ReadJob *job) {
+	job->conn = conn_handle_of(c);
+	job->queued_ns = now_ns();
+	c->tr.mark = job->queued_ns;
+	if (!g_read_pool || !db_messages_threadsafe()) {
+		read_work(job);
+		read_done(job);
+		return;
+	}
+	if (workpool_submit(g_read_pool, read_work, read_done, job) < 0) {
+		conn_send(c->fd, SERVICE_UNAVAILABLE, strlen(SERVICE_UNAVAILABLE));
+		close_conn(c);
+		sb_free(&job->out);
+		free(job);
+		return;
+	}
+	c->type = CONN_BUSY;
+}
+
+// maps a request path to its metrics label
+static metrics_route route_of(const char *path) {
+	if (strcmp(path, "/") == 0) return ROUTE_INDEX;
+	if (strncmp(path, "/static/", 8) == 0) return ROUTE_STATIC;
+	if (strcmp(path, "/me") == 0) return ROUTE_ME;
+	if (strcmp(path, "/stats") == 0) return ROUTE_STATS;
+	if (strcmp(path, "/messages") == 0) return ROUTE_MESSAGES;
+	if (strcmp(path, "/register") == 0) return ROUTE_REGISTER;
+	if (strcmp(path, "/login") == 0) return ROUTE_LOGIN;
+	if (strcmp(path, "/logout") == 0) return ROUTE_LOGOUT;
+	if (strcmp(path, "/ws") == 0) return ROUTE_WS;
+	if (strcmp(path, "/metrics") == 0) return ROUTE_METRICS;
+	if (strcmp(path, "/events") == 0) return ROUTE_EVENTS;
+	if (strcmp(path, "/messages/search") == 0) return ROUTE_SEARCH;
+	if (strcmp(path, "/messages/export") == 0) return ROUTE_EXPORT;
+	return ROUTE_OTHER;
 }
 
 // get MIME type based on file extension
@@ -125,7 +574,7 @@ static const char* get_mime_type(const char *path) {
 static void serve_file(int fd, const char *filepath) {
 	FILE *f = fopen(filepath, "rb");
 	if (!f) {
-		send(fd, NOT_FOUND, strlen(NOT_FOUND), 0);
+		conn_send(fd, NOT_FOUND, strlen(NOT_FOUND));
 		return;
 	}
 	
@@ -136,7 +585,7 @@ static void serve_file(int fd, const char *filepath) {
 	
 	if (fsize < 0 || fsize > 10*1024*1024) {  // max 10MB
 		fclose(f);
-		send(fd, BAD_REQUEST, strlen(BAD_REQUEST), 0);
+		conn_send(fd, BAD_REQUEST, strlen(BAD_REQUEST));
 		return;
 	}
 	
@@ -149,336 +598,862 @@ static void serve_file(int fd, const char *filepath) {
 		"Content-Length: %ld\r\n"
 		"Connection: close\r\n"
 		"\r\n", mime, fsize);
-	send(fd, hdr, (size_t)n, 0);
+	conn_send(fd, hdr, (size_t)n);
 	
 	// send file content
-	char buf[8192];
+	char *buf = (char*)arena_alloc(&g_req_arena, REQ_BUF_SIZE);
 	size_t r;
-	while ((r = fread(buf, 1, sizeof(buf), f)) > 0) {
-		send(fd, buf, r, 0);
+	while (buf && (r = fread(buf, 1, REQ_BUF_SIZE, f)) > 0) {
+		conn_send(fd, buf, r);
 	}
 	fclose(f);
 }
 
-int main(void) {
-	signal(SIGINT, on_sigint);
-	signal(SIGPIPE, SIG_IGN);
-
-	if (db_init("db.sqlite3") < 0) {
-		fprintf(stderr, "db init failed\n");
-		return 1;
-	}
-
+static int open_listener(int port) {
 	int srv = socket(AF_INET, SOCK_STREAM, 0);
-	if (srv < 0) { perror("socket"); return 1; }
-
-	int opt = 1;
-	if (setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) { perror("setsockopt"); return 1; }
+	if (srv < 0) { perror("socket"); return -1; }
 
 	int yes = 1;
-	setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	if (setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) { perror("setsockopt"); close(srv); return -1; }
 #ifdef SO_NOSIGPIPE
 	setsockopt(srv, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
 #endif
 	struct sockaddr_in addr; bzero(&addr, sizeof(addr));
 	addr.sin_family = AF_INET;
-	addr.sin_port = htons(8081);
+	addr.sin_port = htons((uint16_t)port);
 	addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-	if (bind(srv, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); return 1; }
-	if (listen(srv, 16) < 0) { perror("listen"); return 1; }
+	if (bind(srv, (struct sockaddr*)&addr, sizeof(addr)) < 0) { perror("bind"); close(srv); return -1; }
+	/* the kernel queues connections while a turn is busy; shedding happens after accept */
+	if (listen(srv, SOMAXCONN) < 0) { perror("listen"); close(srv); return -1; }
 	set_nonblock(srv);
+	return srv;
+}
+
+/* Graceful restart (include/handoff.h). SIGHUP starts the successor; once
+   it is ready it gets the listening socket and the idle connections, and
+   this process finishes the rest for up to DRAIN_SEC before exiting. */
+#define RESTART_READY_SEC 60
+#define DRAIN_SEC 30
+static volatile sig_atomic_t g_restart = 0;
 
-	printf("Listening on http://127.0.0.1:8081  (Ctrl+C to stop)\n");
+static void on_sighup(int sig) { (void)sig; g_restart = 1; }
 
-	Conn conns[FD_SETSIZE];
-	for (int i = 0; i < FD_SETSIZE; i++) conns[i].fd = -1;
+static void abandon_restart(int ctl, pid_t pid) {
+	close(ctl);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+/* connections nobody is in the middle of: requests not read yet, sockets
+   with no partial frame buffered, and event streams */
+static int movable(const Conn *c) {
+	return c->type == CONN_HTTP || c->type == CONN_SSE || (c->type == CONN_WS && c->rx.len == 0 && !ws_tx_pending(&c->tx));
+}
+
+/* old process: passes the idle connections to the successor and lets go of
+   the message log; returns how many moved */
+static int hand_over(int ctl, int log_store) {
+	static Conn *idle[CONN_MAX];
+	int n = 0, moved = 0;
+	for (int i = 0; i < conn_live_count(); i++)
+		if (movable(conn_live_at(i))) idle[n++] = conn_live_at(i);
+	while (moved < n) {
+		handoff_conn batch[HANDOFF_BATCH];
+		int k = n - moved < HANDOFF_BATCH ? n - moved : HANDOFF_BATCH;
+		for (int j = 0; j < k; j++) {
+			const Conn *c = idle[moved + j];
+			batch[j].fd = c->fd;
+			batch[j].type = c->type;
+			batch[j].user_id = c->user_id;
+			memcpy(batch[j].username, c->username, sizeof(batch[j].username));
+			memcpy(batch[j].ip, c->ip, sizeof(batch[j].ip));
+		}
+		if (handoff_send(ctl, batch, k) < 0) {
+			log_event(LOG_ERROR, "handoff_send_failed", "moved=%d left=%d", moved, n - moved);
+			break;
+		}
+		for (int j = 0; j < k; j++) {
+			Conn *c = idle[moved + j];
+			metrics_add(c->type == CONN_WS ? CTR_WS_ACTIVE : c->type == CONN_SSE ? CTR_SSE_ACTIVE : CTR_HTTP_ACTIVE, -1);
+			close(c->fd);
+			conn_release(c);
+		}
+		moved += k;
+	}
+	/* what could not move is closed and its clients reconnect to the successor;
+	   exports only while the message log has to be let go */
+	for (int i = conn_live_count() - 1; i >= 0; i--) {
+		Conn *c = conn_live_at(i);
+		if (c->type != CONN_BUSY && (c->type != CONN_EXPORT || log_store)) close_conn(c);
+	}
+	if (log_store) db_release_message_log();
+	handoff_finish(ctl);
+	return moved;
+}
+
+/* new process: registers a connection the old one handed over */
+static void adopt_conn(const handoff_conn *h) {
+	int ok = h->type == CONN_HTTP || h->type == CONN_WS || h->type == CONN_SSE;
+	Conn *c = ok && h->fd < FD_SETSIZE ? conn_open(h->fd) : NULL;
+	if (!c) { close(h->fd); return; }
+	g_resp[h->fd].status = 0; g_resp[h->fd].bytes = 0;
+	snprintf(c->ip, sizeof(c->ip), "%s", h->ip);
+	if (h->type == CONN_WS) {
+		c->user_id = h->user_id;
+		snprintf(c->username, sizeof(c->username), "%s", h->username);
+		metrics_add(CTR_WS_ACTIVE, 1);
+		conn_ws_join(c);
+	} else if (h->type == CONN_SSE) {
+		metrics_add(CTR_SSE_ACTIVE, 1);
+		conn_sse_join(c);
+	} else {
+		metrics_add(CTR_HTTP_ACTIVE, 1);
+	}
+}
 
-	fd_set rfds;
+/* new process: returns the listening socket taken over, -1 if there is none */
+static int take_over(int ctl) {
+	int srv = handoff_take_listener(ctl);
+	if (srv >= 0 && handoff_signal_ready(ctl) < 0) {
+		close(srv);
+		srv = -1;
+	}
+	if (srv < 0) {
+		log_event(LOG_ERROR, "handoff_failed", "reason=listener");
+		close(ctl);
+		return -1;
+	}
+	handoff_conn batch[HANDOFF_BATCH];
+	int n, total = 0;
+	while ((n = handoff_recv(ctl, batch)) > 0) {
+		for (int i = 0; i < n; i++) adopt_conn(&batch[i]);
+		total += n;
+	}
+	/* a broken handoff still leaves this process the listener */
+	if (n < 0) log_event(LOG_WARN, "handoff_incomplete", "conns=%d", total);
+	else log_event(LOG_INFO, "handoff_done", "conns=%d", total);
+	close(ctl);
+	return srv;
+}
+
+int main(int argc, char **argv) {
+	(void)argc;
+	signal(SIGINT, on_sigint);
+	signal(SIGHUP, on_sighup);
+	signal(SIGPIPE, SIG_IGN);
+
+	const char *lvl = getenv("LOG_LEVEL");
+	if (lvl) {
+		int l = log_level_parse(lvl);
+		if (l < 0) { fprintf(stderr, "invalid LOG_LEVEL (debug, info, warn, error, off)\n"); return 1; }
+		log_set_level((log_level)l);
+	}
+	const char *log_file = getenv("LOG_FILE");
+	const char *rot = getenv("LOG_ROTATE_MB");
+	const char *keep = getenv("LOG_KEEP");
+	if (log_init(log_file, (size_t)(rot ? atol(rot) : 64) << 20, keep ? atoi(keep) : 5) < 0) {
+		fprintf(stderr, "cannot open log file %s\n", log_file);
+		return 1;
+	}
+
+	const char *slow = getenv("TRACE_SLOW_MS");
+	const char *sample = getenv("TRACE_SAMPLE");
+	trace_configure(slow ? (uint64_t)atol(slow) : 250, sample ? (unsigned)atoi(sample) : 0);
+	const char *lag = getenv("OVERLOAD_LAG_MS");
+	overload_configure(lag ? (unsigned)atoi(lag) : OVERLOAD_LAG_MS_DEFAULT);
+
+	if (db_init("db.sqlite3") < 0) {
+		fprintf(stderr, "db init failed\n");
+		return 1;
+	}
+	const char *store = getenv("MESSAGE_STORE");
+	int log_store = store && strcmp(store, "log") == 0;
+	if (store && !log_store && strcmp(store, "sqlite") != 0) {
+		fprintf(stderr, "invalid MESSAGE_STORE (sqlite, log)\n");
+		return 1;
+	}
+	/* set when a running server started this one to take over from it */
+	const char *handoff_env = getenv("HANDOFF_FD");
+	int handoff_ctl = handoff_env ? atoi(handoff_env) : -1;
+	unsetenv("HANDOFF_FD");
+	if (handoff_ctl >= 0) db_share_users();   /* the old process registers users until it is done */
+	if (db_start_session_sweeper(60) < 0) fprintf(stderr, "session sweeper failed to start\n");
+
+	const char *mode = getenv("SESSION_MODE");
+	if (mode && strcmp(mode, "token") == 0) {
+		const char *keys = getenv("SESSION_KEYS");
+		if (keys) {
+			if (token_load_keys(keys) <= 0) {
+				fprintf(stderr, "invalid SESSION_KEYS (expected kid:hexkey[,kid:hexkey...])\n");
+				return 1;
+			}
+		} else if (token_generate_key() < 0) {
+			fprintf(stderr, "failed to generate session key\n");
+			return 1;
+		} else {
+			fprintf(stderr, "warning: SESSION_KEYS not set, sessions will not survive a restart\n");
+		}
+		g_token_sessions = 1;
+	}
+
+	g_ip_limit = ratelimit_create(16384, 0.5, 10);     /* 30/min per IP, bursts of 10 */
+	g_user_limit = ratelimit_create(16384, 1.0/12, 5); /* 5/min per new username, failed logins per (ip, username) */
+	if (!g_ip_limit || !g_user_limit) {
+		fprintf(stderr, "rate limiter init failed\n");
+		return 1;
+	}
+
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	g_auth_pool = workpool_create(ncpu > 0 ? (int)ncpu : 2, AUTH_QUEUE_MAX);
+	if (!g_auth_pool) {
+		fprintf(stderr, "worker pool init failed\n");
+		return 1;
+	}
+	int auth_fd = workpool_notify_fd(g_auth_pool);
+
+	/* one reader per thread; the event loop reads through the writer connection */
+	const char *readers = getenv("DB_READERS");
+	int nreaders = readers ? atoi(readers) : 4;
+	if (nreaders > DB_READERS_MAX - 1) nreaders = DB_READERS_MAX - 1;
+	int read_fd = -1;
+	if (nreaders > 0) {
+		if (db_open_readers(nreaders) < 0 || !(g_read_pool = workpool_create(nreaders, READ_QUEUE_MAX))) {
+			fprintf(stderr, "reader pool init failed\n");
+			return 1;
+		}
+		read_fd = workpool_notify_fd(g_read_pool);
+	}
+
+	const char *relay_addr = getenv("RELAY");
+	if (relay_addr) {
+		if (log_store) {
+			fprintf(stderr, "RELAY needs MESSAGE_STORE=sqlite: the message log belongs to one process\n");
+			return 1;
+		}
+		if (relay_open(relay_addr) < 0) {
+			fprintf(stderr, "invalid RELAY address %s (unix:/path or host:port)\n", relay_addr);
+			return 1;
+		}
+		db_share_users();   /* the other instances register users too */
+	}
+
+	const char *port_env = getenv("PORT");   /* several instances on one host need their own */
+	int port = port_env ? atoi(port_env) : 8081;
+	if (port <= 0 || port > 65535) { fprintf(stderr, "invalid PORT\n"); return 1; }
+
+	arena_init(&g_req_arena, REQ_ARENA_CHUNK);
+	conn_registry_init();
+
+	int srv = handoff_ctl >= 0 ? take_over(handoff_ctl) : -1;
+	int took_over = srv >= 0;
+	if (!took_over && (srv = open_listener(port)) < 0) return 1;
+
+	/* the message log and the history ring are read only now: until the
+	   handoff is done the old process may still be adding messages */
+	if (log_store) {
+		const char *dir = getenv("MESSAGE_LOG_DIR");
+		const char *seg = getenv("MESSAGE_LOG_SEGMENT_MB");
+		const char *days = getenv("MESSAGE_LOG_RETAIN_DAYS");
+		const char *cap = getenv("MESSAGE_LOG_RETAIN_MB");
+		if (db_use_message_log(dir ? dir : "msglog", (size_t)(seg ? atol(seg) : 64) << 20,
+		                       days ? atol(days) * 86400 : 0, (size_t)(cap ? atol(cap) : 0) << 20) < 0) {
+			fprintf(stderr, "cannot open message log %s\n", dir ? dir : "msglog");
+			return 1;
+		}
+	}
+	int users = db_get_user_count();
+	g_total_users = users > 0 ? users : 0;
+	const char *hist = getenv("HISTORY_SIZE");
+	if (history_init(hist ? (size_t)atol(hist) : HISTORY_DEFAULT_CAP) < 0)
+		fprintf(stderr, "history cache disabled, /messages will read the database\n");
+
+	printf("Listening on http://127.0.0.1:%d  (Ctrl+C to stop, kill -HUP %d to restart)\n", port, (int)getpid());
+	fflush(stdout);
+	log_event(LOG_INFO, "server_start", "port=%d session_mode=%s handoff=%d", port,
+	          g_token_sessions ? "token" : "db", took_over);
+
+	int restart_ctl = -1;            /* socket pair to a successor being started */
+	pid_t successor = 0;
+	uint64_t restart_deadline = 0;   /* for the successor to report ready */
+	uint64_t drain_deadline = 0;     /* set once the listener has been handed over */
+	uint64_t turn_start = 0;         /* when select() last returned, for overload detection */
+
+	fd_set rfds, wfds;
 	int maxfd = srv;
 
 	while (!g_stop) {
+		uint64_t now = now_ns();
+		if (turn_start) {
+			metrics_loop_turn(now - turn_start);
+			double fill = (double)workpool_queue_depth(g_auth_pool) / AUTH_QUEUE_MAX;
+			if (g_read_pool) {
+				double rf = (double)workpool_queue_depth(g_read_pool) / READ_QUEUE_MAX;
+				if (rf > fill) fill = rf;
+			}
+			overload_update(now, now - turn_start, fill);
+			turn_start = 0;
+		}
+		if (g_restart) {
+			g_restart = 0;
+			if (restart_ctl >= 0 || drain_deadline) {
+				log_event(LOG_WARN, "restart_ignored", "reason=%s", drain_deadline ? "draining" : "in_progress");
+			} else if ((restart_ctl = handoff_spawn(argv, srv, &successor)) < 0) {
+				log_event(LOG_ERROR, "restart_failed", "reason=spawn errno=%d", errno);
+			} else {
+				restart_deadline = now + (uint64_t)RESTART_READY_SEC * 1000000000;
+				log_event(LOG_INFO, "restart_begin", "pid=%d", (int)successor);
+			}
+		}
+		int status;
+		if (restart_ctl >= 0 && waitpid(successor, &status, WNOHANG) == successor) {
+			log_event(LOG_ERROR, "restart_failed", "reason=exited pid=%d status=%d", (int)successor,
+			          WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+			close(restart_ctl);
+			restart_ctl = -1;
+		} else if (restart_ctl >= 0 && now > restart_deadline) {
+			log_event(LOG_ERROR, "restart_failed", "reason=timeout pid=%d", (int)successor);
+			abandon_restart(restart_ctl, successor);
+			restart_ctl = -1;
+		}
+		/* the successor has the listener; stop once the rest is done */
+		if (drain_deadline && (conn_live_count() == 0 || now > drain_deadline)) break;
+
+		if (relay_addr) refresh_user_count(now);
+		long push_ms = stats_push(now);
 		FD_ZERO(&rfds);
-		FD_SET(srv, &rfds);
-		maxfd = srv;
+		FD_ZERO(&wfds);
+		FD_SET(auth_fd, &rfds);
+		maxfd = auth_fd;
+		if (srv >= 0) {
+			FD_SET(srv, &rfds);
+			if (srv > maxfd) maxfd = srv;
+		}
+		if (restart_ctl >= 0) {
+			FD_SET(restart_ctl, &rfds);
+			if (restart_ctl > maxfd) maxfd = restart_ctl;
+		}
+		if (read_fd >= 0) {
+			FD_SET(read_fd, &rfds);
+			if (read_fd > maxfd) maxfd = read_fd;
+		}
+		int relay_write = 0;
+		int relay_fd = relay_prepare(&relay_write);
+		relay_check_history();
+		if (relay_fd >= 0) {
+			FD_SET(relay_fd, &rfds);
+			if (relay_write) FD_SET(relay_fd, &wfds);
+			if (relay_fd > maxfd) maxfd = relay_fd;
+		}
 
-		for (int i = 0; i < FD_SETSIZE; i++) if (conns[i].fd >= 0) {
-			FD_SET(conns[i].fd, &rfds);
-			if (conns[i].fd > maxfd) maxfd = conns[i].fd;
+		for (int i = 0; i < conn_live_count(); i++) {
+			Conn *c = conn_live_at(i);
+			if (c->type == CONN_BUSY) continue;
+			FD_SET(c->fd, c->type == CONN_EXPORT ? &wfds : &rfds);
+			if (c->type == CONN_WS && ws_tx_pending(&c->tx)) FD_SET(c->fd, &wfds);
+			if (c->fd > maxfd) maxfd = c->fd;
 		}
 
 		struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
-		int ready = select(maxfd + 1, &rfds, NULL, NULL, &tv);
+		if (push_ms >= 0 && push_ms < 1000) { tv.tv_sec = 0; tv.tv_usec = push_ms * 1000; }
+		int ready = select(maxfd + 1, &rfds, &wfds, NULL, &tv);
 		if (ready < 0 ) {
 			if (errno == EINTR) continue;
-			perror("select");
+			log_event(LOG_ERROR, "select_failed", "errno=%d", errno);
 			break;
 		}
-		if (FD_ISSET(srv, &rfds)) {
-			int cfd = accept(srv, NULL, NULL);
-			if (cfd >= 0) {
-				set_nonblock(cfd);
+		turn_start = now_ns();
+		if (FD_ISSET(auth_fd, &rfds)) workpool_complete(g_auth_pool);
+		if (read_fd >= 0 && FD_ISSET(read_fd, &rfds)) workpool_complete(g_read_pool);
+		if (relay_fd >= 0) {
+			relay_io(FD_ISSET(relay_fd, &rfds), FD_ISSET(relay_fd, &wfds), deliver_message, NULL);
+			relay_check_history();
+		}
+		if (restart_ctl >= 0 && FD_ISSET(restart_ctl, &rfds)) {
+			if (handoff_ready(restart_ctl) < 0) {
+				log_event(LOG_ERROR, "restart_failed", "reason=not_ready pid=%d", (int)successor);
+				abandon_restart(restart_ctl, successor);
+			} else {
+				int moved = hand_over(restart_ctl, log_store);
+				close(restart_ctl);
+				close(srv);
+				srv = -1;
+				drain_deadline = now_ns() + (uint64_t)DRAIN_SEC * 1000000000;
+				log_event(LOG_INFO, "restart_handover", "pid=%d moved=%d draining=%d",
+				          (int)successor, moved, conn_live_count());
+			}
+			restart_ctl = -1;
+			continue;   /* the fd sets refer to connections that may be gone */
+		}
+		/* a bounded batch per turn drains a burst from the backlog without
+		   holding up established connections */
+		for (int k = 0; srv >= 0 && FD_ISSET(srv, &rfds) && k < ACCEPT_BATCH; k++) {
+			struct sockaddr_storage peer;
+			socklen_t peer_len = sizeof(peer);
+			int cfd = accept(srv, (struct sockaddr*)&peer, &peer_len);
+			if (cfd < 0) break;
+			if (cfd >= FD_SETSIZE) { refuse_conn(cfd); continue; }   /* select() cannot watch it */
+			set_nonblock(cfd);
 #ifdef SO_NOSIGPIPE
-				int one = 1;
-				setsockopt(cfd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+			int one = 1;
+			setsockopt(cfd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
 #endif
-				int placed = 0;
-				for (int i = 0; i < FD_SETSIZE; i++) if (conns[i].fd < 0) {
-					conns[i].fd = cfd; conns[i].type = CONN_HTTP; conns[i].user_id = 0; conns[i].username[0] = '\0'; placed = 1; break;
-				}
-				if (!placed) close(cfd);
-			}
+			Conn *c = conn_open(cfd);
+			if (!c) { refuse_conn(cfd); continue; }
+			g_resp[cfd].status = 0; g_resp[cfd].bytes = 0;
+			metrics_add(CTR_HTTP_ACTIVE, 1);
+			if (peer.ss_family == AF_INET)
+				inet_ntop(AF_INET, &((struct sockaddr_in*)&peer)->sin_addr, c->ip, sizeof(c->ip));
+			else if (peer.ss_family == AF_INET6)
+				inet_ntop(AF_INET6, &((struct sockaddr_in6*)&peer)->sin6_addr, c->ip, sizeof(c->ip));
 		}
 
-		for (int i = 0; i < FD_SETSIZE; i++) if (conns[i].fd >= 0 && FD_ISSET(conns[i].fd, &rfds)) {
-			int fd = conns[i].fd;
-			if (conns[i].type == CONN_WS) {
+		/* backwards: closing entry i moves an already-visited one into its place */
+		for (int i = conn_live_count() - 1; i >= 0; i--) {
+			Conn *c = conn_live_at(i);
+			if (c->type == CONN_EXPORT) {
+				if (FD_ISSET(c->fd, &wfds)) {
+					if (!export_pump(c)) close_conn(c);
+				} else if (now_ns() - c->io_ns > (uint64_t)EXPORT_STALL_SEC * 1000000000) {
+					log_event(LOG_WARN, "export_stalled", "fd=%d ip=%s rows=%ld", c->fd, c->ip, export_rows(c->exp));
+					close_conn(c);
+				}
+				continue;
+			}
+			if (c->type == CONN_WS && FD_ISSET(c->fd, &wfds) && ws_tx_flush(c->fd, &c->tx) < 0) {
+				close_conn(c);
+				continue;
+			}
+			if (c->type == CONN_BUSY || !FD_ISSET(c->fd, &rfds)) continue;
+			int fd = c->fd;
+			if (c->type == CONN_WS) {
 				unsigned char *msg = NULL; size_t mlen = 0;
-				int r = ws_read_text(fd, &msg, &mlen);
-				if (r < 0) { close(fd); conns[i].fd = -1; continue; }
-				if (r == 1) {
+				trace wt; trace_begin(&wt);
+				int r;
+				/* msg points into the connection's buffer; one read may hold several frames */
+				while ((r = ws_read_text(fd, &c->rx, &c->tx, &msg, &mlen)) == 1) {
 					// save message to db
-					const char *username = conns[i].username[0] ? conns[i].username : "anon";
-					db_save_message(conns[i].user_id, username, (const char*)msg);
-					
-					// broadcast to all WS conns with username prefix
-					char prefix[64];
-					int pn = snprintf(prefix, sizeof(prefix), "[%s] ", username);
-					for (int k = 0; k < FD_SETSIZE; k++) if (conns[k].fd >= 0 && conns[k].type == CONN_WS) {
-						ws_send_text(conns[k].fd, prefix, (size_t)pn);
-						ws_send_text(conns[k].fd, (const char*)msg, mlen);
-					}
-					free(msg);
+					const char *username = c->username[0] ? c->username : "anon";
+					trace_phase(&wt, PH_DECODE);
+					long ts = (long)time(NULL);
+					long id = db_save_message(c->user_id, username, (const char*)msg, ts);
+					metrics_add(CTR_WS_MESSAGES, 1);
+					trace_phase(&wt, PH_PERSIST);
+					deliver_message(id, username, (const char*)msg, ts, NULL);
+					relay_publish(id > 0 ? id : 0, username, (const char*)msg, ts);
+					trace_phase(&wt, PH_FANOUT);
+					trace_end(&wt, "WS", "/ws", 0);
+					trace_begin(&wt);
 				}
+				if (r < 0) close_conn(c);
+				continue;
+			}
+			if (c->type == CONN_SSE) {
+				/* subscribers never send; readable means the client went away */
+				char junk[256];
+				ssize_t r = recv(fd, junk, sizeof(junk), 0);
+				if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) close_conn(c);
 				continue;
 			}
 
 			/* HTTP request */
-			char buf[8192];
-			ssize_t n = recv(fd, buf, sizeof(buf)-1, 0);
-			if (n <= 0) { close(fd); conns[i].fd = -1; continue; }
+			arena_reset(&g_req_arena);
+			char *buf = (char*)arena_alloc(&g_req_arena, REQ_BUF_SIZE);
+			if (!buf) { close_conn(c); continue; }
+			trace_begin(&c->tr);
+			ssize_t n = recv(fd, buf, REQ_BUF_SIZE-1, 0);
+			if (n <= 0) { close_conn(c); continue; }
+			metrics_add(CTR_BYTES_IN, n);
+			trace_phase(&c->tr, PH_READ);
 			buf[n] = '\0';
 
 			if (!strstr(buf, "\r\n\r\n")) {
-				send(fd, BAD_REQUEST, strlen(BAD_REQUEST), 0);
-				close(fd); conns[i].fd = -1; continue;
+				conn_send(fd, BAD_REQUEST, strlen(BAD_REQUEST));
+				close_conn(c); continue;
 			}
 
             /* IMPORTANT: parse on a temporary copy so original headers
                remain intact for later body parsing (strtok mutates input) */
-            char header_copy[8192];
-            memcpy(header_copy, buf, sizeof(header_copy));
-            header_copy[sizeof(header_copy)-1] = '\0';
+            char *header_copy = (char*)arena_alloc(&g_req_arena, (size_t)n + 1);
+            if (!header_copy) { close_conn(c); continue; }
+            memcpy(header_copy, buf, (size_t)n + 1);
             char *method=NULL, *path=NULL, *ws_key=NULL;
             if (parse_http_request(header_copy, &method, &path, &ws_key) < 0) {
-				send(fd, BAD_REQUEST, strlen(BAD_REQUEST), 0);
-				close(fd); conns[i].fd = -1; continue;
+				conn_send(fd, BAD_REQUEST, strlen(BAD_REQUEST));
+				close_conn(c); continue;
+			}
+			char *query = split_query(path);
+			c->route = route_of(path);
+			snprintf(c->method, sizeof(c->method), "%s", method);
+			snprintf(c->path, sizeof(c->path), "%s", path);
+			trace_phase(&c->tr, PH_PARSE);
+
+			/* admission: /metrics stays reachable so the overload can be watched */
+			int long_lived = c->route == ROUTE_WS || c->route == ROUTE_EVENTS;
+			if ((!overload_admit(now_ns() - turn_start) && c->route != ROUTE_METRICS) ||
+			    (long_lived && conn_live_count() > CONN_MAX - CONN_HEADROOM)) {
+				metrics_add(long_lived ? CTR_SHED_UPGRADE : CTR_SHED_HTTP, 1);
+				conn_send(fd, SERVICE_UNAVAILABLE, strlen(SERVICE_UNAVAILABLE));
+				close_conn(c); continue;
 			}
 
 			// serve index.html for root
 			if (strcasecmp(method, "GET") == 0 && strcmp(path, "/") == 0) {
 				serve_file(fd, "static/index.html");
-				close(fd); conns[i].fd = -1; continue;
+				close_conn(c); continue;
 			}
 			
 			// serve static files
 			if (strcasecmp(method, "GET") == 0 && strncmp(path, "/static/", 8) == 0) {
 				// security: prevent directory traversal
 				if (strstr(path, "..")) {
-					send(fd, BAD_REQUEST, strlen(BAD_REQUEST), 0);
-					close(fd); conns[i].fd = -1; continue;
+					conn_send(fd, BAD_REQUEST, strlen(BAD_REQUEST));
+					close_conn(c); continue;
 				}
 				// remove leading slash: /static/app.js -> static/app.js
 				serve_file(fd, path + 1);
-				close(fd); conns[i].fd = -1; continue;
+				close_conn(c); continue;
 			}
 
 			/* GET /me -> returns {"username":"..."} if session valid */
             if (strcasecmp(method, "GET") == 0 && strcmp(path, "/me") == 0) {
-				char cookie[1024];
-				int have = get_header_value(buf, "Cookie", cookie, sizeof(cookie));
-				char sid[256] = {0};
-				if (have) {
-					get_cookie_value(buf, "sid", sid, sizeof(sid));
-				}
 				int uid = 0;
-				int ok = sid[0] ? db_get_session_user(sid, &uid) : 0;
-				if (ok == 1) {
-                    char uname[64];
-                    if (db_get_username_by_id(uid, uname, sizeof(uname)) == 0) {
-                        char body[128];
-                        snprintf(body, sizeof(body), "{\"username\":\"%s\"}", uname);
-                        send_json(fd, "200 OK", body);
+				char uname[64];
+				int authed = authenticate(buf, &uid, uname, sizeof(uname));
+				trace_phase(&c->tr, PH_AUTH);
+				if (authed == 1) {
+                    if (uname[0]) {
+                        strbuf sb; sb_init_buf(&sb, (char*)arena_alloc(&g_req_arena, 128), 128);
+                        jsonw w; jw_init(&w, &sb);
+                        jw_object_begin(&w);
+                        jw_key(&w, "username"); jw_string(&w, uname);
+                        jw_object_end(&w);
+                        trace_phase(&c->tr, PH_BUILD);
+                        send_json_buf(fd, "200 OK", &sb);
+                        sb_free(&sb);
                     } else {
-                        send(fd, BAD_REQUEST, strlen(BAD_REQUEST), 0);
+                        conn_send(fd, BAD_REQUEST, strlen(BAD_REQUEST));
                     }
 				} else {
-					send(fd, UNAUTHORIZED, strlen(UNAUTHORIZED), 0);
+					conn_send(fd, UNAUTHORIZED, strlen(UNAUTHORIZED));
 				}
-				close(fd); conns[i].fd = -1; continue;
+				close_conn(c); continue;
 			}
 
 			/* GET /stats -> get server statistics */
 			if (strcasecmp(method, "GET") == 0 && strcmp(path, "/stats") == 0) {
-				int total_users = db_get_user_count();
-				int online_users = count_online_ws(conns);
-				char body[128];
-				snprintf(body, sizeof(body), "{\"total_users\":%d,\"online_users\":%d}", 
-					total_users >= 0 ? total_users : 0, online_users);
-				send_json(fd, "200 OK", body);
-				close(fd); conns[i].fd = -1; continue;
+				strbuf sb; sb_init_buf(&sb, (char*)arena_alloc(&g_req_arena, 128), 128);
+				stats_json(&sb);
+				trace_phase(&c->tr, PH_BUILD);
+				send_json_buf(fd, "200 OK", &sb);
+				sb_free(&sb);
+				close_conn(c); continue;
 			}
 
-			/* GET /messages -> get chat history (auth required) */
-			if (strcasecmp(method, "GET") == 0 && strcmp(path, "/messages") == 0) {
-				char sid[256] = {0};
-				get_cookie_value(buf, "sid", sid, sizeof(sid));
+			/* GET /events -> Server-Sent Events stream of stats changes */
+			if (strcasecmp(method, "GET") == 0 && strcmp(path, "/events") == 0) {
+				strbuf sb; sb_init_buf(&sb, (char*)arena_alloc(&g_req_arena, 512), 512);
+				sb_puts(&sb,
+					"HTTP/1.1 200 OK\r\n"
+					"Content-Type: text/event-stream\r\n"
+					"Cache-Control: no-cache\r\n"
+					"Connection: keep-alive\r\n\r\n"
+					"retry: 5000\n\n");
+				stats_event(&sb);
+				trace_phase(&c->tr, PH_BUILD);
+				conn_send(fd, sb.data, sb.len);
+				sb_free(&sb);
+				trace_phase(&c->tr, PH_SEND);
+				uint64_t dur = now_ns() - c->tr.start;
+				metrics_request(ROUTE_EVENTS, dur);
+				log_access(c->ip, c->method, c->path, 200, g_resp[fd].bytes, dur);
+				trace_end(&c->tr, c->method, c->path, 200);
+				metrics_add(CTR_HTTP_ACTIVE, -1);
+				metrics_add(CTR_SSE_ACTIVE, 1);
+				conn_sse_join(c);
+				continue;
+			}
+
+			/* GET /messages/search?q=<words>&offset=<n>&limit=<n> -> ranked matches (auth required) */
+			if (strcasecmp(method, "GET") == 0 && strcmp(path, "/messages/search") == 0) {
+				int uid = 0;
+				int authed = authenticate(buf, &uid, NULL, 0);
+				trace_phase(&c->tr, PH_AUTH);
+				if (authed != 1) {
+					conn_send(fd, UNAUTHORIZED, strlen(UNAUTHORIZED));
+					close_conn(c); continue;
+				}
+				char q[256] = {0}, qv[32];
+				int offset = 0, limit = 20;
+				if (query) form_get_kv(query, "q", q, sizeof(q));
+				if (query && form_get_kv(query, "offset", qv, sizeof(qv))) offset = atoi(qv);
+				if (query && form_get_kv(query, "limit", qv, sizeof(qv))) limit = atoi(qv);
+				if (!q[0] || offset < 0 || offset > SEARCH_OFFSET_MAX) {
+					send_json(fd, "400 Bad Request", "{\"error\":\"invalid_query\"}");
+					close_conn(c); continue;
+				}
+				if (limit < 1) limit = 1;
+				if (limit > HISTORY_PAGE_MAX) limit = HISTORY_PAGE_MAX;
+				trace_phase(&c->tr, PH_PARSE);
+				ReadJob *job = (ReadJob*)calloc(1, sizeof(*job));
+				if (!job) {
+					conn_send(fd, SERVICE_UNAVAILABLE, strlen(SERVICE_UNAVAILABLE));
+					close_conn(c); continue;
+				}
+				job->kind = READ_SEARCH;
+				snprintf(job->q, sizeof(job->q), "%s", q);
+				job->offset = offset;
+				job->limit = limit;
+				sb_init(&job->out, 16384);
+				submit_read_job(c, job);
+				continue;
+			}
+
+			/* GET /messages/export?from=<ts>&to=<ts>&format=ndjson|binary -> chunked dump of the history (auth required) */
+			if (strcasecmp(method, "GET") == 0 && strcmp(path, "/messages/export") == 0) {
 				int uid = 0;
-				if (sid[0] == 0 || db_get_session_user(sid, &uid) != 1) {
-					send(fd, UNAUTHORIZED, strlen(UNAUTHORIZED), 0);
-					close(fd); conns[i].fd = -1; continue;
+				int authed = authenticate(buf, &uid, NULL, 0);
+				trace_phase(&c->tr, PH_AUTH);
+				if (authed != 1) {
+					conn_send(fd, UNAUTHORIZED, strlen(UNAUTHORIZED));
+					close_conn(c); continue;
+				}
+				char qv[32];
+				long from_ts = 0, to_ts = 0;
+				export_format fmt = EXPORT_NDJSON;
+				if (query && form_get_kv(query, "from", qv, sizeof(qv))) from_ts = atol(qv);
+				if (query && form_get_kv(query, "to", qv, sizeof(qv))) to_ts = atol(qv);
+				if (query && form_get_kv(query, "format", qv, sizeof(qv)) && strcmp(qv, "ndjson") != 0) {
+					if (strcmp(qv, "binary") != 0) {
+						send_json(fd, "400 Bad Request", "{\"error\":\"invalid_format\"}");
+						close_conn(c); continue;
+					}
+					fmt = EXPORT_BINARY;
 				}
-				// build JSON array of messages
-				char *resp = malloc(65536); // plenty of space
-				if (!resp) {
-					send(fd, BAD_REQUEST, strlen(BAD_REQUEST), 0);
-					close(fd); conns[i].fd = -1; continue;
+				if (from_ts < 0 || to_ts < 0 || (to_ts > 0 && to_ts <= from_ts)) {
+					send_json(fd, "400 Bad Request", "{\"error\":\"invalid_range\"}");
+					close_conn(c); continue;
+				}
+				trace_phase(&c->tr, PH_PARSE);
+				if (g_exports >= EXPORT_MAX) {
+					conn_send(fd, SERVICE_UNAVAILABLE, strlen(SERVICE_UNAVAILABLE));
+					close_conn(c); continue;
+				}
+				export_stream *x = export_open(from_ts, to_ts, fmt);
+				trace_phase(&c->tr, PH_DB);
+				if (!x) {
+					send_json(fd, "503 Service Unavailable", "{\"error\":\"export_unavailable\"}");
+					close_conn(c); continue;
 				}
-				
-				struct msg_builder mb = { resp, 0, 1 };
-				mb.offset = sprintf(resp, "[");
-				db_get_messages(100, append_message_json, &mb);
-				mb.offset += sprintf(resp + mb.offset, "]");
-				
 				char hdr[256];
-				int n = snprintf(hdr, sizeof(hdr),
+				int m = snprintf(hdr, sizeof(hdr),
 					"HTTP/1.1 200 OK\r\n"
-					"Content-Type: application/json; charset=utf-8\r\n"
-					"Content-Length: %d\r\n"
-					"Connection: close\r\n\r\n", mb.offset);
-				send(fd, hdr, (size_t)n, 0);
-				send(fd, resp, (size_t)mb.offset, 0);
-				free(resp);
-				close(fd); conns[i].fd = -1; continue;
+					"Content-Type: %s\r\n"
+					"Content-Disposition: attachment; filename=\"messages.%s\"\r\n"
+					"Transfer-Encoding: chunked\r\n"
+					"Connection: close\r\n\r\n",
+					fmt == EXPORT_BINARY ? "application/octet-stream" : "application/x-ndjson",
+					fmt == EXPORT_BINARY ? "bin" : "ndjson");
+				conn_send(fd, hdr, (size_t)m);
+				c->exp = x;
+				c->io_ns = now_ns();
+				c->type = CONN_EXPORT;
+				g_exports++;
+				continue;
+			}
+
+			/* GET /messages?before=<id>|after=<id>&limit=<n> -> page of chat history (auth required) */
+			if (strcasecmp(method, "GET") == 0 && strcmp(path, "/messages") == 0) {
+				int uid = 0;
+				int authed = authenticate(buf, &uid, NULL, 0);
+				trace_phase(&c->tr, PH_AUTH);
+				if (authed != 1) {
+					conn_send(fd, UNAUTHORIZED, strlen(UNAUTHORIZED));
+					close_conn(c); continue;
+				}
+				char qv[32];
+				long before_id = 0, after_id = 0;
+				int limit = HISTORY_PAGE_MAX;
+				if (query && form_get_kv(query, "before", qv, sizeof(qv))) before_id = atol(qv);
+				if (query && form_get_kv(query, "after", qv, sizeof(qv))) after_id = atol(qv);
+				if (query && form_get_kv(query, "limit", qv, sizeof(qv))) limit = atoi(qv);
+				if (before_id < 0 || after_id < 0 || (before_id > 0 && after_id > 0)) {
+					conn_send(fd, BAD_REQUEST, strlen(BAD_REQUEST));
+					close_conn(c); continue;
+				}
+				if (limit < 1) limit = 1;
+				if (limit > HISTORY_PAGE_MAX) limit = HISTORY_PAGE_MAX;
+				trace_phase(&c->tr, PH_PARSE);
+				strbuf sb; sb_init_buf(&sb, (char*)arena_alloc(&g_req_arena, 32768), 32768);
+				if (history_page(before_id, after_id, limit, &sb)) {
+					trace_phase(&c->tr, PH_BUILD);
+					send_json_buf(fd, "200 OK", &sb);
+					sb_free(&sb);
+					close_conn(c); continue;
+				}
+				sb_free(&sb);
+				// older than the in-memory ring: build the page from the database
+				ReadJob *job = (ReadJob*)calloc(1, sizeof(*job));
+				if (!job) {
+					conn_send(fd, SERVICE_UNAVAILABLE, strlen(SERVICE_UNAVAILABLE));
+					close_conn(c); continue;
+				}
+				job->kind = READ_HISTORY;
+				job->before_id = before_id;
+				job->after_id = after_id;
+				job->limit = limit;
+				sb_init(&job->out, 32768);
+				submit_read_job(c, job);
+				continue;
+			}
+
+			/* GET /metrics -> Prometheus text exposition */
+			if (strcasecmp(method, "GET") == 0 && strcmp(path, "/metrics") == 0) {
+				strbuf sb; sb_init_buf(&sb, (char*)arena_alloc(&g_req_arena, 32768), 32768);
+				metrics_render(&sb);
+				trace_phase(&c->tr, PH_BUILD);
+				if (sb.failed) send_simple(fd, "500 Internal Server Error", "text/plain; charset=utf-8", "");
+				else send_response(fd, "200 OK", "text/plain; version=0.0.4; charset=utf-8", sb.data, sb.len);
+				sb_free(&sb);
+				close_conn(c); continue;
 			}
 
             /* POST /register (x-www-form-urlencoded: username=...&password=...) */
 			if (strcasecmp(method, "POST") == 0 && strcmp(path, "/register") == 0) {
+				int wait = ratelimit_take(g_ip_limit, c->ip);
+				if (wait > 0) { send_too_many(fd, wait); close_conn(c); continue; }
 				int clen = get_content_length(buf);
-                if (clen < 0 || clen > 1<<20) { send(fd, BAD_REQUEST, strlen(BAD_REQUEST), 0); close(fd); conns[i].fd=-1; continue; }
+                if (clen < 0 || clen > 1<<20) { conn_send(fd, BAD_REQUEST, strlen(BAD_REQUEST)); close_conn(c); continue; }
                 char *hdr_end = strstr(buf, "\r\n\r\n");
                 hdr_end = hdr_end ? hdr_end + 4 : NULL;
-                if (!hdr_end) { send(fd, BAD_REQUEST, strlen(BAD_REQUEST), 0); close(fd); conns[i].fd=-1; continue; }
+                if (!hdr_end) { conn_send(fd, BAD_REQUEST, strlen(BAD_REQUEST)); close_conn(c); continue; }
                 int have = (int)(n - (hdr_end - buf));
                 char *body = hdr_end;
-                char *dyn = NULL;
                 if (have < clen) {
-                    dyn = (char*)malloc((size_t)clen + 1);
-                    if (!dyn) { send(fd, BAD_REQUEST, strlen(BAD_REQUEST), 0); close(fd); conns[i].fd=-1; continue; }
+                    char *dyn = (char*)arena_alloc(&g_req_arena, (size_t)clen + 1);
+                    if (!dyn) { conn_send(fd, BAD_REQUEST, strlen(BAD_REQUEST)); close_conn(c); continue; }
                     if (have > 0) memcpy(dyn, body, (size_t)have);
-                    if (read_remaining(fd, dyn, have, clen) < 0) { free(dyn); send(fd, BAD_REQUEST, strlen(BAD_REQUEST), 0); close(fd); conns[i].fd=-1; continue; }
+                    if (read_remaining(fd, dyn, have, clen) < 0) { conn_send(fd, BAD_REQUEST, strlen(BAD_REQUEST)); close_conn(c); continue; }
                     dyn[clen] = '\0';
                     body = dyn;
                 } else {
                     body[clen] = '\0';
                 }
+                trace_phase(&c->tr, PH_READ);
 				char username[64]={0}, password[256]={0};
 				if (!form_get_kv(body, "username", username, sizeof(username)) ||
 				    !form_get_kv(body, "password", password, sizeof(password))) {
-                    if (dyn) free(dyn); send(fd, BAD_REQUEST, strlen(BAD_REQUEST), 0); close(fd); conns[i].fd=-1; continue;
+                    conn_send(fd, BAD_REQUEST, strlen(BAD_REQUEST)); close_conn(c); continue;
 				}
-                if (dyn) free(dyn);
 				lowercase_ascii(username);
+				trace_phase(&c->tr, PH_PARSE);
 				if (validate_username(username) < 0 || strlen(password) < 8) {
-					send(fd, BAD_REQUEST, strlen(BAD_REQUEST), 0); close(fd); conns[i].fd=-1; continue;
+					conn_send(fd, BAD_REQUEST, strlen(BAD_REQUEST)); close_conn(c); continue;
 				}
-				char ph[256];
-				if (hash_password_pbkdf2(password, ph, sizeof(ph)) < 0) {
-					send(fd, BAD_REQUEST, strlen(BAD_REQUEST), 0); close(fd); conns[i].fd=-1; continue;
-				}
-				int r = db_create_user(username, ph);
-				if (r == -2) {
+				if (db_user_exists(username)) {
+					/* answered from the user directory, before any hashing */
+					trace_phase(&c->tr, PH_DB);
 					send_json(fd, "409 Conflict", "{\"error\":\"username_taken\"}");
-				} else if (r == 0) {
-					send_simple(fd, "201 Created", "text/plain; charset=utf-8", "ok");
-				} else {
-					send(fd, BAD_REQUEST, strlen(BAD_REQUEST), 0);
+					close_conn(c); continue;
 				}
-				close(fd); conns[i].fd = -1; continue;
+				/* charged only for names that get hashed, so a taken name's bucket,
+				   which guards its owner's logins, is never touched from here */
+				if ((wait = ratelimit_take(g_user_limit, username)) > 0) {
+					send_too_many(fd, wait); close_conn(c); continue;
+				}
+				AuthJob *job = (AuthJob*)calloc(1, sizeof(*job));
+				if (!job) { conn_send(fd, BAD_REQUEST, strlen(BAD_REQUEST)); close_conn(c); continue; }
+				job->kind = AUTH_REGISTER;
+				snprintf(job->username, sizeof(job->username), "%s", username);
+				snprintf(job->password, sizeof(job->password), "%s", password);
+				submit_auth_job(c, job);
+				continue;
 			}
 
             /* POST /login */
 			if (strcasecmp(method, "POST") == 0 && strcmp(path, "/login") == 0) {
+				int wait = ratelimit_take(g_ip_limit, c->ip);
+				if (wait > 0) { send_too_many(fd, wait); close_conn(c); continue; }
 				int clen = get_content_length(buf);
-                if (clen < 0 || clen > 1<<20) { send(fd, BAD_REQUEST, strlen(BAD_REQUEST), 0); close(fd); conns[i].fd=-1; continue; }
+                if (clen < 0 || clen > 1<<20) { conn_send(fd, BAD_REQUEST, strlen(BAD_REQUEST)); close_conn(c); continue; }
                 char *hdr_end = strstr(buf, "\r\n\r\n");
                 hdr_end = hdr_end ? hdr_end + 4 : NULL;
-                if (!hdr_end) { send(fd, BAD_REQUEST, strlen(BAD_REQUEST), 0); close(fd); conns[i].fd=-1; continue; }
+                if (!hdr_end) { conn_send(fd, BAD_REQUEST, strlen(BAD_REQUEST)); close_conn(c); continue; }
                 int have = (int)(n - (hdr_end - buf));
                 char *body = hdr_end;
-                char *dyn = NULL;
                 if (have < clen) {
-                    dyn = (char*)malloc((size_t)clen + 1);
-                    if (!dyn) { send(fd, BAD_REQUEST, strlen(BAD_REQUEST), 0); close(fd); conns[i].fd=-1; continue; }
+                    char *dyn = (char*)arena_alloc(&g_req_arena, (size_t)clen + 1);
+                    if (!dyn) { conn_send(fd, BAD_REQUEST, strlen(BAD_REQUEST)); close_conn(c); continue; }
                     if (have > 0) memcpy(dyn, body, (size_t)have);
-                    if (read_remaining(fd, dyn, have, clen) < 0) { free(dyn); send(fd, BAD_REQUEST, strlen(BAD_REQUEST), 0); close(fd); conns[i].fd=-1; continue; }
+                    if (read_remaining(fd, dyn, have, clen) < 0) { conn_send(fd, BAD_REQUEST, strlen(BAD_REQUEST)); close_conn(c); continue; }
                     dyn[clen] = '\0';
                     body = dyn;
                 } else {
                     body[clen] = '\0';
                 }
+                trace_phase(&c->tr, PH_READ);
 				char username[64]={0}, password[256]={0};
 				if (!form_get_kv(body, "username", username, sizeof(username)) ||
 				    !form_get_kv(body, "password", password, sizeof(password))) {
-                    if (dyn) free(dyn); send(fd, BAD_REQUEST, strlen(BAD_REQUEST), 0); close(fd); conns[i].fd=-1; continue;
+                    conn_send(fd, BAD_REQUEST, strlen(BAD_REQUEST)); close_conn(c); continue;
 				}
-                if (dyn) free(dyn);
 				lowercase_ascii(username);
+				/* only failed logins are charged, and to the client's own (ip, username)
+				   bucket, so wrong passwords sent by others never lock the owner out */
+				char limit_key[INET6_ADDRSTRLEN + 64];
+				snprintf(limit_key, sizeof(limit_key), "%s|%s", c->ip, username);
+				if ((wait = ratelimit_peek(g_user_limit, limit_key)) > 0) {
+					send_too_many(fd, wait); close_conn(c); continue;
+				}
 				int uid = 0;
 				char stored[256];
-				if (db_get_user_by_username(username, &uid, stored, sizeof(stored)) < 0) {
-					fprintf(stderr, "[login] user not found: %s\n", username);
-					send(fd, UNAUTHORIZED, strlen(UNAUTHORIZED), 0);
-					close(fd); conns[i].fd=-1; continue;
-				}
-				/* IMPORTANT: implement verify_password_pbkdf2() fully; currently stub returns -1 */
-				if (verify_password_pbkdf2(password, stored) != 1) {
-					fprintf(stderr, "[login] bad password for: %s\n", username);
-					send(fd, UNAUTHORIZED, strlen(UNAUTHORIZED), 0);
-					close(fd); conns[i].fd=-1; continue;
-				}
-				char sid[128];
-				if (generate_session_id(sid, sizeof(sid)) < 0) {
-					send(fd, BAD_REQUEST, strlen(BAD_REQUEST), 0);
-					close(fd); conns[i].fd=-1; continue;
+				trace_phase(&c->tr, PH_PARSE);
+				int found = db_get_user_by_username(username, &uid, stored, sizeof(stored));
+				trace_phase(&c->tr, PH_DB);
+				if (found < 0) {
+					log_event(LOG_WARN, "login_failed", "ip=%s user=%s reason=unknown_user", c->ip, username);
+					ratelimit_take(g_user_limit, limit_key);
+					conn_send(fd, UNAUTHORIZED, strlen(UNAUTHORIZED));
+					close_conn(c); continue;
 				}
-				long ttl = 7*24*3600;
-				if (db_create_session(sid, uid, time(NULL)+ttl) < 0) {
-					send(fd, BAD_REQUEST, strlen(BAD_REQUEST), 0);
-					close(fd); conns[i].fd=-1; continue;
-				}
-				set_cookie_and_no_content(fd, "sid", sid, (int)ttl);
-				close(fd); conns[i].fd=-1; continue;
+				AuthJob *job = (AuthJob*)calloc(1, sizeof(*job));
+				if (!job) { conn_send(fd, BAD_REQUEST, strlen(BAD_REQUEST)); close_conn(c); continue; }
+				job->kind = AUTH_LOGIN;
+				job->user_id = uid;
+				snprintf(job->username, sizeof(job->username), "%s", username);
+				snprintf(job->password, sizeof(job->password), "%s", password);
+				snprintf(job->hash, sizeof(job->hash), "%s", stored);
+				submit_auth_job(c, job);
+				continue;
 			}
 
 			/* POST /logout */
 			if (strcasecmp(method, "POST") == 0 && strcmp(path, "/logout") == 0) {
 				char sid[256]={0};
 				get_cookie_value(buf, "sid", sid, sizeof(sid));
-				if (sid[0]) db_delete_session(sid);
+				if (sid[0]) {
+					if (g_token_sessions && token_revoke(sid) < 0) {
+						/* the token stays valid, so the logout did not happen */
+						log_event(LOG_WARN, "logout_failed", "ip=%s reason=revocation_list_full", c->ip);
+						metrics_add(CTR_LOGOUT_FAILED, 1);
+						conn_send(fd, SERVICE_UNAVAILABLE, strlen(SERVICE_UNAVAILABLE));
+						close_conn(c); continue;
+					}
+					if (!g_token_sessions) db_delete_session(sid);
+				}
+				trace_phase(&c->tr, PH_DB);
 				set_cookie_and_no_content(fd, "sid", "deleted", 0);
-				close(fd); conns[i].fd=-1; continue;
+				close_conn(c); continue;
 			}
 
 			/* WS upgrade with auth via Cookie sid */
             if (strcmp(path, "/ws") == 0 && ws_key) {
-				char sid[256]={0};
-				get_cookie_value(buf, "sid", sid, sizeof(sid));
 				int uid = 0;
-				int ok = sid[0] ? db_get_session_user(sid, &uid) : 0;
-				if (ok != 1) {
-					send(fd, UNAUTHORIZED, strlen(UNAUTHORIZED), 0);
-					close(fd); conns[i].fd = -1; continue;
+				int authed = authenticate(buf, &uid, c->username, sizeof(c->username));
+				trace_phase(&c->tr, PH_AUTH);
+				if (authed != 1) {
+					conn_send(fd, UNAUTHORIZED, strlen(UNAUTHORIZED));
+					close_conn(c); continue;
 				}
 				char accept[64]; compute_ws_accept(ws_key, accept);
 				char resp[512];
@@ -487,26 +1462,49 @@ int main(void) {
 					"Connection: Upgrade\r\n"
 					"Upgrade: websocket\r\n"
 					"Sec-WebSocket-Accept: %s\r\n\r\n", accept);
-				send(fd, resp, (size_t)m, 0);
-				printf("[upgrade] client fd=%d -> WebSocket (uid=%d)\n", fd, uid);
-				fflush(stdout);
-				conns[i].type = CONN_WS;
-				conns[i].user_id = uid;
-                if (db_get_username_by_id(uid, conns[i].username, sizeof(conns[i].username)) != 0) {
-                    snprintf(conns[i].username, sizeof(conns[i].username), "user%d", uid);
+				trace_phase(&c->tr, PH_BUILD);
+				conn_send(fd, resp, (size_t)m);
+				trace_phase(&c->tr, PH_SEND);
+				log_event(LOG_INFO, "ws_open", "fd=%d uid=%d ip=%s", fd, uid, c->ip);
+				uint64_t dur = now_ns() - c->tr.start;
+				metrics_request(ROUTE_WS, dur);
+				log_access(c->ip, c->method, c->path, 101, g_resp[fd].bytes, dur);
+				trace_end(&c->tr, c->method, c->path, 101);
+				metrics_add(CTR_HTTP_ACTIVE, -1);
+				metrics_add(CTR_WS_ACTIVE, 1);
+				conn_ws_join(c);
+				c->user_id = uid;
+                if (!c->username[0]) {
+                    snprintf(c->username, sizeof(c->username), "user%d", uid);
                 }
+				char qv[32];
+				if (query && form_get_kv(query, "since", qv, sizeof(qv)) && atol(qv) > 0) ws_replay(c, atol(qv));
 				continue;
 			}
 
-			send(fd, NOT_FOUND, strlen(NOT_FOUND), 0);
-			close(fd); conns[i].fd = -1;
+			conn_send(fd, NOT_FOUND, strlen(NOT_FOUND));
+			close_conn(c);
 		}
 
 	}
 
-	for (int i = 0; i < FD_SETSIZE; i++) if (conns[i].fd >= 0) close(conns[i].fd);
-	close(srv);
+	workpool_destroy(g_auth_pool);   /* answers any logins still in flight */
+	if (g_read_pool) workpool_destroy(g_read_pool);
+	while (conn_live_count() > 0) {
+		Conn *c = conn_live_at(conn_live_count() - 1);
+		if (c->type == CONN_WS) { ws_rx_free(&c->rx); ws_tx_free(&c->tx); }
+		if (c->type == CONN_EXPORT) export_close(c->exp);
+		close(c->fd);
+		conn_release(c);
+	}
+	arena_free(&g_req_arena);
+	relay_close();
+	history_free();
+	if (srv >= 0) close(srv);
+	ratelimit_destroy(g_ip_limit);
+	ratelimit_destroy(g_user_limit);
 	db_close();
+	log_shutdown();
 	printf("Server stopped\n");
 	return 0;
 }
\ No newline at end of file
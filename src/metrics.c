@@ -0,0 +1,240 @@
+#include "metrics.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_LINE 64
+#define NBUCKETS 15   /* finite buckets; the +Inf bucket is implied by count */
+
+static const uint64_t bucket_ns[NBUCKETS] = {
+    100000ULL, 250000ULL, 500000ULL,                     /* 0.1ms .. 0.5ms */
+    1000000ULL, 2500000ULL, 5000000ULL,                  /* 1ms .. 5ms */
+    10000000ULL, 25000000ULL, 50000000ULL,               /* 10ms .. 50ms */
+    100000000ULL, 250000000ULL, 500000000ULL,            /* 100ms .. 500ms */
+    1000000000ULL, 2500000000ULL, 5000000000ULL,         /* 1s .. 5s */
+};
+static const char *bucket_le[NBUCKETS] = {
+    "0.0001", "0.00025", "0.0005", "0.001", "0.0025", "0.005", "0.01", "0.025",
+    "0.05", "0.1", "0.25", "0.5", "1", "2.5", "5",
+};
+
+static const char *route_names[ROUTE_COUNT] = {
+    "/", "/static", "/me", "/stats", "/messages", "/register", "/login", "/logout",
+    "/ws", "/metrics", "/events", "/messages/search", "/messages/export", "other",
+};
+static const char *dbop_names[DBOP_COUNT] = {
+    "create_user", "get_user", "create_session", "get_session", "delete_session",
+    "get_username", "user_count", "save_message", "get_messages", "search_messages",
+};
+
+typedef struct {
+    uint64_t buckets[NBUCKETS + 1];
+    uint64_t sum_ns;
+    uint64_t count;
+} hist;
+
+typedef struct shard {
+    uint64_t counters[CTR_COUNT];
+    hist req[ROUTE_COUNT];
+    hist db[DBOP_COUNT];
+    hist fanout;
+    hist pbkdf2_queue;
+    hist loop_turn;
+    struct shard *next;
+} __attribute__((aligned(CACHE_LINE))) shard;
+
+static shard *g_shards = NULL;
+static pthread_mutex_t g_shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local shard *t_shard = NULL;
+
+static shard *my_shard(void) {
+    shard *s = t_shard;
+    if (s) return s;
+    /* round the size up so neighbouring shards never share a line */
+    size_t sz = (sizeof(shard) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    void *mem = NULL;
+    if (posix_memalign(&mem, CACHE_LINE, sz) != 0) abort();
+    s = (shard*)mem;
+    memset(s, 0, sz);
+    pthread_mutex_lock(&g_shards_lock);
+    s->next = g_shards;
+    g_shards = s;
+    pthread_mutex_unlock(&g_shards_lock);
+    t_shard = s;
+    return s;
+}
+
+/* only the owning thread writes a shard, so load+store is enough (no lock prefix) */
+static inline void bump(uint64_t *p, uint64_t v) {
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t rd(const uint64_t *p) {
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static void observe(hist *h, uint64_t ns) {
+    int b = 0;
+    while (b < NBUCKETS && ns > bucket_ns[b]) b++;
+    bump(&h->buckets[b], 1);
+    bump(&h->sum_ns, ns);
+    bump(&h->count, 1);
+}
+
+void metrics_add(metrics_counter c, int64_t v) {
+    bump(&my_shard()->counters[c], (uint64_t)v);
+}
+
+void metrics_request(metrics_route r, uint64_t ns) {
+    observe(&my_shard()->req[r], ns);
+}
+
+void metrics_db(metrics_dbop op, uint64_t ns) {
+    observe(&my_shard()->db[op], ns);
+}
+
+void metrics_fanout(uint64_t ns) {
+    observe(&my_shard()->fanout, ns);
+}
+
+void metrics_pbkdf2_queue(uint64_t ns) {
+    observe(&my_shard()->pbkdf2_queue, ns);
+}
+
+void metrics_loop_turn(uint64_t ns) {
+    observe(&my_shard()->loop_turn, ns);
+}
+
+/* ---- rendering ---- */
+
+static void sum_hist(hist *dst, const hist *src) {
+    for (int b = 0; b <= NBUCKETS; b++) dst->buckets[b] += rd(&src->buckets[b]);
+    dst->sum_ns += rd(&src->sum_ns);
+    dst->count += rd(&src->count);
+}
+
+static void render_hist(strbuf *out, const char *name, const char *label, const hist *h) {
+    uint64_t cum = 0;
+    const char *sep = label[0] ? "," : "";
+    for (int b = 0; b < NBUCKETS; b++) {
+        cum += h->buckets[b];
+        sb_printf(out, "%s_bucket{%s%sle=\"%s\"} %llu\n", name, label, sep, bucket_le[b], (unsigned long long)cum);
+    }
+    sb_printf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, label, sep, (unsigned long long)h->count);
+    if (label[0]) {
+        sb_printf(out, "%s_sum{%s} %.9f\n", name, label, (double)h->sum_ns / 1e9);
+        sb_printf(out, "%s_count{%s} %llu\n", name, label, (unsigned long long)h->count);
+    } else {
+        sb_printf(out, "%s_sum %.9f\n", name, (double)h->sum_ns / 1e9);
+        sb_printf(out, "%s_count %llu\n", name, (unsigned long long)h->count);
+    }
+}
+
+void metrics_render(strbuf *out) {
+    void *mem = NULL;
+    if (posix_memalign(&mem, CACHE_LINE, sizeof(shard)) != 0) { out->failed = 1; return; }
+    shard *total = (shard*)mem;
+    memset(total, 0, sizeof(shard));
+    pthread_mutex_lock(&g_shards_lock);
+    for (const shard *s = g_shards; s; s = s->next) {
+        for (int c = 0; c < CTR_COUNT; c++) total->counters[c] += rd(&s->counters[c]);
+        for (int r = 0; r < ROUTE_COUNT; r++) sum_hist(&total->req[r], &s->req[r]);
+        for (int d = 0; d < DBOP_COUNT; d++) sum_hist(&total->db[d], &s->db[d]);
+        sum_hist(&total->fanout, &s->fanout);
+        sum_hist(&total->pbkdf2_queue, &s->pbkdf2_queue);
+        sum_hist(&total->loop_turn, &s->loop_turn);
+    }
+    pthread_mutex_unlock(&g_shards_lock);
+
+    char label[64];
+    sb_puts(out, "# HELP chat_http_requests_total HTTP requests by route.\n"
+                 "# TYPE chat_http_requests_total counter\n");
+    for (int r = 0; r < ROUTE_COUNT; r++)
+        sb_printf(out, "chat_http_requests_total{route=\"%s\"} %llu\n", route_names[r], (unsigned long long)total->req[r].count);
+
+    sb_puts(out, "# HELP chat_http_request_duration_seconds Time from reading a request to closing it.\n"
+                 "# TYPE chat_http_request_duration_seconds histogram\n");
+    for (int r = 0; r < ROUTE_COUNT; r++) {
+        if (!total->req[r].count) continue;
+        snprintf(label, sizeof(label), "route=\"%s\"", route_names[r]);
+        render_hist(out, "chat_http_request_duration_seconds", label, &total->req[r]);
+    }
+
+    sb_puts(out, "# HELP chat_sqlite_call_duration_seconds SQLite call latency by operation.\n"
+                 "# TYPE chat_sqlite_call_duration_seconds histogram\n");
+    for (int d = 0; d < DBOP_COUNT; d++) {
+        if (!total->db[d].count) continue;
+        snprintf(label, sizeof(label), "op=\"%s\"", dbop_names[d]);
+        render_hist(out, "chat_sqlite_call_duration_seconds", label, &total->db[d]);
+    }
+
+    sb_puts(out, "# HELP chat_broadcast_fanout_seconds Time to send one chat message to every WebSocket client.\n"
+                 "# TYPE chat_broadcast_fanout_seconds histogram\n");
+    render_hist(out, "chat_broadcast_fanout_seconds", "", &total->fanout);
+
+    sb_puts(out, "# HELP chat_pbkdf2_queue_seconds Time a password job waited for a worker thread.\n"
+                 "# TYPE chat_pbkdf2_queue_seconds histogram\n");
+    render_hist(out, "chat_pbkdf2_queue_seconds", "", &total->pbkdf2_queue);
+
+    sb_puts(out, "# HELP chat_event_loop_turn_seconds Time the event loop spent handling one select() wakeup.\n"
+                 "# TYPE chat_event_loop_turn_seconds histogram\n");
+    render_hist(out, "chat_event_loop_turn_seconds", "", &total->loop_turn);
+
+    sb_printf(out,
+        "# HELP chat_http_connections Open HTTP connections.\n"
+        "# TYPE chat_http_connections gauge\n"
+        "chat_http_connections %lld\n"
+        "# HELP chat_ws_connections Open WebSocket connections.\n"
+        "# TYPE chat_ws_connections gauge\n"
+        "chat_ws_connections %lld\n"
+        "# HELP chat_sse_connections Open /events (Server-Sent Events) subscriptions.\n"
+        "# TYPE chat_sse_connections gauge\n"
+        "chat_sse_connections %lld\n"
+        "# HELP chat_ws_messages_total Chat messages received over WebSocket.\n"
+        "# TYPE chat_ws_messages_total counter\n"
+        "chat_ws_messages_total %llu\n"
+        "# HELP chat_export_messages_total Messages streamed by /messages/export.\n"
+        "# TYPE chat_export_messages_total counter\n"
+        "chat_export_messages_total %llu\n"
+        "# HELP chat_relay_messages_sent_total Messages passed to the relay hub.\n"
+        "# TYPE chat_relay_messages_sent_total counter\n"
+        "chat_relay_messages_sent_total %llu\n"
+        "# HELP chat_relay_messages_received_total Messages from other instances delivered here.\n"
+        "# TYPE chat_relay_messages_received_total counter\n"
+        "chat_relay_messages_received_total %llu\n"
+        "# HELP chat_relay_messages_dropped_total Messages not relayed because the queue to the hub was full.\n"
+        "# TYPE chat_relay_messages_dropped_total counter\n"
+        "chat_relay_messages_dropped_total %llu\n"
+        "# HELP chat_overloaded Whether new requests are being shed (1) or admitted (0).\n"
+        "# TYPE chat_overloaded gauge\n"
+        "chat_overloaded %lld\n"
+        "# HELP chat_requests_shed_total Connections turned away with 503 by admission control.\n"
+        "# TYPE chat_requests_shed_total counter\n"
+        "chat_requests_shed_total{kind=\"http\"} %llu\n"
+        "chat_requests_shed_total{kind=\"upgrade\"} %llu\n"
+        "chat_requests_shed_total{kind=\"accept\"} %llu\n"
+        "# HELP chat_logout_failures_total Logouts answered 503 because the token could not be revoked.\n"
+        "# TYPE chat_logout_failures_total counter\n"
+        "chat_logout_failures_total %llu\n"
+        "# HELP chat_bytes_received_total Bytes read from client sockets.\n"
+        "# TYPE chat_bytes_received_total counter\n"
+        "chat_bytes_received_total %llu\n"
+        "# HELP chat_bytes_sent_total Bytes written to client sockets.\n"
+        "# TYPE chat_bytes_sent_total counter\n"
+        "chat_bytes_sent_total %llu\n",
+        (long long)total->counters[CTR_HTTP_ACTIVE], (long long)total->counters[CTR_WS_ACTIVE],
+        (long long)total->counters[CTR_SSE_ACTIVE],
+        (unsigned long long)total->counters[CTR_WS_MESSAGES],
+        (unsigned long long)total->counters[CTR_EXPORT_MESSAGES],
+        (unsigned long long)total->counters[CTR_RELAY_SENT],
+        (unsigned long long)total->counters[CTR_RELAY_RECEIVED],
+        (unsigned long long)total->counters[CTR_RELAY_DROPPED],
+        (long long)total->counters[CTR_OVERLOADED],
+        (unsigned long long)total->counters[CTR_SHED_HTTP],
+        (unsigned long long)total->counters[CTR_SHED_UPGRADE],
+        (unsigned long long)total->counters[CTR_SHED_ACCEPT],
+        (unsigned long long)total->counters[CTR_LOGOUT_FAILED],
+        (unsigned long long)total->counters[CTR_BYTES_IN], (unsigned long long)total->counters[CTR_BYTES_OUT]);
+    free(total);
+}
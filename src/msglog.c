@@ -0,0 +1,646 @@
+#include "msglog.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+
+/* record layout, host byte order; username and content follow the header,
+   each NUL-terminated so readers can pass them on straight from the map */
+typedef struct {
+    uint32_t len;       /* whole record, a multiple of 8; 0 marks the end */
+    uint32_t crc;       /* CRC-32 of everything after this field */
+    int64_t id;
+    int64_t ts;
+    int32_t user_id;
+    uint32_t ulen;      /* without the NUL */
+    uint32_t clen;
+    uint32_t reserved;
+} rec_hdr;
+
+/* segment files start with the magic and their base id */
+static const char SEG_MAGIC[8] = "MSGLOG1";
+#define SEG_HDR 16
+#define SEG_MIN_BYTES ((size_t)1 << 20)
+#define SEG_MAX_BYTES ((size_t)1 << 30)   /* offsets are 32-bit */
+#define INDEX_EVERY 64
+#define MAINT_INTERVAL 60                 /* seconds between retention checks */
+
+typedef struct {
+    long id;
+    uint32_t off;
+} idx_entry;
+
+typedef struct {
+    long base;              /* lowest id it may hold, also its file name */
+    int fd;                 /* open while it is the active segment */
+    unsigned char *map;
+    size_t size;            /* mapped bytes */
+    size_t used;            /* bytes up to the end of the last record */
+    size_t nrec;
+    long last_id;           /* base - 1 while empty */
+    long first_ts, last_ts;
+    idx_entry *idx;         /* record 0, INDEX_EVERY, 2*INDEX_EVERY, ... */
+    size_t nidx, idx_cap;
+} segment;
+
+static char g_dir[512];
+static segment *g_segs = NULL;    /* oldest first; the last one takes appends */
+static size_t g_nseg, g_segcap;
+static size_t g_seg_bytes, g_retain_bytes;
+static long g_retain_sec;
+static long g_next_maint;
+static uint32_t g_crc_table[256];
+
+/* Sealing syncs a whole segment and compaction rewrites one, which can take
+   seconds, so both run on a maintenance thread. The event loop hands a job
+   over and picks up the result on a later call; no segment is dropped or
+   compacted again while a job is out. */
+typedef struct maint_job {
+    struct maint_job *next;
+    int compact;            /* else a seal */
+    segment seg;            /* copy of the segment to seal or compact */
+    long cutoff;
+    int result;             /* compact: 1 rewritten into fresh, 0 nothing to do, -1 failed */
+    segment fresh;
+} maint_job;
+
+static pthread_mutex_t g_maint_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_maint_cv = PTHREAD_COND_INITIALIZER;
+static maint_job *g_todo, *g_todo_tail, *g_done;
+static int g_maint_stop;
+static int g_maint_running;
+static pthread_t g_maint_thread;
+static size_t g_maint_pending;    /* event loop: jobs handed over, not yet collected */
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        g_crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32_of(const unsigned char *p, size_t n) {
+    uint32_t c = 0xFFFFFFFFu;
+    while (n--) c = g_crc_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+static void seg_path(char *out, size_t n, long base, const char *ext) {
+    snprintf(out, n, "%s/%020ld.%s", g_dir, base, ext);
+}
+
+static const rec_hdr *rec(const segment *s, size_t off) {
+    return (const rec_hdr*)(s->map + off);
+}
+
+static size_t rec_len(size_t ulen, size_t clen) {
+    return (sizeof(rec_hdr) + ulen + clen + 2 + 7) & ~(size_t)7;
+}
+
+/* the record at off if it is complete and intact */
+static const rec_hdr *rec_check(const segment *s, size_t off) {
+    if (off + sizeof(rec_hdr) > s->size) return NULL;
+    const rec_hdr *h = rec(s, off);
+    if (h->len < sizeof(rec_hdr) || (h->len & 7) || h->len > s->size - off) return NULL;
+    if (rec_len(h->ulen, h->clen) != h->len) return NULL;
+    if (crc32_of((const unsigned char*)h + 8, h->len - 8) != h->crc) return NULL;
+    return h;
+}
+
+static int index_add(segment *s, long id, size_t off) {
+    if (s->nrec % INDEX_EVERY) return 0;
+    if (s->nidx == s->idx_cap) {
+        size_t cap = s->idx_cap ? s->idx_cap * 2 : 64;
+        idx_entry *p = (idx_entry*)realloc(s->idx, cap * sizeof(idx_entry));
+        if (!p) return -1;
+        s->idx = p;
+        s->idx_cap = cap;
+    }
+    s->idx[s->nidx].id = id;
+    s->idx[s->nidx].off = (uint32_t)off;
+    s->nidx++;
+    return 0;
+}
+
+/* 0, or -1 (nothing noted) when the index cannot grow */
+static int note_record(segment *s, const rec_hdr *h, size_t off) {
+    if (index_add(s, (long)h->id, off) < 0) return -1;
+    if (s->nrec == 0) s->first_ts = (long)h->ts;
+    s->last_ts = (long)h->ts;
+    s->last_id = (long)h->id;
+    s->nrec++;
+    s->used = off + h->len;
+    return 0;
+}
+
+static void seg_unmap(segment *s) {
+    if (s->map) munmap(s->map, s->size);
+    if (s->fd >= 0) close(s->fd);
+    free(s->idx);
+    s->map = NULL;
+    s->fd = -1;
+    s->idx = NULL;
+}
+
+/* clears whatever a torn append left past the last good record, so it
+   can never be mistaken for part of the log later */
+static void zero_tail(segment *s) {
+    size_t off = s->used;
+    while (off < s->size) {
+        size_t n = s->size - off < 4096 ? s->size - off : 4096;
+        size_t i = 0;
+        while (i < n && s->map[off + i] == 0) i++;
+        if (i == n) break;
+        memset(s->map + off, 0, n);
+        off += n;
+    }
+}
+
+/* maps an existing segment and rebuilds its index, keeping the records up
+   to the first damaged one; the active segment is mapped writable and
+   grown back to full size */
+static int seg_load(segment *s, long base, int active) {
+    char path[600];
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+    s->base = base;
+    s->last_id = base - 1;
+    seg_path(path, sizeof(path), base, "log");
+    int fd = open(path, active ? O_RDWR : O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0) { close(fd); return -1; }
+    size_t size = (size_t)st.st_size;
+    if (active && size < g_seg_bytes) {
+        if (ftruncate(fd, (off_t)g_seg_bytes) < 0) { close(fd); return -1; }
+        size = g_seg_bytes;
+    }
+    if (size < SEG_HDR) { close(fd); return -1; }
+    void *map = mmap(NULL, size, active ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) { close(fd); return -1; }
+    s->map = (unsigned char*)map;
+    s->size = size;
+    if (active) s->fd = fd; else close(fd);
+    int64_t hdr_base;
+    memcpy(&hdr_base, s->map + 8, sizeof(hdr_base));
+    if (memcmp(s->map, SEG_MAGIC, sizeof(SEG_MAGIC)) != 0 || hdr_base != base) {
+        seg_unmap(s);
+        return -1;
+    }
+    size_t off = SEG_HDR;
+    const rec_hdr *h;
+    while ((h = rec_check(s, off)) && (long)h->id > s->last_id) {
+        if (note_record(s, h, off) < 0) {
+            seg_unmap(s);
+            return -1;
+        }
+        off += h->len;
+    }
+    s->used = off;
+    if (off + sizeof(uint32_t) <= s->size && rec(s, off)->len != 0) {
+        log_event(LOG_WARN, "msglog_damaged", "segment=%ld offset=%zu records=%zu", base, off, s->nrec);
+        if (active) zero_tail(s);
+    }
+    return 0;
+}
+
+static int seg_create(segment *s, long base) {
+    char path[600];
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+    s->base = base;
+    s->last_id = base - 1;
+    seg_path(path, sizeof(path), base, "log");
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    if (ftruncate(fd, (off_t)g_seg_bytes) < 0) { close(fd); unlink(path); return -1; }
+    void *map = mmap(NULL, g_seg_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) { close(fd); unlink(path); return -1; }
+    s->fd = fd;
+    s->map = (unsigned char*)map;
+    s->size = g_seg_bytes;
+    int64_t b = base;
+    memcpy(s->map, SEG_MAGIC, sizeof(SEG_MAGIC));
+    memcpy(s->map + 8, &b, sizeof(b));
+    s->used = SEG_HDR;
+    return 0;
+}
+
+/* syncs a full segment and trims the file to its records; takes the fd */
+static void seal_sync(const segment *s) {
+    msync(s->map, s->used, MS_SYNC);
+    if (ftruncate(s->fd, (off_t)s->used) < 0)
+        log_event(LOG_WARN, "msglog_trim_failed", "segment=%ld errno=%d", s->base, errno);
+    close(s->fd);
+}
+
+static void seg_remove(segment *s) {
+    char path[600];
+    seg_path(path, sizeof(path), s->base, "log");
+    seg_unmap(s);
+    unlink(path);
+}
+
+static segment *seg_push(void) {
+    if (g_nseg == g_segcap) {
+        size_t cap = g_segcap ? g_segcap * 2 : 16;
+        segment *p = (segment*)realloc(g_segs, cap * sizeof(segment));
+        if (!p) return NULL;
+        g_segs = p;
+        g_segcap = cap;
+    }
+    return &g_segs[g_nseg++];
+}
+
+/* Rewrites the oldest segment without its records older than cutoff, once
+   they are at least half of it, and loads the copy into fresh. The copy is
+   named after its new first id and renamed into place; the original is
+   removed when the event loop swaps the copy in. Maintenance thread. */
+static int compact_copy(const segment *s, long cutoff, segment *fresh) {
+    size_t off = SEG_HDR;
+    while (off < s->used && rec(s, off)->ts < cutoff) off += rec(s, off)->len;
+    if (off == SEG_HDR || off == s->used || (off - SEG_HDR) * 2 < s->used - SEG_HDR) return 0;
+
+    long base = (long)rec(s, off)->id;
+    char tmp[600], path[600];
+    seg_path(tmp, sizeof(tmp), base, "tmp");
+    seg_path(path, sizeof(path), base, "log");
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    unsigned char hdr[SEG_HDR];
+    int64_t b = base;
+    memcpy(hdr, SEG_MAGIC, sizeof(SEG_MAGIC));
+    memcpy(hdr + 8, &b, sizeof(b));
+    int ok = write(fd, hdr, SEG_HDR) == SEG_HDR;
+    for (size_t p = off; ok && p < s->used; ) {
+        ssize_t n = write(fd, s->map + p, s->used - p);
+        if (n <= 0) ok = 0; else p += (size_t)n;
+    }
+    ok = ok && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp, path) < 0 || seg_load(fresh, base, 0) < 0) {
+        unlink(ok ? path : tmp);
+        log_event(LOG_WARN, "msglog_compact_failed", "segment=%ld errno=%d", s->base, errno);
+        return -1;
+    }
+    return 1;
+}
+
+static void *maint_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_maint_mu);
+    for (;;) {
+        while (!g_todo && !g_maint_stop) pthread_cond_wait(&g_maint_cv, &g_maint_mu);
+        maint_job *j = g_todo;
+        if (!j) break;
+        g_todo = j->next;
+        pthread_mutex_unlock(&g_maint_mu);
+        if (j->compact) j->result = compact_copy(&j->seg, j->cutoff, &j->fresh);
+        else seal_sync(&j->seg);
+        pthread_mutex_lock(&g_maint_mu);
+        j->next = g_done;
+        g_done = j;
+    }
+    pthread_mutex_unlock(&g_maint_mu);
+    return NULL;
+}
+
+static void maint_submit(maint_job *j) {
+    g_maint_pending++;
+    if (!g_maint_running) {
+        /* no thread: do it here */
+        if (j->compact) j->result = compact_copy(&j->seg, j->cutoff, &j->fresh);
+        else seal_sync(&j->seg);
+        j->next = g_done;
+        g_done = j;
+        return;
+    }
+    pthread_mutex_lock(&g_maint_mu);
+    j->next = NULL;
+    if (g_todo) g_todo_tail->next = j; else g_todo = j;
+    g_todo_tail = j;
+    pthread_cond_signal(&g_maint_cv);
+    pthread_mutex_unlock(&g_maint_mu);
+}
+
+/* event loop: takes in finished jobs; a compacted copy replaces the oldest
+   segment it was made from */
+static void maint_collect(void) {
+    if (!g_maint_pending) return;
+    pthread_mutex_lock(&g_maint_mu);
+    maint_job *j = g_done;
+    g_done = NULL;
+    pthread_mutex_unlock(&g_maint_mu);
+    while (j) {
+        maint_job *next = j->next;
+        if (j->compact && j->result > 0) {
+            if (g_nseg > 1 && g_segs[0].base == j->seg.base) {
+                size_t dropped = g_segs[0].nrec - j->fresh.nrec;
+                seg_remove(&g_segs[0]);
+                g_segs[0] = j->fresh;
+                log_event(LOG_INFO, "msglog_compacted", "segment=%ld dropped=%zu kept=%zu",
+                          j->fresh.base, dropped, j->fresh.nrec);
+            } else {
+                seg_remove(&j->fresh);
+            }
+        }
+        free(j);
+        g_maint_pending--;
+        j = next;
+    }
+}
+
+/* makes a full segment read-only and has it synced and trimmed */
+static int seg_seal(segment *s) {
+    maint_job *j = (maint_job*)calloc(1, sizeof(*j));
+    if (!j) return -1;
+    mprotect(s->map, s->size, PROT_READ);
+    j->seg = *s;
+    s->fd = -1;
+    maint_submit(j);
+    return 0;
+}
+
+static void compact_head(long cutoff) {
+    maint_job *j = (maint_job*)calloc(1, sizeof(*j));
+    if (!j) return;
+    j->compact = 1;
+    j->seg = g_segs[0];
+    j->cutoff = cutoff;
+    maint_submit(j);
+}
+
+/* retention: whole segments first (never the active one), then compaction
+   of the oldest one left */
+static void maintain(long now) {
+    if (g_maint_pending) {
+        g_next_maint = now + 1;   /* again once the job is in */
+        return;
+    }
+    g_next_maint = now + MAINT_INTERVAL;
+    if (!g_retain_sec && !g_retain_bytes) return;
+    long cutoff = g_retain_sec ? now - g_retain_sec : LONG_MIN;
+    size_t total = 0;
+    for (size_t i = 0; i < g_nseg; i++) total += g_segs[i].used;
+    size_t drop = 0;
+    while (drop + 1 < g_nseg) {
+        segment *s = &g_segs[drop];
+        int expired = s->nrec == 0 || s->last_ts < cutoff;
+        int over = g_retain_bytes && total > g_retain_bytes;
+        if (!expired && !over) break;
+        log_event(LOG_INFO, "msglog_segment_dropped", "segment=%ld records=%zu", s->base, s->nrec);
+        total -= s->used;
+        seg_remove(s);
+        drop++;
+    }
+    if (drop) {
+        memmove(g_segs, g_segs + drop, (g_nseg - drop) * sizeof(segment));
+        g_nseg -= drop;
+    }
+    if (g_nseg > 1 && g_retain_sec) compact_head(cutoff);
+}
+
+static int cmp_long(const void *a, const void *b) {
+    long x = *(const long*)a, y = *(const long*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* base ids of the segment files in g_dir, sorted; removes leftovers of an
+   interrupted compaction */
+static int list_segments(long **out, size_t *n) {
+    DIR *d = opendir(g_dir);
+    if (!d) return -1;
+    long *bases = NULL;
+    size_t cnt = 0, cap = 0;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        const char *name = e->d_name;
+        if (strlen(name) != 24 || strspn(name, "0123456789") != 20) continue;
+        if (strcmp(name + 20, ".tmp") == 0) {
+            char path[600];
+            snprintf(path, sizeof(path), "%s/%s", g_dir, name);
+            unlink(path);
+            continue;
+        }
+        if (strcmp(name + 20, ".log") != 0) continue;
+        if (cnt == cap) {
+            cap = cap ? cap * 2 : 16;
+            long *p = (long*)realloc(bases, cap * sizeof(long));
+            if (!p) { free(bases); closedir(d); return -1; }
+            bases = p;
+        }
+        bases[cnt++] = strtol(name, NULL, 10);
+    }
+    closedir(d);
+    if (cnt) qsort(bases, cnt, sizeof(long), cmp_long);
+    *out = bases;
+    *n = cnt;
+    return 0;
+}
+
+int msglog_open(const char *dir, size_t segment_bytes, long retain_sec, size_t retain_bytes) {
+    crc_init();
+    snprintf(g_dir, sizeof(g_dir), "%s", dir);
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) return -1;
+    g_seg_bytes = segment_bytes < SEG_MIN_BYTES ? SEG_MIN_BYTES
+                : segment_bytes > SEG_MAX_BYTES ? SEG_MAX_BYTES : segment_bytes;
+    g_retain_sec = retain_sec > 0 ? retain_sec : 0;
+    g_retain_bytes = retain_bytes;
+    g_nseg = 0;
+    g_maint_stop = 0;
+    g_maint_running = pthread_create(&g_maint_thread, NULL, maint_main, NULL) == 0;
+    if (!g_maint_running) log_event(LOG_WARN, "msglog_no_maintenance_thread", "errno=%d", errno);
+
+    long *bases;
+    size_t n;
+    if (list_segments(&bases, &n) < 0) return -1;
+    for (size_t i = 0; i < n; i++) {
+        segment *s = seg_push();
+        if (!s || seg_load(s, bases[i], i == n - 1) < 0) {
+            if (s) g_nseg--;
+            log_event(LOG_ERROR, "msglog_open_failed", "dir=\"%s\" segment=%ld", dir, bases[i]);
+            free(bases);
+            msglog_close();
+            return -1;
+        }
+        /* a compaction that stopped before removing the original: the
+           rewritten copy has the higher base and supersedes it */
+        if (g_nseg > 1 && g_segs[g_nseg - 2].last_id >= s->base) {
+            segment copy = *s;
+            seg_remove(&g_segs[g_nseg - 2]);
+            g_segs[g_nseg - 2] = copy;
+            g_nseg--;
+        }
+    }
+    free(bases);
+    int created = g_nseg == 0;
+    if (created) {
+        segment *s = seg_push();
+        if (!s || seg_create(s, 1) < 0) {
+            if (s) g_nseg--;
+            msglog_close();
+            return -1;
+        }
+    }
+    maintain((long)time(NULL));
+    return created;
+}
+
+void msglog_close(void) {
+    /* lets queued seals and a running compaction finish first */
+    if (g_maint_running) {
+        pthread_mutex_lock(&g_maint_mu);
+        g_maint_stop = 1;
+        pthread_cond_signal(&g_maint_cv);
+        pthread_mutex_unlock(&g_maint_mu);
+        pthread_join(g_maint_thread, NULL);
+        g_maint_running = 0;
+    }
+    maint_collect();
+    for (size_t i = 0; i < g_nseg; i++) {
+        segment *s = &g_segs[i];
+        if (s->fd >= 0) msync(s->map, s->used, MS_SYNC);
+        seg_unmap(s);
+    }
+    free(g_segs);
+    g_segs = NULL;
+    g_nseg = g_segcap = 0;
+}
+
+long msglog_last_id(void) {
+    return g_nseg ? g_segs[g_nseg - 1].last_id : 0;
+}
+
+int msglog_append(long id, int user_id, const char *username, const char *content, long ts) {
+    if (!g_nseg) return -1;
+    maint_collect();
+    segment *s = &g_segs[g_nseg - 1];
+    if (id <= s->last_id) return -1;
+    size_t ulen = strlen(username), clen = strlen(content);
+    size_t len = rec_len(ulen, clen);
+    if (len > g_seg_bytes - SEG_HDR) return -1;
+    if (s->used + len > s->size) {
+        /* the next segment first, so a failure leaves this one active */
+        segment *next = seg_push();
+        if (!next) return -1;
+        if (seg_create(next, id) < 0) { g_nseg--; return -1; }
+        s = next - 1;
+        if (seg_seal(s) < 0) {
+            seg_remove(next);
+            g_nseg--;
+            return -1;
+        }
+        s = next;
+        g_next_maint = 0;   /* a sealed segment may now be due for retention */
+    }
+    unsigned char *p = s->map + s->used;
+    rec_hdr h = { (uint32_t)len, 0, id, ts, user_id, (uint32_t)ulen, (uint32_t)clen, 0 };
+    memcpy(p + sizeof(h), username, ulen + 1);
+    memcpy(p + sizeof(h) + ulen + 1, content, clen + 1);
+    memset(p + sizeof(h) + ulen + clen + 2, 0, len - sizeof(h) - ulen - clen - 2);
+    memcpy(p, &h, sizeof(h));
+    ((rec_hdr*)p)->crc = crc32_of(p + 8, len - 8);
+    if (note_record(s, rec(s, s->used), s->used) < 0) {
+        memset(p, 0, len);   /* not in the index, so not in the log */
+        return -1;
+    }
+    if (ts >= g_next_maint) maintain(ts);
+    return 0;
+}
+
+/* last segment whose base is <= id, or 0 */
+static size_t seg_find(long id) {
+    size_t lo = 0, hi = g_nseg;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (g_segs[mid].base <= id) lo = mid; else hi = mid;
+    }
+    return lo;
+}
+
+/* last index entry whose id is <= id, or 0 */
+static size_t idx_find(const segment *s, long id) {
+    size_t lo = 0, hi = s->nidx;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (s->idx[mid].id <= id) lo = mid; else hi = mid;
+    }
+    return lo;
+}
+
+static void emit(const rec_hdr *h, db_message_cb callback, void *userdata) {
+    const char *username = (const char*)(h + 1);
+    if (callback) callback((long)h->id, username, username + h->ulen + 1, (long)h->ts, userdata);
+}
+
+static int read_forward(long after_id, int limit, db_message_cb callback, void *userdata) {
+    int n = 0;
+    for (size_t i = seg_find(after_id + 1); i < g_nseg && n < limit; i++) {
+        const segment *s = &g_segs[i];
+        if (!s->nrec || s->last_id <= after_id) continue;
+        size_t off = s->idx[idx_find(s, after_id + 1)].off;
+        for (; off < s->used && n < limit; off += rec(s, off)->len) {
+            if (rec(s, off)->id <= after_id) continue;
+            emit(rec(s, off), callback, userdata);
+            n++;
+        }
+    }
+    return n;
+}
+
+/* walks index blocks from the newest down; records inside a block are
+   only linked forwards, so each block is collected, then emitted reversed */
+static int read_backward(long before_id, int limit, db_message_cb callback, void *userdata) {
+    int n = 0;
+    for (size_t i = seg_find(before_id - 1) + 1; i-- > 0 && n < limit; ) {
+        const segment *s = &g_segs[i];
+        if (!s->nrec) continue;
+        for (size_t k = idx_find(s, before_id - 1) + 1; k-- > 0 && n < limit; ) {
+            size_t end = k + 1 < s->nidx ? s->idx[k + 1].off : s->used;
+            uint32_t offs[INDEX_EVERY];
+            size_t m = 0;
+            for (size_t off = s->idx[k].off; off < end && rec(s, off)->id < before_id; off += rec(s, off)->len)
+                offs[m++] = (uint32_t)off;
+            while (m > 0 && n < limit) {
+                emit(rec(s, offs[--m]), callback, userdata);
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+int msglog_read(long before_id, long after_id, int limit, db_message_cb callback, void *userdata) {
+    if (!g_nseg || limit < 1) return 0;
+    if (before_id > 0) return read_backward(before_id, limit, callback, userdata);
+    if (after_id > 0) return read_forward(after_id, limit, callback, userdata);
+    return read_backward(LONG_MAX, limit, callback, userdata);
+}
+
+int msglog_read_from(long first_id, int limit, db_message_cb callback, void *userdata) {
+    if (!g_nseg || limit < 1) return 0;
+    return read_forward(first_id > 0 ? first_id - 1 : 0, limit, callback, userdata);
+}
+
+/* segments are skipped by their time bounds, then the first one that
+   reaches ts is scanned */
+long msglog_first_id_at(long ts) {
+    for (size_t i = 0; i < g_nseg; i++) {
+        const segment *s = &g_segs[i];
+        if (!s->nrec || s->last_ts < ts) continue;
+        for (size_t off = SEG_HDR; off < s->used; off += rec(s, off)->len)
+            if (rec(s, off)->ts >= ts) return (long)rec(s, off)->id;
+    }
+    return 0;
+}
@@ -0,0 +1,41 @@
+#include "overload.h"
+#include "log.h"
+#include "metrics.h"
+
+static uint64_t g_limit_ns = (uint64_t)OVERLOAD_LAG_MS_DEFAULT * 1000000;
+static uint64_t g_avg_ns = 0;        /* moving average of turn times, 1/8 weight per turn */
+static int g_active = 0;
+static uint64_t g_since = 0;         /* when the current state began */
+
+void overload_configure(unsigned lag_ms) {
+    g_limit_ns = (uint64_t)lag_ms * 1000000;
+}
+
+int overload_update(uint64_t now, uint64_t turn_ns, double queue_fill) {
+    if (!g_limit_ns) return 0;
+    g_avg_ns = g_avg_ns - g_avg_ns / 8 + turn_ns / 8;
+    if (!g_active) {
+        if (g_avg_ns < g_limit_ns && queue_fill < OVERLOAD_QUEUE_HIGH) return 0;
+        g_active = 1;
+        g_since = now;
+        metrics_add(CTR_OVERLOADED, 1);
+        log_event(LOG_WARN, "overload_start", "lag_us=%llu queue_fill=%.2f",
+                  (unsigned long long)(g_avg_ns / 1000), queue_fill);
+        return 1;
+    }
+    if (now - g_since < (uint64_t)OVERLOAD_HOLD_MS * 1000000 ||
+        g_avg_ns >= g_limit_ns / 2 || queue_fill >= OVERLOAD_QUEUE_HIGH / 2)
+        return 1;
+    g_active = 0;
+    metrics_add(CTR_OVERLOADED, -1);
+    log_event(LOG_INFO, "overload_end", "duration_ms=%llu", (unsigned long long)((now - g_since) / 1000000));
+    return 0;
+}
+
+int overload_active(void) {
+    return g_active;
+}
+
+int overload_admit(uint64_t turn_ns) {
+    return !g_active || turn_ns < g_limit_ns / 2;
+}
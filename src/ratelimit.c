@@ -0,0 +1,103 @@
+#include "ratelimit.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define PROBE_WINDOW 8
+
+/* 16 bytes per bucket: keys are stored only as 64-bit hashes */
+typedef struct {
+    uint64_t key;       /* 0 = empty */
+    float tokens;
+    uint32_t last_ms;   /* monotonic ms of the last refill (wraps after ~49 days) */
+} Bucket;
+
+struct ratelimit {
+    Bucket *buckets;
+    size_t mask;
+    double rate_ms;     /* tokens per millisecond */
+    float burst;
+};
+
+static uint32_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u);
+}
+
+/* FNV-1a, never 0 so 0 can mark empty buckets */
+static uint64_t hash_key(const char *s) {
+    uint64_t h = 1469598103934665603ULL;
+    for (; *s; ++s) { h ^= (unsigned char)*s; h *= 1099511628211ULL; }
+    return h ? h : 1;
+}
+
+ratelimit *ratelimit_create(size_t capacity, double rate_per_sec, double burst) {
+    size_t cap = 64;
+    while (cap < capacity) cap <<= 1;
+    ratelimit *rl = (ratelimit*)calloc(1, sizeof(*rl));
+    if (!rl) return NULL;
+    rl->buckets = (Bucket*)calloc(cap, sizeof(Bucket));
+    if (!rl->buckets) { free(rl); return NULL; }
+    rl->mask = cap - 1;
+    rl->rate_ms = rate_per_sec / 1000.0;
+    rl->burst = (float)burst;
+    return rl;
+}
+
+void ratelimit_destroy(ratelimit *rl) {
+    if (!rl) return;
+    free(rl->buckets);
+    free(rl);
+}
+
+static float refilled(const ratelimit *rl, const Bucket *b, uint32_t now) {
+    double t = b->tokens + (double)(uint32_t)(now - b->last_ms) * rl->rate_ms;
+    return t > rl->burst ? rl->burst : (float)t;
+}
+
+static int wait_secs(const ratelimit *rl, float tokens) {
+    double wait_ms = (1.0 - tokens) / rl->rate_ms;
+    int secs = (int)((wait_ms + 999.0) / 1000.0);
+    return secs > 0 ? secs : 1;
+}
+
+int ratelimit_peek(ratelimit *rl, const char *key) {
+    uint64_t h = hash_key(key);
+    for (size_t n = 0, i = (size_t)h & rl->mask; n < PROBE_WINDOW; n++, i = (i + 1) & rl->mask) {
+        const Bucket *c = &rl->buckets[i];
+        if (c->key != h) continue;
+        float t = refilled(rl, c, now_ms());
+        return t >= 1.0f ? 0 : wait_secs(rl, t);
+    }
+    return 0;   /* no bucket yet: it would start full */
+}
+
+int ratelimit_take(ratelimit *rl, const char *key) {
+    uint64_t h = hash_key(key);
+    uint32_t now = now_ms();
+    Bucket *victim = NULL;
+    float victim_tokens = -1.0f;
+    Bucket *b = NULL;
+    for (size_t n = 0, i = (size_t)h & rl->mask; n < PROBE_WINDOW; n++, i = (i + 1) & rl->mask) {
+        Bucket *c = &rl->buckets[i];
+        if (c->key == h) { b = c; break; }
+        /* prefer an empty slot; otherwise a full bucket carries no state,
+           so the fullest one is the cheapest to recycle */
+        float t = c->key == 0 ? rl->burst + 1.0f : refilled(rl, c, now);
+        if (!victim || t > victim_tokens) { victim = c; victim_tokens = t; }
+    }
+    if (!b) {
+        b = victim;
+        b->key = h;
+        b->tokens = rl->burst;
+        b->last_ms = now;
+    }
+    b->tokens = refilled(rl, b, now);
+    b->last_ms = now;
+    if (b->tokens >= 1.0f) {
+        b->tokens -= 1.0f;
+        return 0;
+    }
+    return wait_secs(rl, b->tokens);
+}
@@ -0,0 +1,284 @@
+#include "relay.h"
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "metrics.h"
+#include "util.h"
+
+#define SEEN_MAX 64   /* origins remembered for duplicate suppression */
+
+enum { RELAY_DOWN, RELAY_CONNECTING, RELAY_UP };
+
+static char g_addr[256];
+static struct sockaddr_storage g_sa;
+static socklen_t g_salen = 0;
+static int g_fd = -1;
+static int g_state = RELAY_DOWN;
+static int g_was_up = 0;        /* log the first failure after start or a loss, not every retry */
+static time_t g_retry_at = 0;
+static uint64_t g_gaps = 0;     /* see relay_gaps() */
+
+static uint64_t g_origin, g_seq;
+static struct { uint64_t origin, seq; } g_seen[SEEN_MAX];
+static int g_nseen = 0, g_seen_next = 0;
+
+static unsigned char *g_in = NULL;   /* RELAY_FRAME_MAX + 1 for a NUL after the content */
+static size_t g_in_len = 0;
+static unsigned char *g_out = NULL;
+static size_t g_out_len = 0, g_out_off = 0;
+
+static void put_le(unsigned char *p, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint64_t get_le(const unsigned char *p, int bytes) {
+    uint64_t v = 0;
+    for (int i = bytes - 1; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+/* unix:/path, or host:port */
+static int parse_addr(const char *addr) {
+    memset(&g_sa, 0, sizeof(g_sa));
+    if (strncmp(addr, "unix:", 5) == 0) {
+        struct sockaddr_un *un = (struct sockaddr_un*)&g_sa;
+        if (!addr[5] || strlen(addr + 5) >= sizeof(un->sun_path)) return -1;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, addr + 5);
+        g_salen = (socklen_t)sizeof(*un);
+        return 0;
+    }
+    char host[200];
+    const char *colon = strrchr(addr, ':');
+    if (!colon || colon == addr || (size_t)(colon - addr) >= sizeof(host) || !colon[1]) return -1;
+    memcpy(host, addr, (size_t)(colon - addr));
+    host[colon - addr] = '\0';
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0 || !res) return -1;
+    memcpy(&g_sa, res->ai_addr, res->ai_addrlen);
+    g_salen = (socklen_t)res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+/* FNV-1a over host name, pid and clock: distinct per process and restart */
+static uint64_t make_origin(void) {
+    char host[64] = {0};
+    gethostname(host, sizeof(host) - 1);
+    uint64_t h = 1469598103934665603ULL;
+    for (const char *s = host; *s; ++s) { h ^= (unsigned char)*s; h *= 1099511628211ULL; }
+    uint64_t mix[2] = { (uint64_t)getpid(), now_ns() };
+    const unsigned char *b = (const unsigned char*)mix;
+    for (size_t i = 0; i < sizeof(mix); i++) { h ^= b[i]; h *= 1099511628211ULL; }
+    return h ? h : 1;
+}
+
+int relay_open(const char *addr) {
+    if (!addr || strlen(addr) >= sizeof(g_addr) || parse_addr(addr) < 0) return -1;
+    g_in = (unsigned char*)malloc(RELAY_FRAME_MAX + 1);
+    g_out = (unsigned char*)malloc(RELAY_OUT_MAX);
+    if (!g_in || !g_out) { relay_close(); return -1; }
+    snprintf(g_addr, sizeof(g_addr), "%s", addr);
+    g_origin = make_origin();
+    g_seq = 0;
+    g_retry_at = 0;
+    g_was_up = 1;
+    g_gaps = 1;   /* nothing has arrived from the others yet */
+    return 0;
+}
+
+static void drop_connection(const char *why) {
+    if (g_fd >= 0) close(g_fd);
+    g_fd = -1;
+    /* queued messages go with the connection, a partly sent one too */
+    size_t lost = 0;
+    for (size_t off = 0; off < g_out_len; off += 4 + (size_t)get_le(g_out + off, 4))
+        if (off + 4 + (size_t)get_le(g_out + off, 4) > g_out_off) lost++;
+    if (lost) metrics_add(CTR_RELAY_DROPPED, (int64_t)lost);
+    if (g_was_up)
+        log_event(LOG_WARN, "relay_down", "addr=%s reason=%s unsent=%zu", g_addr, why, lost);
+    g_was_up = 0;
+    g_state = RELAY_DOWN;
+    g_in_len = g_out_len = g_out_off = 0;
+    g_gaps++;
+    g_retry_at = time(NULL) + RELAY_RETRY_SEC;
+}
+
+void relay_close(void) {
+    if (g_fd >= 0) close(g_fd);
+    g_fd = -1;
+    g_state = RELAY_DOWN;
+    free(g_in); free(g_out);
+    g_in = g_out = NULL;
+    g_in_len = g_out_len = g_out_off = 0;
+}
+
+static void connected(void) {
+    g_state = RELAY_UP;
+    g_was_up = 1;
+    g_gaps++;   /* whatever the others sent while the link was down is missing */
+    log_event(LOG_INFO, "relay_up", "addr=%s origin=%016llx", g_addr, (unsigned long long)g_origin);
+}
+
+int relay_prepare(int *want_write) {
+    *want_write = 0;
+    if (!g_in) return -1;
+    if (g_state == RELAY_DOWN) {
+        if (time(NULL) < g_retry_at) return -1;
+        g_fd = socket(g_sa.ss_family, SOCK_STREAM, 0);
+        if (g_fd < 0 || g_fd >= FD_SETSIZE) { drop_connection("socket"); return -1; }
+        set_nonblock(g_fd);
+#ifdef SO_NOSIGPIPE
+        int one = 1;
+        setsockopt(g_fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+        if (connect(g_fd, (struct sockaddr*)&g_sa, g_salen) == 0) connected();
+        else if (errno == EINPROGRESS) g_state = RELAY_CONNECTING;
+        else { drop_connection("connect"); return -1; }
+    }
+    *want_write = g_state == RELAY_CONNECTING || g_out_off < g_out_len;
+    return g_fd;
+}
+
+static void flush_out(void) {
+    while (g_out_off < g_out_len) {
+        ssize_t w = send(g_fd, g_out + g_out_off, g_out_len - g_out_off, 0);
+        if (w < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR) continue;
+            drop_connection("send");
+            return;
+        }
+        g_out_off += (size_t)w;
+    }
+    g_out_len = g_out_off = 0;
+}
+
+/* 1 if this origin/seq pair is new, recording it; a seq that skips some,
+   or an origin first seen past seq 1, counts as a gap */
+static int first_sight(uint64_t origin, uint64_t seq) {
+    for (int i = 0; i < g_nseen; i++) {
+        if (g_seen[i].origin != origin) continue;
+        if (seq <= g_seen[i].seq) return 0;
+        if (seq != g_seen[i].seq + 1) g_gaps++;
+        g_seen[i].seq = seq;
+        return 1;
+    }
+    /* a new origin takes the oldest slot once the table is full */
+    int i = g_nseen < SEEN_MAX ? g_nseen++ : g_seen_next++ % SEEN_MAX;
+    g_seen[i].origin = origin;
+    g_seen[i].seq = seq;
+    if (seq != 1) g_gaps++;
+    return 1;
+}
+
+/* f points at a whole frame of 4 + len bytes, with room for one more */
+static int handle_frame(unsigned char *f, size_t len, relay_cb cb, void *userdata) {
+    if (f[4] != RELAY_MSG) return 0;   /* unknown types are skipped */
+    uint64_t origin = get_le(f + 6, 8), seq = get_le(f + 14, 8);
+    size_t ulen = f[38], clen = (size_t)get_le(f + 39, 4);
+    if (RELAY_HDR - 4 + ulen + clen != len) return -1;
+    if (f[5] > RELAY_MAX_HOPS || origin == g_origin || !first_sight(origin, seq)) return 0;
+    char username[256];
+    memcpy(username, f + RELAY_HDR, ulen);
+    username[ulen] = '\0';
+    unsigned char *content = f + RELAY_HDR + ulen;
+    unsigned char saved = content[clen];
+    content[clen] = '\0';
+    metrics_add(CTR_RELAY_RECEIVED, 1);
+    cb((long)get_le(f + 22, 8), username, (const char*)content, (long)get_le(f + 30, 8), userdata);
+    content[clen] = saved;
+    return 0;
+}
+
+void relay_io(int readable, int writable, relay_cb cb, void *userdata) {
+    if (g_fd < 0) return;
+    if (g_state == RELAY_CONNECTING) {
+        if (!writable) return;
+        int err = 0;
+        socklen_t elen = sizeof(err);
+        if (getsockopt(g_fd, SOL_SOCKET, SO_ERROR, &err, &elen) < 0 || err != 0) {
+            drop_connection("connect");
+            return;
+        }
+        connected();
+    }
+    if (writable) flush_out();
+    if (!readable || g_fd < 0) return;
+    for (;;) {
+        ssize_t r = recv(g_fd, g_in + g_in_len, RELAY_FRAME_MAX - g_in_len, 0);
+        if (r == 0) { drop_connection("closed"); return; }
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) drop_connection("recv");
+            return;
+        }
+        g_in_len += (size_t)r;
+        size_t off = 0;
+        while (g_in_len - off >= 4) {
+            size_t len = (size_t)get_le(g_in + off, 4);
+            if (len < RELAY_HDR - 4 || len > RELAY_FRAME_MAX - 4) { drop_connection("bad_frame"); return; }
+            if (g_in_len - off < 4 + len) break;
+            if (handle_frame(g_in + off, len, cb, userdata) < 0) { drop_connection("bad_frame"); return; }
+            off += 4 + len;
+        }
+        memmove(g_in, g_in + off, g_in_len - off);
+        g_in_len -= off;
+    }
+}
+
+void relay_publish(long id, const char *username, const char *content, long ts) {
+    if (!g_out) return;
+    /* a dropped message still takes its seq, so the others see the gap */
+    uint64_t seq = ++g_seq;
+    size_t ulen = strlen(username), clen = strlen(content);
+    if (ulen > 255) ulen = 255;
+    size_t n = RELAY_HDR + ulen + clen;
+    /* only what is unsent counts against the limit: drop the frames already
+       sent, keeping a partly sent one whole so g_out still starts on a frame */
+    if (g_out_off && g_out_len + n > RELAY_OUT_MAX) {
+        size_t sent = 0;
+        while (sent + 4 + (size_t)get_le(g_out + sent, 4) <= g_out_off) sent += 4 + (size_t)get_le(g_out + sent, 4);
+        memmove(g_out, g_out + sent, g_out_len - sent);
+        g_out_len -= sent;
+        g_out_off -= sent;
+    }
+    if (g_state != RELAY_UP || n > RELAY_FRAME_MAX || g_out_len + n > RELAY_OUT_MAX) {
+        metrics_add(CTR_RELAY_DROPPED, 1);
+        return;
+    }
+    unsigned char *f = g_out + g_out_len;
+    put_le(f, n - 4, 4);
+    f[4] = RELAY_MSG;
+    f[5] = 0;
+    put_le(f + 6, g_origin, 8);
+    put_le(f + 14, seq, 8);
+    put_le(f + 22, (uint64_t)id, 8);
+    put_le(f + 30, (uint64_t)ts, 8);
+    f[38] = (unsigned char)ulen;
+    put_le(f + 39, clen, 4);
+    memcpy(f + RELAY_HDR, username, ulen);
+    memcpy(f + RELAY_HDR + ulen, content, clen);
+    g_out_len += n;
+    metrics_add(CTR_RELAY_SENT, 1);
+    flush_out();
+}
+
+int relay_up(void) {
+    return g_state == RELAY_UP;
+}
+
+uint64_t relay_gaps(void) {
+    return g_gaps;
+}
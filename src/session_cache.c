@@ -0,0 +1,163 @@
+#include "session_cache.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SID_MAX 64
+
+enum { SLOT_EMPTY = 0, SLOT_USED = 1, SLOT_DELETED = 2 };
+
+typedef struct {
+    unsigned char state;
+    char sid[SID_MAX];
+    int user_id;
+    long expires_at;
+} Slot;
+
+static Slot *g_slots = NULL;
+static size_t g_cap = 0;       /* power of two */
+static size_t g_used = 0;      /* SLOT_USED entries */
+static size_t g_tombs = 0;     /* SLOT_DELETED entries */
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* FNV-1a */
+static uint64_t hash_sid(const char *s) {
+    uint64_t h = 1469598103934665603ULL;
+    for (; *s; ++s) { h ^= (unsigned char)*s; h *= 1099511628211ULL; }
+    return h;
+}
+
+int session_cache_init(size_t capacity) {
+    size_t cap = 64;
+    while (cap < capacity * 2) cap <<= 1;   /* keep load factor <= 0.5 */
+    Slot *slots = (Slot*)calloc(cap, sizeof(Slot));
+    if (!slots) return -1;
+    pthread_mutex_lock(&g_lock);
+    free(g_slots);
+    g_slots = slots;
+    g_cap = cap;
+    g_used = g_tombs = 0;
+    pthread_mutex_unlock(&g_lock);
+    return 0;
+}
+
+void session_cache_free(void) {
+    pthread_mutex_lock(&g_lock);
+    free(g_slots);
+    g_slots = NULL;
+    g_cap = g_used = g_tombs = 0;
+    pthread_mutex_unlock(&g_lock);
+}
+
+/* caller holds g_lock; returns slot index or -1 */
+static long find_slot(const char *sid) {
+    size_t mask = g_cap - 1;
+    size_t i = (size_t)hash_sid(sid) & mask;
+    for (size_t n = 0; n < g_cap; n++, i = (i + 1) & mask) {
+        Slot *s = &g_slots[i];
+        if (s->state == SLOT_EMPTY) return -1;
+        if (s->state == SLOT_USED && strcmp(s->sid, sid) == 0) return (long)i;
+    }
+    return -1;
+}
+
+static void drop_slot(size_t i) {
+    g_slots[i].state = SLOT_DELETED;
+    g_used--;
+    g_tombs++;
+}
+
+/* caller holds g_lock; rehash in place to clear tombstones */
+static void rebuild(void) {
+    Slot *old = g_slots;
+    Slot *fresh = (Slot*)calloc(g_cap, sizeof(Slot));
+    if (!fresh) return;
+    size_t mask = g_cap - 1;
+    for (size_t k = 0; k < g_cap; k++) {
+        if (old[k].state != SLOT_USED) continue;
+        size_t i = (size_t)hash_sid(old[k].sid) & mask;
+        while (fresh[i].state == SLOT_USED) i = (i + 1) & mask;
+        fresh[i] = old[k];
+    }
+    g_slots = fresh;
+    g_tombs = 0;
+    free(old);
+}
+
+void session_cache_put(const char *sid, int user_id, long expires_at) {
+    if (!sid || strlen(sid) >= SID_MAX) return;
+    pthread_mutex_lock(&g_lock);
+    if (!g_slots) { pthread_mutex_unlock(&g_lock); return; }
+    long at = find_slot(sid);
+    if (at >= 0) {
+        g_slots[at].user_id = user_id;
+        g_slots[at].expires_at = expires_at;
+        pthread_mutex_unlock(&g_lock);
+        return;
+    }
+    if ((g_used + g_tombs + 1) * 4 > g_cap * 3) {
+        /* over 75%: reclaim expired entries and tombstones first */
+        long now = (long)time(NULL);
+        for (size_t k = 0; k < g_cap; k++)
+            if (g_slots[k].state == SLOT_USED && g_slots[k].expires_at < now) drop_slot(k);
+        rebuild();
+        if ((g_used + 1) * 4 > g_cap * 3) { pthread_mutex_unlock(&g_lock); return; }
+    }
+    size_t mask = g_cap - 1;
+    size_t i = (size_t)hash_sid(sid) & mask;
+    while (g_slots[i].state == SLOT_USED) i = (i + 1) & mask;
+    if (g_slots[i].state == SLOT_DELETED) g_tombs--;
+    Slot *s = &g_slots[i];
+    s->state = SLOT_USED;
+    strcpy(s->sid, sid);
+    s->user_id = user_id;
+    s->expires_at = expires_at;
+    g_used++;
+    pthread_mutex_unlock(&g_lock);
+}
+
+int session_cache_get(const char *sid, int *user_id) {
+    if (!sid) return 0;
+    int out = 0;
+    pthread_mutex_lock(&g_lock);
+    if (g_slots) {
+        long at = find_slot(sid);
+        if (at >= 0) {
+            if (g_slots[at].expires_at < (long)time(NULL)) {
+                drop_slot((size_t)at);
+                out = -1;
+            } else {
+                *user_id = g_slots[at].user_id;
+                out = 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&g_lock);
+    return out;
+}
+
+void session_cache_remove(const char *sid) {
+    if (!sid) return;
+    pthread_mutex_lock(&g_lock);
+    if (g_slots) {
+        long at = find_slot(sid);
+        if (at >= 0) drop_slot((size_t)at);
+    }
+    pthread_mutex_unlock(&g_lock);
+}
+
+size_t session_cache_evict_expired(long now) {
+    size_t n = 0;
+    pthread_mutex_lock(&g_lock);
+    for (size_t k = 0; k < g_cap; k++) {
+        if (g_slots[k].state == SLOT_USED && g_slots[k].expires_at < now) {
+            drop_slot(k);
+            n++;
+        }
+    }
+    if (g_tombs * 4 > g_cap) rebuild();
+    pthread_mutex_unlock(&g_lock);
+    return n;
+}
@@ -0,0 +1,114 @@
+#include "strbuf.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void sb_init(strbuf *sb, size_t initial_cap) {
+    memset(sb, 0, sizeof(*sb));
+    if (initial_cap < 64) initial_cap = 64;
+    sb->data = (char*)malloc(initial_cap);
+    if (!sb->data) { sb->failed = 1; return; }
+    sb->cap = initial_cap;
+    sb->owned = 1;
+}
+
+void sb_init_buf(strbuf *sb, char *buf, size_t cap) {
+    memset(sb, 0, sizeof(*sb));
+    sb->data = buf;
+    sb->cap = buf ? cap : 0;
+}
+
+void sb_init_stream(strbuf *sb, char *buf, size_t cap, sb_flush_fn flush, void *ctx) {
+    memset(sb, 0, sizeof(*sb));
+    sb->data = buf;
+    sb->cap = cap;
+    sb->flush = flush;
+    sb->flush_ctx = ctx;
+}
+
+void sb_free(strbuf *sb) {
+    if (sb->owned) free(sb->data);
+    memset(sb, 0, sizeof(*sb));
+}
+
+void sb_reset(strbuf *sb) {
+    sb->len = 0;
+    sb->failed = 0;
+}
+
+int sb_flush(strbuf *sb) {
+    if (!sb->flush || sb->failed) return sb->failed ? -1 : 0;
+    if (sb->len && sb->flush(sb->flush_ctx, sb->data, sb->len) < 0) sb->failed = 1;
+    sb->len = 0;
+    return sb->failed ? -1 : 0;
+}
+
+int sb_reserve(strbuf *sb, size_t n) {
+    if (sb->failed) return -1;
+    if (sb->cap - sb->len >= n) return 0;
+    if (sb->flush) {
+        if (sb_flush(sb) < 0) return -1;
+        if (sb->cap >= n) return 0;
+        sb->failed = 1;   /* a single reservation larger than the stream buffer */
+        return -1;
+    }
+    size_t cap = sb->cap ? sb->cap : 64;
+    while (cap - sb->len < n) {
+        if (cap > ((size_t)-1) / 2) { sb->failed = 1; return -1; }
+        cap *= 2;
+    }
+    char *p;
+    if (sb->owned) {
+        p = (char*)realloc(sb->data, cap);
+    } else {
+        /* borrowed buffer: copy out to the heap */
+        p = (char*)malloc(cap);
+        if (p && sb->len) memcpy(p, sb->data, sb->len);
+    }
+    if (!p) { sb->failed = 1; return -1; }
+    sb->owned = 1;
+    sb->data = p;
+    sb->cap = cap;
+    return 0;
+}
+
+void sb_append(strbuf *sb, const char *s, size_t n) {
+    if (sb->flush && n > sb->cap - sb->len) {
+        /* stream mode: fill what fits, flush, and pass oversized chunks straight through */
+        if (sb_flush(sb) < 0) return;
+        if (n >= sb->cap) {
+            if (sb->flush(sb->flush_ctx, s, n) < 0) sb->failed = 1;
+            return;
+        }
+    }
+    if (sb_reserve(sb, n) < 0) return;
+    memcpy(sb->data + sb->len, s, n);
+    sb->len += n;
+}
+
+void sb_puts(strbuf *sb, const char *s) {
+    sb_append(sb, s, strlen(s));
+}
+
+void sb_putc(strbuf *sb, char c) {
+    if (sb_reserve(sb, 1) < 0) return;
+    sb->data[sb->len++] = c;
+}
+
+void sb_printf(strbuf *sb, const char *fmt, ...) {
+    char small[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(small, sizeof(small), fmt, ap);
+    va_end(ap);
+    if (n < 0) { sb->failed = 1; return; }
+    if ((size_t)n < sizeof(small)) { sb_append(sb, small, (size_t)n); return; }
+    char *big = (char*)malloc((size_t)n + 1);
+    if (!big) { sb->failed = 1; return; }
+    va_start(ap, fmt);
+    vsnprintf(big, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    sb_append(sb, big, (size_t)n);
+    free(big);
+}
@@ -0,0 +1,233 @@
+#include "token.h"
+#include "base64.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__APPLE__)
+#include <CommonCrypto/CommonHMAC.h>
+#include <CommonCrypto/CommonRandom.h>
+#else
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#endif
+
+#define MAC_LEN 32
+#define MAC_B64_LEN 43   /* base64url without padding */
+
+typedef struct {
+    char kid[9];
+    unsigned char key[64];
+    size_t key_len;
+} Key;
+
+static Key g_keys[TOKEN_MAX_KEYS];
+static int g_nkeys = 0;
+
+/* revocation list: open addressing on the token's mac, grows when 3/4 full */
+typedef struct {
+    char mac[MAC_B64_LEN + 1];
+    long expires_at;       /* 0 = empty slot */
+} Revoked;
+
+static Revoked *g_revoked = NULL;
+static size_t g_rcap = 0;
+static size_t g_rused = 0;
+static pthread_mutex_t g_rlock = PTHREAD_MUTEX_INITIALIZER;
+
+static int hexval(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return 10 + (c - 'a');
+    if (c >= 'A' && c <= 'F') return 10 + (c - 'A');
+    return -1;
+}
+
+static int valid_kid(const char *kid, size_t len) {
+    if (len == 0 || len >= sizeof(g_keys[0].kid)) return 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = kid[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))) return 0;
+    }
+    return 1;
+}
+
+int token_load_keys(const char *spec) {
+    if (!spec) return -1;
+    const char *p = spec;
+    while (*p && g_nkeys < TOKEN_MAX_KEYS) {
+        const char *colon = strchr(p, ':');
+        if (!colon) return -1;
+        const char *end = strchr(colon + 1, ',');
+        if (!end) end = colon + 1 + strlen(colon + 1);
+        size_t kid_len = (size_t)(colon - p);
+        size_t hex_len = (size_t)(end - colon - 1);
+        if (!valid_kid(p, kid_len) || hex_len < 32 || hex_len % 2 || hex_len / 2 > sizeof(g_keys[0].key)) return -1;
+        Key *k = &g_keys[g_nkeys];
+        memcpy(k->kid, p, kid_len);
+        k->kid[kid_len] = '\0';
+        for (size_t i = 0; i < hex_len / 2; i++) {
+            int hi = hexval(colon[1 + 2*i]), lo = hexval(colon[2 + 2*i]);
+            if (hi < 0 || lo < 0) return -1;
+            k->key[i] = (unsigned char)((hi << 4) | lo);
+        }
+        k->key_len = hex_len / 2;
+        g_nkeys++;
+        p = *end ? end + 1 : end;
+    }
+    return g_nkeys;
+}
+
+int token_generate_key(void) {
+    if (g_nkeys >= TOKEN_MAX_KEYS) return -1;
+    Key *k = &g_keys[g_nkeys];
+#if defined(__APPLE__)
+    if (CCRandomGenerateBytes(k->key, 32) != kCCSuccess) return -1;
+#else
+    if (RAND_bytes(k->key, 32) != 1) return -1;
+#endif
+    k->key_len = 32;
+    snprintf(k->kid, sizeof(k->kid), "r%d", g_nkeys);
+    g_nkeys++;
+    return 0;
+}
+
+static const Key *find_key(const char *kid, size_t len) {
+    for (int i = 0; i < g_nkeys; i++)
+        if (strlen(g_keys[i].kid) == len && memcmp(g_keys[i].kid, kid, len) == 0) return &g_keys[i];
+    return NULL;
+}
+
+/* base64url(HMAC-SHA256(key, msg)) into out[MAC_B64_LEN + 1] */
+static void sign(const Key *k, const char *msg, size_t len, char *out) {
+    unsigned char mac[MAC_LEN];
+#if defined(__APPLE__)
+    CCHmac(kCCHmacAlgSHA256, k->key, k->key_len, msg, len, mac);
+#else
+    unsigned int mlen = 0;
+    HMAC(EVP_sha256(), k->key, (int)k->key_len, (const unsigned char*)msg, len, mac, &mlen);
+#endif
+    size_t n = base64_encode_ex(mac, sizeof(mac), out, BASE64_URL | BASE64_NOPAD);
+    out[n] = '\0';
+}
+
+int token_issue(int user_id, const char *username, long expires_at, char *out, size_t out_sz) {
+    if (g_nkeys == 0 || !username) return -1;
+    const Key *k = &g_keys[0];
+    int n = snprintf(out, out_sz, "1.%s.%d.%ld.%s", k->kid, user_id, expires_at, username);
+    if (n < 0 || (size_t)n + 1 + MAC_B64_LEN + 1 > out_sz) return -1;
+    out[n] = '.';
+    sign(k, out, (size_t)n, out + n + 1);
+    return 0;
+}
+
+static uint64_t hash_mac(const char *mac) {
+    uint64_t h = 1469598103934665603ULL;
+    for (; *mac; ++mac) { h ^= (unsigned char)*mac; h *= 1099511628211ULL; }
+    return h;
+}
+
+/* caller holds g_rlock */
+static int revoked_locked(const char *mac, long now) {
+    if (!g_revoked) return 0;
+    size_t mask = g_rcap - 1;
+    for (size_t i = (size_t)hash_mac(mac) & mask, n = 0; n < g_rcap; n++, i = (i + 1) & mask) {
+        if (g_revoked[i].expires_at == 0) return 0;
+        if (strcmp(g_revoked[i].mac, mac) == 0) return g_revoked[i].expires_at >= now;
+    }
+    return 0;
+}
+
+/* caller holds g_rlock; rebuilds the table into new_cap slots, dropping expired entries */
+static int rehash_locked(size_t new_cap, long now) {
+    Revoked *fresh = (Revoked*)calloc(new_cap, sizeof(Revoked));
+    if (!fresh) return -1;
+    size_t used = 0;
+    for (size_t k = 0; k < g_rcap; k++) {
+        if (g_revoked[k].expires_at < now) continue;   /* also skips empty slots */
+        size_t i = (size_t)hash_mac(g_revoked[k].mac) & (new_cap - 1);
+        while (fresh[i].expires_at != 0) i = (i + 1) & (new_cap - 1);
+        fresh[i] = g_revoked[k];
+        used++;
+    }
+    free(g_revoked);
+    g_revoked = fresh;
+    g_rcap = new_cap;
+    g_rused = used;
+    return 0;
+}
+
+int token_revoke(const char *token) {
+    int uid;
+    if (!token_verify(token, &uid, NULL, 0)) return 0;   /* forged, expired or already revoked */
+    const char *mac = strrchr(token, '.') + 1;
+    /* the expiry is the 4th field: 1.kid.uid.exp.user.mac */
+    const char *p = token;
+    for (int f = 0; f < 3; f++) p = strchr(p, '.') + 1;
+    long exp = strtol(p, NULL, 10);
+    long now = (long)time(NULL);
+    if (exp > now + TOKEN_TTL_SEC) exp = now + TOKEN_TTL_SEC;
+
+    pthread_mutex_lock(&g_rlock);
+    if (!g_revoked || (g_rused + 1) * 4 > g_rcap * 3) {
+        size_t cap = g_rcap ? g_rcap : 256;
+        if (g_revoked) rehash_locked(cap, now);   /* first try reclaiming expired entries */
+        if (!g_revoked || (g_rused + 1) * 4 > g_rcap * 3) {
+            size_t grow = g_revoked ? g_rcap * 2 : cap;
+            if (grow > TOKEN_REVOKED_MAX || rehash_locked(grow, now) < 0) { pthread_mutex_unlock(&g_rlock); return -1; }
+        }
+    }
+    size_t i = (size_t)hash_mac(mac) & (g_rcap - 1);
+    while (g_revoked[i].expires_at != 0 && strcmp(g_revoked[i].mac, mac) != 0) i = (i + 1) & (g_rcap - 1);
+    if (g_revoked[i].expires_at == 0) g_rused++;
+    snprintf(g_revoked[i].mac, sizeof(g_revoked[i].mac), "%s", mac);
+    g_revoked[i].expires_at = exp;
+    pthread_mutex_unlock(&g_rlock);
+    return 0;
+}
+
+int token_verify(const char *token, int *user_id, char *uname, size_t uname_sz) {
+    if (!token || strncmp(token, "1.", 2) != 0) return 0;
+    size_t len = strlen(token);
+    if (len >= TOKEN_MAX_LEN) return 0;
+    const char *mac = strrchr(token, '.');
+    if (!mac || strlen(mac + 1) != MAC_B64_LEN) return 0;
+
+    const char *kid = token + 2;
+    const char *dot = strchr(kid, '.');
+    if (!dot) return 0;
+    const Key *k = find_key(kid, (size_t)(dot - kid));
+    if (!k) return 0;
+
+    char expect[MAC_B64_LEN + 1];
+    sign(k, token, (size_t)(mac - token), expect);
+    unsigned char diff = 0;
+    for (size_t i = 0; i < MAC_B64_LEN; i++) diff |= (unsigned char)(expect[i] ^ mac[1 + i]);
+    if (diff != 0) return 0;
+
+    /* signature is good, so the fields are ours and well-formed */
+    char *end = NULL;
+    long uid = strtol(dot + 1, &end, 10);
+    if (!end || *end != '.') return 0;
+    long exp = strtol(end + 1, &end, 10);
+    if (!end || *end != '.') return 0;
+    const char *user = end + 1;
+    long now = (long)time(NULL);
+    if (exp < now) return 0;
+
+    pthread_mutex_lock(&g_rlock);
+    int revoked = revoked_locked(mac + 1, now);
+    pthread_mutex_unlock(&g_rlock);
+    if (revoked) return 0;
+
+    *user_id = (int)uid;
+    if (uname && uname_sz) {
+        size_t ulen = (size_t)(mac - user);
+        if (ulen >= uname_sz) ulen = uname_sz - 1;
+        memcpy(uname, user, ulen);
+        uname[ulen] = '\0';
+    }
+    return 1;
+}
@@ -0,0 +1,38 @@
+#include "trace.h"
+#include "log.h"
+#include <stdio.h>
+
+static const char *phase_names[PH_COUNT] = {
+    "read", "parse", "auth", "db", "queue", "hash", "build", "send",
+    "decode", "persist", "fanout",
+};
+
+static uint64_t g_slow_ns = 250ULL * 1000000ULL;
+static unsigned g_sample_every = 0;
+static unsigned g_sample_count = 0;   /* event loop only */
+
+void trace_configure(uint64_t slow_ms, unsigned sample_every) {
+    g_slow_ns = slow_ms * 1000000ULL;
+    g_sample_every = sample_every;
+}
+
+void trace_end(trace *t, const char *method, const char *path, int status) {
+    uint64_t total = t->mark - t->start;   /* up to the last charged phase */
+    int slow = g_slow_ns && total >= g_slow_ns;
+    int sampled = !slow && g_sample_every && ++g_sample_count % g_sample_every == 0;
+    if (!slow && !sampled) return;
+
+    char phases[256];
+    size_t n = 0;
+    for (int i = 0; i < PH_COUNT && n < sizeof(phases); i++) {
+        if (!t->ns[i]) continue;
+        int m = snprintf(phases + n, sizeof(phases) - n, " %s_us=%llu", phase_names[i],
+                         (unsigned long long)(t->ns[i] / 1000));
+        if (m > 0) n += (size_t)m;
+    }
+    if (n >= sizeof(phases)) n = sizeof(phases) - 1;
+    phases[n] = '\0';
+    log_event(slow ? LOG_WARN : LOG_INFO, slow ? "slow_request" : "trace",
+              "method=%s path=%.64s status=%d total_us=%llu%s",
+              method, path, status, (unsigned long long)(total / 1000), phases);
+}
@@ -0,0 +1,146 @@
+#include "userdir.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    int id;
+    char *name;           /* one allocation: name, NUL, hash, NUL */
+    const char *hash;
+} user;
+
+static user *g_users = NULL;
+static size_t g_count = 0, g_alloc = 0;
+/* slots hold an index into g_users plus one; 0 is empty */
+static uint32_t *g_by_id = NULL, *g_by_name = NULL;
+static size_t g_cap = 0;       /* power of two, load <= 0.5 */
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t hash_id(int id) {
+    return (size_t)(((uint64_t)(uint32_t)id * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+/* FNV-1a over the name */
+static size_t hash_name(const char *s) {
+    uint64_t h = 1469598103934665603ULL;
+    for (; *s; ++s) { h ^= (unsigned char)*s; h *= 1099511628211ULL; }
+    return (size_t)h;
+}
+
+/* caller holds g_lock; -1 if not there */
+static long find_id(int id) {
+    size_t mask = g_cap - 1;
+    for (size_t i = hash_id(id) & mask; g_by_id[i]; i = (i + 1) & mask)
+        if (g_users[g_by_id[i] - 1].id == id) return (long)g_by_id[i] - 1;
+    return -1;
+}
+
+static long find_name(const char *name) {
+    size_t mask = g_cap - 1;
+    for (size_t i = hash_name(name) & mask; g_by_name[i]; i = (i + 1) & mask)
+        if (strcmp(g_users[g_by_name[i] - 1].name, name) == 0) return (long)g_by_name[i] - 1;
+    return -1;
+}
+
+static void index_user(uint32_t *by_id, uint32_t *by_name, size_t cap, size_t k) {
+    size_t mask = cap - 1, i;
+    for (i = hash_id(g_users[k].id) & mask; by_id[i]; i = (i + 1) & mask) {}
+    by_id[i] = (uint32_t)k + 1;
+    for (i = hash_name(g_users[k].name) & mask; by_name[i]; i = (i + 1) & mask) {}
+    by_name[i] = (uint32_t)k + 1;
+}
+
+/* caller holds g_lock; doubles both indexes and reinserts everyone */
+static int grow(void) {
+    size_t cap = g_cap * 2;
+    uint32_t *by_id = (uint32_t*)calloc(cap, sizeof(uint32_t));
+    uint32_t *by_name = (uint32_t*)calloc(cap, sizeof(uint32_t));
+    if (!by_id || !by_name) { free(by_id); free(by_name); return -1; }
+    for (size_t k = 0; k < g_count; k++) index_user(by_id, by_name, cap, k);
+    free(g_by_id); free(g_by_name);
+    g_by_id = by_id; g_by_name = by_name;
+    g_cap = cap;
+    return 0;
+}
+
+int userdir_init(void) {
+    userdir_free();
+    pthread_mutex_lock(&g_lock);
+    g_cap = 1024;
+    g_by_id = (uint32_t*)calloc(g_cap, sizeof(uint32_t));
+    g_by_name = (uint32_t*)calloc(g_cap, sizeof(uint32_t));
+    int ok = g_by_id && g_by_name;
+    pthread_mutex_unlock(&g_lock);
+    if (!ok) { userdir_free(); return -1; }
+    return 0;
+}
+
+void userdir_free(void) {
+    pthread_mutex_lock(&g_lock);
+    for (size_t k = 0; k < g_count; k++) free(g_users[k].name);
+    free(g_users); free(g_by_id); free(g_by_name);
+    g_users = NULL; g_by_id = g_by_name = NULL;
+    g_count = g_alloc = g_cap = 0;
+    pthread_mutex_unlock(&g_lock);
+}
+
+int userdir_add(int id, const char *username, const char *password_hash) {
+    size_t nl = strlen(username), hl = strlen(password_hash);
+    int out = -1;
+    pthread_mutex_lock(&g_lock);
+    if (!g_cap) goto done;
+    if (find_id(id) >= 0 || find_name(username) >= 0) { out = -2; goto done; }
+    if ((g_count + 1) * 2 > g_cap && grow() < 0) goto done;
+    if (g_count == g_alloc) {
+        size_t n = g_alloc ? g_alloc * 2 : 256;
+        user *u = (user*)realloc(g_users, n * sizeof(user));
+        if (!u) goto done;
+        g_users = u;
+        g_alloc = n;
+    }
+    char *s = (char*)malloc(nl + hl + 2);
+    if (!s) goto done;
+    memcpy(s, username, nl + 1);
+    memcpy(s + nl + 1, password_hash, hl + 1);
+    g_users[g_count] = (user){ id, s, s + nl + 1 };
+    index_user(g_by_id, g_by_name, g_cap, g_count);
+    g_count++;
+    out = 0;
+done:
+    pthread_mutex_unlock(&g_lock);
+    return out;
+}
+
+int userdir_find_name(const char *username, int *id, char *hash_out, size_t hash_sz) {
+    int out = -1;
+    pthread_mutex_lock(&g_lock);
+    long k = g_cap ? find_name(username) : -1;
+    if (k >= 0) {
+        if (id) *id = g_users[k].id;
+        if (hash_out) snprintf(hash_out, hash_sz, "%s", g_users[k].hash);
+        out = 0;
+    }
+    pthread_mutex_unlock(&g_lock);
+    return out;
+}
+
+int userdir_find_id(int id, char *username_out, size_t out_sz) {
+    int out = -1;
+    pthread_mutex_lock(&g_lock);
+    long k = g_cap ? find_id(id) : -1;
+    if (k >= 0) {
+        if (username_out) snprintf(username_out, out_sz, "%s", g_users[k].name);
+        out = 0;
+    }
+    pthread_mutex_unlock(&g_lock);
+    return out;
+}
+
+size_t userdir_count(void) {
+    pthread_mutex_lock(&g_lock);
+    size_t n = g_count;
+    pthread_mutex_unlock(&g_lock);
+    return n;
+}
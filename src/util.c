@@ -1,6 +1,7 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
+#include <time.h>
 #include "util.h"
 
 // Nonblocking helper
@@ -10,6 +11,13 @@ int set_nonblock(int fd) {
     return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
+// Monotonic clock in nanoseconds, for measuring durations
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
 // Signal handling
 volatile sig_atomic_t g_stop = 0;
 void on_sigint(int sig) { 
@@ -4,156 +4,273 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #if defined(__APPLE__)
 #include <CommonCrypto/CommonCrypto.h>
+#else
+#include <openssl/sha.h>
 #endif
 
 #include "base64.h"
+#include "bufpool.h"
+#include "metrics.h"
 #include "websocket.h"
 
 /* Compute Sec-WebSocket-Accept = Base64(SHA1(key + GUID)) */
 void compute_ws_accept(const char *client_key, char *accept_out /*must be >= 29*/) {
 	static const char *GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-	unsigned char sha1[CC_SHA1_DIGEST_LENGTH];
+	unsigned char sha1[20];
 	char buf[128];
 
 	size_t n = snprintf(buf, sizeof(buf), "%s%s", client_key, GUID);
+	if (n >= sizeof(buf)) n = sizeof(buf) - 1;
+#if defined(__APPLE__)
 	CC_SHA1((const unsigned char *)buf, (CC_LONG)n, sha1);
+#else
+	SHA1((const unsigned char *)buf, n, sha1);
+#endif
 
-	char b64[64];
-	size_t len = base64_encode(sha1, sizeof(sha1), b64);
-	b64[len] = '\0';
-	strncpy(accept_out, b64, 64);
+	size_t len = base64_encode(sha1, sizeof(sha1), accept_out);
+	accept_out[len] = '\0';
 }
 
-/* Send WebSocket text frame (server -> client, unmasked) */
-int ws_send_text(int fd, const char *msg, size_t len) {
-	unsigned char hdr[10];
-	size_t hlen = 0;
-
-	hdr[0] = 0x80 | 0x1;
+static size_t frame_header(unsigned char hdr[10], unsigned opcode, size_t len) {
+	hdr[0] = (unsigned char)(0x80 | opcode);
 	if (len < 126) {
 		hdr[1] = (unsigned char)len;
-		hlen = 2;
-	} else if (len <= 0xFFFF) {
+		return 2;
+	}
+	if (len <= 0xFFFF) {
 		hdr[1] = 126;
 		hdr[2] = (len >> 8) & 0xFF;
 		hdr[3] = len & 0xFF;
-		hlen = 4;
-	} else {
-		hdr[1] = 127;
-		for (int i = 0; i < 8; i++) hdr[2 + i] = (len >> (8 * (7 - i))) & 0xFF;
-		hlen = 10;
+		return 4;
 	}
+	hdr[1] = 127;
+	for (int i = 0; i < 8; i++) hdr[2 + i] = (len >> (8 * (7 - i))) & 0xFF;
+	return 10;
+}
+
+/* Send WebSocket text frame (server -> client, unmasked) */
+int ws_send_text(int fd, const char *msg, size_t len) {
+	unsigned char hdr[10];
+	size_t hlen = frame_header(hdr, 0x1, len);
 
 	if (write(fd, hdr, hlen) < 0) return -1;
 	if (write(fd, msg, len) < 0) return -1;
+	metrics_add(CTR_BYTES_OUT, (int64_t)(hlen + len));
+	return 0;
+}
+
+static int tx_append(ws_tx *tx, const void *data, size_t n) {
+	if (tx->len + n > tx->cap) {
+		/* reclaim the sent prefix before growing */
+		if (tx->off > 0) {
+			memmove(tx->buf, tx->buf + tx->off, tx->len - tx->off);
+			tx->len -= tx->off;
+			tx->off = 0;
+		}
+		if (tx->len + n > tx->cap) {
+			size_t cap = tx->cap ? tx->cap : 4096;
+			while (cap < tx->len + n) cap *= 2;
+			char *p = (char*)realloc(tx->buf, cap);
+			if (!p) return -1;
+			tx->buf = p;
+			tx->cap = cap;
+		}
+	}
+	memcpy(tx->buf + tx->len, data, n);
+	tx->len += n;
+	return 0;
+}
+
+/* one whole frame through tx, so frames never interleave on the wire */
+static int send_frame(int fd, ws_tx *tx, unsigned opcode, const char *msg, size_t len) {
+	unsigned char hdr[10];
+	size_t hlen = frame_header(hdr, opcode, len);
+	size_t sent = 0;
+	if (!ws_tx_pending(tx)) {
+		struct iovec iov[2] = { { hdr, hlen }, { (void*)msg, len } };
+		struct msghdr mh = { .msg_iov = iov, .msg_iovlen = 2 };
+		ssize_t n = sendmsg(fd, &mh, 0);
+		if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+		if (n > 0) {
+			sent = (size_t)n;
+			metrics_add(CTR_BYTES_OUT, n);
+		}
+		if (sent == hlen + len) return 0;
+	}
+	if (tx->len - tx->off + hlen + len - sent > WS_TX_MAX) return -1;
+	if (sent < hlen && tx_append(tx, hdr + sent, hlen - sent) < 0) return -1;
+	size_t body = sent > hlen ? sent - hlen : 0;
+	return tx_append(tx, msg + body, len - body);
+}
+
+int ws_send_queued(int fd, ws_tx *tx, const char *msg, size_t len) {
+	return send_frame(fd, tx, 0x1, msg, len);
+}
+
+int ws_tx_flush(int fd, ws_tx *tx) {
+	while (ws_tx_pending(tx)) {
+		ssize_t n = send(fd, tx->buf + tx->off, tx->len - tx->off, 0);
+		if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+		metrics_add(CTR_BYTES_OUT, n);
+		tx->off += (size_t)n;
+	}
+	/* drained: give the memory back */
+	ws_tx_free(tx);
+	return 0;
+}
+
+void ws_tx_free(ws_tx *tx) {
+	free(tx->buf);
+	tx->buf = NULL;
+	tx->len = tx->cap = tx->off = 0;
+}
+
+/* Receive buffers: taken from the pool when data arrives and returned once
+   everything buffered has been consumed, so idle connections hold none. */
+static bufpool g_rx_pool;
+static int g_rx_pool_ready = 0;
+
+static int rx_reserve(ws_rx *rx, size_t need) {
+	if (!rx->buf) {
+		if (!g_rx_pool_ready) { bufpool_init(&g_rx_pool, WS_RX_POOL_BUF, 1024); g_rx_pool_ready = 1; }
+		size_t cap = need > WS_RX_POOL_BUF ? need : WS_RX_POOL_BUF;
+		rx->buf = (unsigned char*)(cap == WS_RX_POOL_BUF ? bufpool_get(&g_rx_pool) : malloc(cap));
+		if (!rx->buf) return -1;
+		rx->cap = cap;
+		return 0;
+	}
+	if (rx->cap >= need) return 0;
+	unsigned char *nb = (unsigned char*)malloc(need);
+	if (!nb) return -1;
+	memcpy(nb, rx->buf, rx->len);
+	if (rx->cap == WS_RX_POOL_BUF) bufpool_put(&g_rx_pool, rx->buf);
+	else free(rx->buf);
+	rx->buf = nb;
+	rx->cap = need;
 	return 0;
 }
 
-/* Read one WebSocket frame (client -> server, masked). Returns -1 error/closed, 0 if not a full frame yet, 1 if OK and sets payload */
-int ws_read_text(int fd, unsigned char **out, size_t *len_out) {
-	unsigned char hdr[2];
-	ssize_t n = recv(fd, hdr, 2, MSG_PEEK);
-	if (n < 0) {
-		if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
-		return -1;
+void ws_rx_free(ws_rx *rx) {
+	if (rx->buf) {
+		if (rx->cap == WS_RX_POOL_BUF) bufpool_put(&g_rx_pool, rx->buf);
+		else free(rx->buf);
 	}
-	if (n == 0) return -1;
-	if (n < 2)  return 0;
-
-	unsigned fin = (hdr[0] & 0x80) != 0;
-	unsigned opcode = hdr[0] & 0x0F;
-	unsigned masked = (hdr[1] & 0x80) != 0;
-	uint64_t plen = hdr[1] & 0x7F;
-	size_t header_len = 2;
-
-	if (plen == 126) header_len += 2;
-	else if (plen == 127) header_len += 8;
-	if (masked) header_len += 4;
-
-	unsigned char header[14];
-	n = recv(fd, header, header_len, MSG_PEEK);
-	if (n < 0) {
-		if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
-		return -1;
+	memset(rx, 0, sizeof(*rx));
+}
+
+/* drops the frame handed out by the previous call */
+static void rx_compact(ws_rx *rx) {
+	if (!rx->consumed) return;
+	rx->buf[rx->consumed] = rx->saved;   /* byte overwritten by the NUL terminator */
+	rx->len -= rx->consumed;
+	if (rx->len) memmove(rx->buf, rx->buf + rx->consumed, rx->len);
+	rx->consumed = 0;
+}
+
+/* XOR with the 4-byte mask, a machine word at a time */
+static void ws_unmask(unsigned char *p, size_t n, const unsigned char mask[4]) {
+	size_t i = 0;
+	uint32_t m32;
+	memcpy(&m32, mask, 4);
+	uint64_t m64 = ((uint64_t)m32 << 32) | m32;
+	for (; i + 8 <= n; i += 8) {
+		uint64_t v;
+		memcpy(&v, p + i, 8);
+		v ^= m64;
+		memcpy(p + i, &v, 8);
 	}
-	if (n < (ssize_t)header_len) return 0;
+	for (; i < n; i++) p[i] ^= mask[i & 3];
+}
+
+/* Parses one frame at the start of rx. Returns 1 for a text frame, 2 for a
+   frame handled here (ping, other opcodes), 0 if incomplete (*need set to
+   the bytes required), -1 on close, a protocol error or a pong that could
+   not be queued. */
+static int parse_frame(int fd, ws_rx *rx, ws_tx *tx, unsigned char **out, size_t *len_out, size_t *need) {
+	*need = 2;
+	if (rx->len < 2) return 0;
+	const unsigned char *h = rx->buf;
+	unsigned opcode = h[0] & 0x0F;
+	unsigned masked = (h[1] & 0x80) != 0;
+	uint64_t plen = h[1] & 0x7F;
+	size_t header_len = 2 + (plen == 126 ? 2 : plen == 127 ? 8 : 0) + (masked ? 4 : 0);
+	*need = header_len;
+	if (rx->len < header_len) return 0;
 
 	size_t off = 2;
 	if (plen == 126) {
-		plen = ((uint64_t)header[2] << 8) | header[3];
+		plen = ((uint64_t)h[2] << 8) | h[3];
 		off += 2;
 	} else if (plen == 127) {
 		plen = 0;
-		for (int i = 0; i < 8; ++i) plen = (plen << 8) | header[2+i];
+		for (int i = 0; i < 8; ++i) plen = (plen << 8) | h[2+i];
 		off += 8;
 	}
+	if (plen > WS_MAX_FRAME) return -1;
+	if (opcode >= 0x8 && plen > 125) return -1;
 
-	unsigned char mask[4] = {0};
-	if (masked) {
-		mask[0] = header[off+0];
-		mask[1] = header[off+1];
-		mask[2] = header[off+2];
-		mask[3] = header[off+3];
-	}
-
+	/* +1 so the payload can be NUL-terminated in place */
 	size_t total = header_len + (size_t)plen;
-	unsigned char *frame = (unsigned char*)malloc(total);
-	if (!frame) return -1;
-
-	ssize_t got = recv(fd, frame, total, 0);
-	if (got < 0) {
-		free(frame);
-		if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
-		return -1;
-	}
-	if (got == 0) { free(frame); return -1; }
-	if ((size_t)got < total) { free(frame); return 0; }
+	*need = total + 1;
+	if (rx->len < total) return 0;
 
-	unsigned char *payload = frame + header_len;
+	unsigned char *payload = rx->buf + header_len;
+	if (masked) ws_unmask(payload, (size_t)plen, h + off);
 
-	if (masked) {
-		for (uint64_t i = 0; i < plen; ++i) payload[i] ^= mask[i % 4];
-	}
-
-	int ret = 0;
-	if (opcode == 0x8) { /* close */
-		ret = -1;
-	} else if (opcode == 0x1) { /* text */
-		*out = (unsigned char*)malloc((size_t)plen);
-		if (!*out) { free(frame); return -1; }
-		memcpy(*out, payload, (size_t)plen);
+	if (opcode == 0x8) return -1;   /* close */
+	if (opcode == 0x1) {
+		if (rx_reserve(rx, total + 1) < 0) return -1;
+		payload = rx->buf + header_len;
+		rx->saved = total < rx->len ? rx->buf[total] : 0;
+		rx->buf[total] = '\0';
+		rx->consumed = total;
+		*out = payload;
 		*len_out = (size_t)plen;
-		ret = 1;
-	} else if (opcode == 0x9) { /* ping -> pong */
-		unsigned char hdr2[10];
-		size_t hlen = 0;
-		hdr2[0] = 0x80 | 0xA;
-		if (plen < 126) { hdr2[1] = (unsigned char)plen; hlen = 2; }
-		else if (plen <= 0xFFFF) { hdr2[1]=126; hdr2[2]=(plen>>8)&0xFF; hdr2[3]=plen&0xFF; hlen=4; }
-		else { hdr2[1]=127; for (int i=0;i<8;i++) hdr2[2+i]=(plen>>(56-8*i))&0xFF; hlen=10; }
-		write(fd, hdr2, hlen);
-		if (plen) write(fd, payload, (size_t)plen);
-		ret = 0;
-	} else {
-		ret = 0;
+		return 1;
 	}
+	/* pongs queue behind any partly sent frame */
+	if (opcode == 0x9 && send_frame(fd, tx, 0xA, (const char*)payload, (size_t)plen) < 0) return -1;
+	rx->len -= total;
+	if (rx->len) memmove(rx->buf, rx->buf + total, rx->len);
+	return 2;
+}
 
-	free(frame);
-	(void)fin;
-	return ret;
+int ws_read_text(int fd, ws_rx *rx, ws_tx *tx, unsigned char **out, size_t *len_out) {
+	rx_compact(rx);
+	for (;;) {
+		size_t need;
+		int r = parse_frame(fd, rx, tx, out, len_out, &need);
+		if (r == 1 || r < 0) return r;
+		if (r == 2) continue;
+		/* incomplete: make room for at least the whole frame, then read */
+		if (rx_reserve(rx, need) < 0) return -1;
+		ssize_t n = recv(fd, rx->buf + rx->len, rx->cap - rx->len, 0);
+		if (n == 0) return -1;
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+			if (!rx->len) ws_rx_free(rx);   /* nothing pending: give the buffer back */
+			return 0;
+		}
+		metrics_add(CTR_BYTES_IN, n);
+		rx->len += (size_t)n;
+	}
 }
 
 /* keep original echo for backward compatibility (unused now) */
 int ws_read_and_echo(int fd) {
+	ws_rx rx;
+	ws_tx tx;
+	memset(&rx, 0, sizeof(rx));
+	memset(&tx, 0, sizeof(tx));
 	unsigned char *msg = NULL;
 	size_t len = 0;
-	int r = ws_read_text(fd, &msg, &len);
-	if (r == 1) {
-		ws_send_text(fd, (const char*)msg, len);
-		free(msg);
-	}
+	int r = ws_read_text(fd, &rx, &tx, &msg, &len);
+	if (r == 1) ws_send_text(fd, (const char*)msg, len);
+	ws_rx_free(&rx);
+	ws_tx_free(&tx);
 	return (r > 0) ? 1 : r;
-}
\ No newline at end of file
+}
@@ -0,0 +1,147 @@
+#include "workpool.h"
+#include "util.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct job {
+    work_fn work;
+    work_fn done;
+    void *arg;
+    struct job *next;
+} job;
+
+struct workpool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    job *queue_head, *queue_tail;   /* waiting for a worker */
+    job *done_head, *done_tail;     /* waiting for workpool_complete() */
+    int queued;
+    int max_queue;
+    int stopping;
+    int nthreads;
+    pthread_t *threads;
+    int pipe_rd, pipe_wr;
+};
+
+static void *worker_main(void *arg) {
+    workpool *wp = (workpool*)arg;
+    pthread_mutex_lock(&wp->lock);
+    for (;;) {
+        while (!wp->queue_head && !wp->stopping) pthread_cond_wait(&wp->cond, &wp->lock);
+        job *j = wp->queue_head;
+        if (!j) break;   /* stopping and drained */
+        wp->queue_head = j->next;
+        if (!wp->queue_head) wp->queue_tail = NULL;
+        wp->queued--;
+        pthread_mutex_unlock(&wp->lock);
+
+        j->work(j->arg);
+
+        pthread_mutex_lock(&wp->lock);
+        j->next = NULL;
+        if (wp->done_tail) wp->done_tail->next = j; else wp->done_head = j;
+        wp->done_tail = j;
+        /* a full pipe already means "something is pending", so ignore EAGAIN */
+        char b = 1;
+        ssize_t w = write(wp->pipe_wr, &b, 1);
+        (void)w;
+    }
+    pthread_mutex_unlock(&wp->lock);
+    return NULL;
+}
+
+workpool *workpool_create(int nthreads, int max_queue) {
+    if (nthreads < 1) nthreads = 1;
+    if (max_queue < 1) max_queue = 1;
+    workpool *wp = (workpool*)calloc(1, sizeof(*wp));
+    if (!wp) return NULL;
+    int fds[2];
+    if (pipe(fds) < 0) { free(wp); return NULL; }
+    wp->pipe_rd = fds[0];
+    wp->pipe_wr = fds[1];
+    set_nonblock(wp->pipe_rd);
+    set_nonblock(wp->pipe_wr);
+    fcntl(wp->pipe_rd, F_SETFD, FD_CLOEXEC);
+    fcntl(wp->pipe_wr, F_SETFD, FD_CLOEXEC);
+    pthread_mutex_init(&wp->lock, NULL);
+    pthread_cond_init(&wp->cond, NULL);
+    wp->max_queue = max_queue;
+    wp->threads = (pthread_t*)calloc((size_t)nthreads, sizeof(pthread_t));
+    if (!wp->threads) { workpool_destroy(wp); return NULL; }
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&wp->threads[i], NULL, worker_main, wp) != 0) break;
+        wp->nthreads++;
+    }
+    if (wp->nthreads == 0) { workpool_destroy(wp); return NULL; }
+    return wp;
+}
+
+void workpool_destroy(workpool *wp) {
+    if (!wp) return;
+    pthread_mutex_lock(&wp->lock);
+    wp->stopping = 1;
+    pthread_cond_broadcast(&wp->cond);
+    pthread_mutex_unlock(&wp->lock);
+    for (int i = 0; i < wp->nthreads; i++) pthread_join(wp->threads[i], NULL);
+    workpool_complete(wp);
+    close(wp->pipe_rd);
+    close(wp->pipe_wr);
+    pthread_mutex_destroy(&wp->lock);
+    pthread_cond_destroy(&wp->cond);
+    free(wp->threads);
+    free(wp);
+}
+
+int workpool_submit(workpool *wp, work_fn work, work_fn done, void *arg) {
+    job *j = (job*)malloc(sizeof(*j));
+    if (!j) return -1;
+    j->work = work;
+    j->done = done;
+    j->arg = arg;
+    j->next = NULL;
+    pthread_mutex_lock(&wp->lock);
+    if (wp->stopping || wp->queued >= wp->max_queue) {
+        pthread_mutex_unlock(&wp->lock);
+        free(j);
+        return -1;
+    }
+    if (wp->queue_tail) wp->queue_tail->next = j; else wp->queue_head = j;
+    wp->queue_tail = j;
+    wp->queued++;
+    pthread_cond_signal(&wp->cond);
+    pthread_mutex_unlock(&wp->lock);
+    return 0;
+}
+
+int workpool_notify_fd(const workpool *wp) {
+    return wp->pipe_rd;
+}
+
+int workpool_complete(workpool *wp) {
+    char sink[64];
+    while (read(wp->pipe_rd, sink, sizeof(sink)) > 0) {}
+
+    pthread_mutex_lock(&wp->lock);
+    job *j = wp->done_head;
+    wp->done_head = wp->done_tail = NULL;
+    pthread_mutex_unlock(&wp->lock);
+
+    int n = 0;
+    while (j) {
+        job *next = j->next;
+        if (j->done) j->done(j->arg);
+        free(j);
+        j = next;
+        n++;
+    }
+    return n;
+}
+
+int workpool_queue_depth(workpool *wp) {
+    pthread_mutex_lock(&wp->lock);
+    int n = wp->queued;
+    pthread_mutex_unlock(&wp->lock);
+    return n;
+}
@@ -4,22 +4,38 @@ let currentUser = null;
 let encryptionKey = null;
 
 // update stats badges
+function showStats(stats) {
+  document.getElementById('users-count').textContent = stats.total_users;
+  document.getElementById('online-count').textContent = stats.online_users;
+}
+
 async function updateStats() {
   try {
     const response = await fetch('/stats');
-    if (response.ok) {
-      const stats = await response.json();
-      document.getElementById('users-count').textContent = stats.total_users;
-      document.getElementById('online-count').textContent = stats.online_users;
-    }
+    if (response.ok) showStats(await response.json());
   } catch (error) {
     console.error('Failed to fetch stats:', error);
   }
 }
 
-// update stats every 3 seconds
-setInterval(updateStats, 3000);
-updateStats(); // initial call
+// the server pushes stats over /events when they change;
+// fall back to polling every 3 seconds if EventSource is unavailable or gives up
+let statsPoll = null;
+function startStatsPolling() {
+  if (statsPoll) return;
+  statsPoll = setInterval(updateStats, 3000);
+  updateStats();
+}
+
+if (window.EventSource) {
+  const events = new EventSource('/events');
+  events.addEventListener('stats', (e) => showStats(JSON.parse(e.data)));
+  events.onerror = () => {
+    if (events.readyState === EventSource.CLOSED) startStatsPolling();
+  };
+} else {
+  startStatsPolling();
+}
 
 // Crypto functions for end-to-end encryption
 async function deriveKey(password) {
@@ -202,18 +218,54 @@ async function checkAuthStatus() {
       document.getElementById('auth-section').classList.remove('hidden');
       document.getElementById('user-info').classList.add('hidden');
       document.getElementById('chat-section').classList.add('hidden');
-      if (ws) { ws.close(); ws = null; }
+      clearTimeout(reconnectTimer);
+      if (ws) { const old = ws; ws = null; old.close(); }
     }
   } catch (error) {
     console.error('Auth check failed:', error);
   }
 }
 
+// cursor for the next older page of history (null when there is none)
+let historyBefore = null;
+let loadingOlder = false;
+// newest message id shown; sent as ?since= so a reconnect only replays what was missed
+let lastMessageId = 0;
+// ids already shown; with several instances ids can arrive out of order,
+// so a lower id than lastMessageId may still be new
+let seenIds = new Set();
+let reconnectDelay = 1000;
+let reconnectTimer = null;
+
+async function formatHistoryMessage(msg) {
+  let content = msg.content;
+
+  // Check if message looks encrypted (base64)
+  if (content.match(/^[A-Za-z0-9+/]+=*$/)) {
+    if (encryptionKey) {
+      // Try to decrypt
+      try {
+        content = await decryptMessage(content, encryptionKey);
+      } catch (e) {
+        content = '[🔒 Encrypted - wrong key?]';
+      }
+    } else {
+      content = '[🔒 Encrypted message - no key provided]';
+    }
+  }
+
+  return '[' + msg.username + '] ' + content;
+}
+
 async function loadMessageHistory() {
   try {
     const response = await fetch('/messages', { credentials: 'same-origin' });
     if (response.ok) {
-      const messages = await response.json();
+      const page = await response.json();
+      const messages = page.messages;
+      historyBefore = page.has_more ? page.before : null;
+      lastMessageId = page.after || 0;
+      seenIds = new Set(messages.map(function (m) { return m.id; }));
       // messages come back newest first, so reverse them
       messages.reverse();
       const chatLog = document.getElementById('chat-log');
@@ -222,23 +274,7 @@ async function loadMessageHistory() {
         addToChat('[No message history]');
       } else {
         for (const msg of messages) {
-          let content = msg.content;
-
-          // Check if message looks encrypted (base64)
-          if (content.match(/^[A-Za-z0-9+/]+=*$/)) {
-            if (encryptionKey) {
-              // Try to decrypt
-              try {
-                content = await decryptMessage(content, encryptionKey);
-              } catch (e) {
-                content = '[🔒 Encrypted - wrong key?]';
-              }
-            } else {
-              content = '[🔒 Encrypted message - no key provided]';
-            }
-          }
-
-          addToChat('[' + msg.username + '] ' + content);
+          addToChat(await formatHistoryMessage(msg));
         }
       }
     }
@@ -247,6 +283,34 @@ async function loadMessageHistory() {
   }
 }
 
+// fetch the page before the oldest message shown and prepend it
+async function loadOlderMessages() {
+  if (historyBefore === null || loadingOlder) return;
+  loadingOlder = true;
+  try {
+    const response = await fetch('/messages?before=' + historyBefore, { credentials: 'same-origin' });
+    if (response.ok) {
+      const page = await response.json();
+      historyBefore = page.has_more ? page.before : null;
+      const lines = [];
+      for (const msg of page.messages.reverse()) {
+        seenIds.add(msg.id);
+        lines.push(await formatHistoryMessage(msg));
+      }
+      if (lines.length > 0) {
+        const chatLog = document.getElementById('chat-log');
+        const oldHeight = chatLog.scrollHeight;
+        chatLog.textContent = lines.join('\n') + '\n' + chatLog.textContent;
+        chatLog.scrollTop = chatLog.scrollHeight - oldHeight;
+      }
+    }
+  } catch (error) {
+    console.error('Failed to load older messages:', error);
+  } finally {
+    loadingOlder = false;
+  }
+}
+
 async function promptForEncryptionKey(showInChat) {
   const password = prompt(
     '🔒 SECURE CHAT ROOM PASSWORD\n\n' +
@@ -298,57 +362,60 @@ async function promptForEncryptionKey(showInChat) {
 
 function connectWebSocket() {
   console.log('Connecting to WebSocket...');
-  if (ws) { ws.close(); }
+  if (ws) { const old = ws; ws = null; old.close(); }
+  clearTimeout(reconnectTimer);
 
   // Ask for encryption password, then load history and connect
-  promptForEncryptionKey(true).then(function () {
-    ws = new WebSocket('ws://' + location.host + '/ws');
-
-    ws.onopen = function () {
-      console.log('WebSocket connected');
-      addToChat('[Connected to chat]');
-    };
-
-    ws.onmessage = async function (event) {
-      console.log('WebSocket message received:', event.data);
-      // Messages from server come as "[username] content"
-      // If encryption is enabled, content will be encrypted
-      const match = event.data.match(/^\[([^\]]+)\] (.+)$/);
-
-      if (match) {
-        const username = match[1];
-        const content = match[2];
-
-        // Try to decrypt if we have a key
-        // Check if content looks like base64 (encrypted)
-        if (encryptionKey && content.match(/^[A-Za-z0-9+/]+=*$/)) {
-          try {
-            const decrypted = await decryptMessage(content, encryptionKey);
-            addToChat('[' + username + '] ' + decrypted);
-          } catch (e) {
-            // Decryption failed, show as encrypted
-            addToChat('[' + username + '] [🔒 Encrypted - wrong key?]');
-          }
-        } else {
-          // Either no key or plaintext message
-          addToChat('[' + username + '] ' + content);
-        }
-      } else {
-        // System message or other format
-        addToChat(event.data);
-      }
-    };
-
-    ws.onclose = function () {
-      console.log('WebSocket disconnected');
-      addToChat('[Disconnected from chat]');
-    };
-
-    ws.onerror = function (error) {
-      console.log('WebSocket error:', error);
-      addToChat('[WebSocket error]');
-    };
-  });
+  promptForEncryptionKey(true).then(openSocket);
+}
+
+// opens /ws, resuming after lastMessageId; on a drop it retries with backoff
+// and the server replays only the messages sent in between
+function openSocket() {
+  const sock = new WebSocket('ws://' + location.host + '/ws?since=' + lastMessageId);
+  ws = sock;
+
+  sock.onopen = function () {
+    console.log('WebSocket connected');
+    reconnectDelay = 1000;
+    addToChat('[Connected to chat]');
+  };
+
+  sock.onmessage = async function (event) {
+    let msg;
+    try {
+      msg = JSON.parse(event.data);
+    } catch (e) {
+      addToChat(event.data);  // system message or other format
+      return;
+    }
+    if (msg.resync) {
+      // missed too much to replay; reload the newest page instead
+      await loadMessageHistory();
+      return;
+    }
+    if (msg.id) {
+      if (seenIds.has(msg.id)) return;  // already shown
+      seenIds.add(msg.id);
+      if (msg.id > lastMessageId) lastMessageId = msg.id;
+    }
+    addToChat(await formatHistoryMessage(msg));
+  };
+
+  sock.onclose = function () {
+    console.log('WebSocket disconnected');
+    if (ws !== sock) return;  // replaced or logged out
+    ws = null;
+    addToChat('[Disconnected from chat, reconnecting...]');
+    reconnectTimer = setTimeout(function () {
+      if (currentUser && !ws) openSocket();
+    }, reconnectDelay);
+    reconnectDelay = Math.min(reconnectDelay * 2, 30000);
+  };
+
+  sock.onerror = function (error) {
+    console.log('WebSocket error:', error);
+  };
 }
 
 function addToChat(message) {
@@ -382,7 +449,8 @@ async function sendMessage() {
 async function logout() {
   try {
     await fetch('/logout', { method: 'POST', credentials: 'same-origin' });
-    if (ws) { ws.close(); ws = null; }
+    clearTimeout(reconnectTimer);
+    if (ws) { const old = ws; ws = null; old.close(); }
     currentUser = null;
     document.getElementById('chat-log').textContent = '';
     checkAuthStatus();
@@ -396,6 +464,13 @@ document.addEventListener('DOMContentLoaded', function () {
   setupFormHandlers();
   checkAuthStatus();
 
+  const chatLog = document.getElementById('chat-log');
+  if (chatLog) {
+    chatLog.addEventListener('scroll', function () {
+      if (chatLog.scrollTop === 0) loadOlderMessages();
+    });
+  }
+
   const msgInput = document.getElementById('msg-input');
   if (msgInput) {
     msgInput.addEventListener('keypress', function (e) {
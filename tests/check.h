@@ -0,0 +1,22 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+/* Minimal assertions for the test programs in tests/: a failed CHECK is
+   reported with its location and the program carries on, so one run lists
+   every failure; CHECK_DONE() ends main with the exit status. */
+
+#include <stdio.h>
+
+static int g_checks, g_failed;
+
+#define CHECK(cond) do { \
+    g_checks++; \
+    if (!(cond)) { g_failed++; fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); } \
+} while (0)
+
+#define CHECK_DONE(name) do { \
+    printf("%-12s %d checks, %d failed\n", name, g_checks, g_failed); \
+    return g_failed ? 1 : 0; \
+} while (0)
+
+#endif
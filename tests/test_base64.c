@@ -0,0 +1,119 @@
+/* base64: every implementation this CPU has (avx2, ssse3, scalar) against
+   a plain reference encoder, round trips, and the strict decoder's
+   rejection of malformed input. */
+#include <stdlib.h>
+#include <string.h>
+#include "base64.h"
+#include "check.h"
+
+static const char *IMPLS[] = { "scalar", "ssse3", "avx2" };
+
+static size_t ref_encode(const unsigned char *in, size_t n, char *out, int flags) {
+    const char *t = flags & BASE64_URL
+        ? "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"
+        : "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t o = 0;
+    for (size_t i = 0; i < n; i += 3) {
+        unsigned v = (unsigned)in[i] << 16;
+        if (i + 1 < n) v |= (unsigned)in[i + 1] << 8;
+        if (i + 2 < n) v |= in[i + 2];
+        out[o++] = t[(v >> 18) & 63];
+        out[o++] = t[(v >> 12) & 63];
+        if (i + 1 < n) out[o++] = t[(v >> 6) & 63]; else if (!(flags & BASE64_NOPAD)) out[o++] = '=';
+        if (i + 2 < n) out[o++] = t[v & 63]; else if (!(flags & BASE64_NOPAD)) out[o++] = '=';
+    }
+    return o;
+}
+
+static long decode_with(const char *impl, const char *in, size_t n, unsigned char *out, size_t cap, int flags) {
+    base64_use_impl(impl);
+    return base64_decode(in, n, out, cap, flags);
+}
+
+static void round_trips(const char *impl) {
+    unsigned char data[300], back[300];
+    char enc[BASE64_ENCODED_LEN(300) + 1], ref[BASE64_ENCODED_LEN(300) + 1];
+    for (size_t n = 0; n <= sizeof(data); n++) {
+        for (size_t i = 0; i < n; i++) data[i] = (unsigned char)rand();
+        for (int flags = 0; flags < 4; flags++) {
+            base64_use_impl(impl);
+            size_t len = base64_encode_ex(data, n, enc, flags);
+            size_t rlen = ref_encode(data, n, ref, flags);
+            CHECK(len == rlen && memcmp(enc, ref, len) == 0);
+            long d = base64_decode(enc, len, back, sizeof(back), flags);
+            CHECK(d == (long)n && memcmp(back, data, n) == 0);
+        }
+    }
+}
+
+/* every single-character corruption of valid input is judged as scalar does,
+   and characters outside the alphabet are always rejected */
+static void corruptions(const char *impl) {
+    static const char bad[] = { '*', ' ', '\0', '\n', (char)0x80, (char)0xFF, '.' };
+    unsigned char data[96], out[96];
+    char enc[BASE64_ENCODED_LEN(96) + 1];
+    for (size_t n = 1; n <= sizeof(data); n += 7) {
+        for (size_t i = 0; i < n; i++) data[i] = (unsigned char)rand();
+        for (int flags = 0; flags < 4; flags++) {
+            base64_use_impl(impl);
+            size_t len = base64_encode_ex(data, n, enc, flags);
+            for (size_t pos = 0; pos < len; pos++) {
+                char saved = enc[pos];
+                for (size_t b = 0; b < sizeof(bad); b++) {
+                    enc[pos] = bad[b];
+                    CHECK(decode_with(impl, enc, len, out, sizeof(out), flags) == -1);
+                }
+                /* the other alphabet's characters are outside this one */
+                for (const char *c = flags & BASE64_URL ? "+/" : "-_"; *c; c++) {
+                    enc[pos] = *c;
+                    CHECK(decode_with(impl, enc, len, out, sizeof(out), flags) == -1);
+                }
+                /* '=' may make valid padding near the end; agree with scalar */
+                enc[pos] = '=';
+                long want = decode_with("scalar", enc, len, out, sizeof(out), flags);
+                CHECK(decode_with(impl, enc, len, out, sizeof(out), flags) == want);
+                enc[pos] = saved;
+            }
+        }
+    }
+}
+
+static void strictness(const char *impl) {
+    unsigned char out[16];
+    base64_use_impl(impl);
+    CHECK(base64_decode("QQ==", 4, out, sizeof(out), 0) == 1 && out[0] == 'A');
+    CHECK(base64_decode("QR==", 4, out, sizeof(out), 0) == -1);           /* non-zero trailing bits */
+    CHECK(base64_decode("QUI=", 4, out, sizeof(out), 0) == 2);
+    CHECK(base64_decode("QUJ=", 4, out, sizeof(out), 0) == -1);
+    CHECK(base64_decode("QQ", 2, out, sizeof(out), 0) == -1);             /* padding missing */
+    CHECK(base64_decode("QQ", 2, out, sizeof(out), BASE64_NOPAD) == 1);
+    CHECK(base64_decode("QQ==", 4, out, sizeof(out), BASE64_NOPAD) == -1); /* padding not allowed */
+    CHECK(base64_decode("Q", 1, out, sizeof(out), BASE64_NOPAD) == -1);
+    CHECK(base64_decode("Q===", 4, out, sizeof(out), 0) == -1);
+    CHECK(base64_decode("QQ==QUJD", 8, out, sizeof(out), 0) == -1);       /* padding inside */
+    CHECK(base64_decode("QUJD", 4, out, 2, 0) == -1);                     /* no room */
+    CHECK(base64_decode("", 0, out, sizeof(out), 0) == 0);
+    /* long input: the vector loops and the scalar tail disagree on nothing */
+    char enc[BASE64_ENCODED_LEN(3000)];
+    unsigned char data[3000], back[3000];
+    memset(data, 0xA5, sizeof(data));
+    size_t len = base64_encode(data, sizeof(data), enc);
+    for (size_t pos = 0; pos < len; pos += 61) {
+        char saved = enc[pos];
+        enc[pos] = '!';
+        CHECK(base64_decode(enc, len, back, sizeof(back), 0) == -1);
+        enc[pos] = saved;
+    }
+    CHECK(base64_decode(enc, len, back, sizeof(back), 0) == (long)sizeof(data));
+}
+
+int main(void) {
+    srand(1);
+    for (size_t i = 0; i < sizeof(IMPLS) / sizeof(IMPLS[0]); i++) {
+        if (base64_use_impl(IMPLS[i]) < 0) continue;   /* not on this CPU */
+        round_trips(IMPLS[i]);
+        corruptions(IMPLS[i]);
+        strictness(IMPLS[i]);
+    }
+    CHECK_DONE("base64");
+}
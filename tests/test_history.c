@@ -0,0 +1,112 @@
+/* History ring: what it answers from memory and when it sends readers to
+   the database instead, after eviction, an out-of-order id or a reset. */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "db.h"
+#include "history.h"
+#include "json.h"
+#include "log.h"
+#include "check.h"
+
+#define CAP 120
+
+struct seen { int n; long ids[CAP + 8]; };
+
+static void collect(const char *json, size_t len, void *userdata) {
+    struct seen *s = (struct seen*)userdata;
+    const char *p = strstr(json, "\"id\":");
+    if (p && p < json + len && s->n < CAP + 8) s->ids[s->n++] = atol(p + 5);
+}
+
+static void append(long id) {
+    char buf[128];
+    strbuf sb; sb_init_buf(&sb, buf, sizeof(buf));
+    jsonw w; jw_init(&w, &sb);
+    json_message(&w, id, "u", "hi", 1700000000 + id);
+    history_append(id, sb.data, sb.len);
+    sb_free(&sb);
+}
+
+/* ids since after_id straight from the ring, or -1 if it defers */
+static int since(long after_id, struct seen *s) {
+    memset(s, 0, sizeof(*s));
+    return history_since(after_id, CAP, collect, s);
+}
+
+static int page(long before_id, long after_id, int limit) {
+    strbuf sb; sb_init(&sb, 256);
+    int r = history_page(before_id, after_id, limit, &sb);
+    sb_free(&sb);
+    return r;
+}
+
+int main(void) {
+    char dir[] = "/tmp/history_test.XXXXXX", path[64];
+    if (!mkdtemp(dir)) return 1;
+    snprintf(path, sizeof(path), "%s/db.sqlite3", dir);
+    log_set_level(LOG_ERROR);
+    CHECK(db_init(path) == 0);
+    CHECK(db_create_user("u", "x") == 0);   /* messages reference a user */
+    for (int i = 1; i <= 5; i++) CHECK(db_save_message(1, "u", "seed", 1700000000 + i) == i);
+
+    /* seeded from the database: the whole table is in memory */
+    struct seen s;
+    CHECK(history_init(CAP) == 0);
+    CHECK(since(0, &s) == 5 && s.ids[0] == 1 && s.ids[4] == 5);
+    CHECK(page(0, 0, HISTORY_PAGE_MAX) == 1);
+    append(6);
+    append(7);
+    CHECK(since(5, &s) == 2 && s.ids[0] == 6 && s.ids[1] == 7);
+
+    /* an id that is not newer: everything up to it is left to the database,
+       and a client that saw 5..7 may have skipped it, so it cannot resume */
+    append(4);
+    CHECK(since(3, &s) == -1);
+    CHECK(since(4, &s) == -1);
+    CHECK(since(7, &s) == -1);
+    CHECK(page(0, 3, 10) == 0);
+    CHECK(page(6, 0, 5) == 0);           /* the page reaches below the floor */
+    CHECK(page(0, 4, 10) == 1);
+    append(8);
+    CHECK(since(7, &s) == -1);
+    CHECK(since(8, &s) == 0);
+    append(9);
+    CHECK(since(8, &s) == 1 && s.ids[0] == 9);
+
+    /* suspended: nothing is answered from memory or added to it */
+    history_reset(LONG_MAX);
+    CHECK(since(100, &s) == -1);
+    CHECK(page(0, 0, HISTORY_PAGE_MAX) == 0);
+    append(10);
+    CHECK(since(9, &s) == -1);
+
+    /* after a gap up to 20 the ring starts over above it */
+    history_reset(20);
+    append(21);
+    append(22);
+    CHECK(since(20, &s) == 2 && s.ids[0] == 21 && s.ids[1] == 22);
+    CHECK(since(19, &s) == -1);
+    append(15);                          /* at or below the floor: ignored, */
+    CHECK(since(20, &s) == -1);          /* but 21 and 22 went out before it */
+    CHECK(since(22, &s) == -1);
+    CHECK(page(0, 0, HISTORY_PAGE_MAX) == 0);   /* fewer than a page above the floor */
+    CHECK(page(0, 20, 10) == 1);
+
+    /* eviction moves the floor up to the oldest id pushed out */
+    for (long id = 23; id <= 23 + CAP; id++) append(id);
+    CHECK(since(23, &s) == CAP);
+    CHECK(since(22, &s) == -1);
+    CHECK(s.n == 0);
+    CHECK(since(23 + CAP - 3, &s) == 3 && s.ids[2] == 23 + CAP);
+    CHECK(page(0, 0, HISTORY_PAGE_MAX) == 1);
+
+    history_free();
+    db_close();
+    char cmd[96];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    if (system(cmd) != 0) perror("rm");
+    CHECK_DONE("history");
+}
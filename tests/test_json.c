@@ -0,0 +1,86 @@
+/* JSON escaping: the vectorized json_escape against a byte-at-a-time
+   reference, for every byte value at every position across the 16-byte
+   block boundaries, plus the writer's framing. */
+#include <stdlib.h>
+#include <string.h>
+#include "json.h"
+#include "strbuf.h"
+#include "check.h"
+
+static size_t ref_escape(const unsigned char *s, size_t n, char *out) {
+    static const char hex[] = "0123456789abcdef";
+    size_t o = 0;
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = s[i];
+        const char *short_esc = c == '"' ? "\\\"" : c == '\\' ? "\\\\" : c == '\b' ? "\\b" :
+            c == '\f' ? "\\f" : c == '\n' ? "\\n" : c == '\r' ? "\\r" : c == '\t' ? "\\t" : NULL;
+        if (short_esc) {
+            memcpy(out + o, short_esc, 2);
+            o += 2;
+        } else if (c < 0x20) {
+            memcpy(out + o, "\\u00", 4);
+            out[o + 4] = hex[c >> 4];
+            out[o + 5] = hex[c & 15];
+            o += 6;
+        } else {
+            out[o++] = (char)c;
+        }
+    }
+    return o;
+}
+
+static int same_as_ref(const unsigned char *s, size_t n) {
+    char ref[6 * 100];
+    size_t rlen = ref_escape(s, n, ref);
+    strbuf sb; sb_init(&sb, 16);
+    json_escape(&sb, (const char*)s, n);
+    int ok = !sb.failed && sb.len == rlen && memcmp(sb.data, ref, rlen) == 0;
+    sb_free(&sb);
+    return ok;
+}
+
+int main(void) {
+    unsigned char buf[100];
+    /* each byte value at each position of plain text, from every alignment */
+    for (size_t n = 1; n <= 70; n++) {
+        for (size_t align = 0; align < 4; align++) {
+            unsigned char *s = buf + align;
+            for (int c = 0; c < 256; c++) {
+                for (size_t pos = 0; pos < n; pos += (n > 40 ? 5 : 1)) {
+                    memset(s, 'a', n);
+                    s[pos] = (unsigned char)c;
+                    CHECK(same_as_ref(s, n));
+                }
+            }
+        }
+    }
+    /* random mixes, heavy on bytes that need escaping */
+    srand(2);
+    for (int iter = 0; iter < 20000; iter++) {
+        size_t n = (size_t)rand() % 96;
+        for (size_t i = 0; i < n; i++) {
+            int r = rand() % 8;
+            buf[i] = r == 0 ? (unsigned char)(rand() % 0x20) : r == 1 ? '"' : r == 2 ? '\\' : (unsigned char)rand();
+        }
+        CHECK(same_as_ref(buf, n));
+    }
+    CHECK(same_as_ref((const unsigned char*)"", 0));
+
+    /* the writer: quotes, commas, nesting */
+    strbuf sb; sb_init(&sb, 16);
+    jsonw w; jw_init(&w, &sb);
+    json_message(&w, 7, "a\"b", "line\nnext\x01", 1700000000);
+    sb_putc(&sb, '\0');
+    CHECK(strcmp(sb.data, "{\"id\":7,\"username\":\"a\\\"b\",\"content\":\"line\\nnext\\u0001\","
+                          "\"timestamp\":1700000000}") == 0);
+    sb_reset(&sb);
+    jw_init(&w, &sb);
+    jw_object_begin(&w);
+    jw_key(&w, "list"); jw_array_begin(&w); jw_int(&w, 1); jw_null(&w); jw_bool(&w, 0); jw_array_end(&w);
+    jw_key(&w, "raw"); jw_raw(&w, "{}", 2);
+    jw_object_end(&w);
+    sb_putc(&sb, '\0');
+    CHECK(strcmp(sb.data, "{\"list\":[1,null,false],\"raw\":{}}") == 0);
+    sb_free(&sb);
+    CHECK_DONE("json");
+}
@@ -0,0 +1,124 @@
+/* Session tokens: issue and verify, expiry, any change to the payload or
+   the MAC, key rotation, and revocation (forged tokens never get in). */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "base64.h"
+#include "token.h"
+#include "check.h"
+
+#if defined(__APPLE__)
+#include <CommonCrypto/CommonHMAC.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+#define KEY_A "00112233445566778899aabbccddeeff"
+#define KEY_B "ffeeddccbbaa99887766554433221100"
+
+/* signs payload with a raw key the way token.c does, so a token from a
+   verification-only key can be made */
+static void sign_with(const char *hexkey, const char *payload, char *out, size_t out_sz) {
+    unsigned char key[16], mac[32];
+    for (int i = 0; i < 16; i++) sscanf(hexkey + 2 * i, "%2hhx", &key[i]);
+#if defined(__APPLE__)
+    CCHmac(kCCHmacAlgSHA256, key, sizeof(key), payload, strlen(payload), mac);
+#else
+    unsigned int mlen = 0;
+    HMAC(EVP_sha256(), key, sizeof(key), (const unsigned char*)payload, strlen(payload), mac, &mlen);
+#endif
+    char b64[64];
+    size_t n = base64_encode_ex(mac, sizeof(mac), b64, BASE64_URL | BASE64_NOPAD);
+    b64[n] = '\0';
+    snprintf(out, out_sz, "%s.%s", payload, b64);
+}
+
+static int verifies(const char *t) {
+    int uid = 0;
+    return token_verify(t, &uid, NULL, 0);
+}
+
+int main(void) {
+    long now = (long)time(NULL);
+    char t[TOKEN_MAX_LEN], u[TOKEN_MAX_LEN];
+    int uid = 0;
+    char name[33];
+
+    CHECK(token_issue(1, "alice", now + 60, t, sizeof(t)) == -1);   /* no key yet */
+    CHECK(token_load_keys("a:" KEY_A ",b:" KEY_B) == 2);
+
+    CHECK(token_issue(42, "alice", now + 3600, t, sizeof(t)) == 0);
+    CHECK(strncmp(t, "1.a.42.", 7) == 0);
+    CHECK(token_verify(t, &uid, name, sizeof(name)) == 1);
+    CHECK(uid == 42 && strcmp(name, "alice") == 0);
+    CHECK(token_issue(42, "alice", now + 3600, t, 40) == -1);       /* does not fit */
+
+    /* expiry */
+    CHECK(token_issue(42, "alice", now - 1, u, sizeof(u)) == 0);
+    CHECK(!verifies(u));
+
+    /* every single-character change is caught, payload or MAC */
+    CHECK(token_issue(42, "alice", now + 3600, t, sizeof(t)) == 0);
+    for (size_t i = 0; t[i]; i++) {
+        strcpy(u, t);
+        u[i] = u[i] == 'x' ? 'y' : 'x';
+        CHECK(!verifies(u));
+    }
+    strcpy(u, t);
+    u[strlen(u) - 1] = '\0';                                          /* MAC cut short */
+    CHECK(!verifies(u));
+    CHECK(!verifies(""));
+    CHECK(!verifies("1.a.42"));
+    CHECK(!verifies("2.a.42.99999999999.alice.AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA"));
+
+    /* the second key verifies but does not sign; an unknown one does neither */
+    char payload[96];
+    snprintf(payload, sizeof(payload), "1.b.7.%ld.bob", now + 3600);
+    sign_with(KEY_B, payload, u, sizeof(u));
+    CHECK(token_verify(u, &uid, name, sizeof(name)) == 1 && uid == 7 && strcmp(name, "bob") == 0);
+    snprintf(payload, sizeof(payload), "1.c.7.%ld.bob", now + 3600);
+    sign_with(KEY_B, payload, u, sizeof(u));
+    CHECK(!verifies(u));
+    snprintf(payload, sizeof(payload), "1.a.7.%ld.bob", now + 3600);
+    sign_with(KEY_B, payload, u, sizeof(u));                          /* right format, wrong key */
+    CHECK(!verifies(u));
+
+    /* revocation ends a token and no other */
+    char t2[TOKEN_MAX_LEN];
+    CHECK(token_issue(42, "alice", now + 3600, t, sizeof(t)) == 0);
+    CHECK(token_issue(42, "alice", now + 3601, t2, sizeof(t2)) == 0);
+    CHECK(token_revoke(t) == 0);
+    CHECK(!verifies(t));
+    CHECK(verifies(t2));
+    CHECK(token_revoke(t) == 0);                                      /* twice is harmless */
+    CHECK(!verifies(t));
+
+    /* a forged token with the same MAC as a live one cannot revoke it:
+       the MAC is only trusted once it verifies */
+    strcpy(u, t2);
+    u[7] = u[7] == '9' ? '8' : '9';                                   /* payload changed, MAC kept */
+    token_revoke(u);
+    CHECK(verifies(t2));
+    snprintf(payload, sizeof(payload), "1.a.42.%ld.alice", 9223372036854775807L);
+    snprintf(u, sizeof(u), "%s.%s", payload, strrchr(t2, '.') + 1);
+    token_revoke(u);
+    CHECK(verifies(t2));
+    /* and an expired one is not stored */
+    CHECK(token_issue(42, "alice", now - 5, u, sizeof(u)) == 0);
+    CHECK(token_revoke(u) == 0);
+    CHECK(!verifies(u));
+
+    /* a full list refuses, and says so: the token stays valid */
+    long n = 0;
+    int r = 0;
+    while (n < (long)TOKEN_REVOKED_MAX && r == 0) {
+        if (token_issue(1000 + (int)n, "bob", now + 3600, u, sizeof(u)) != 0) break;
+        r = token_revoke(u);
+        n++;
+    }
+    CHECK(r == -1);
+    CHECK(n > (long)TOKEN_REVOKED_MAX / 2 && n <= (long)TOKEN_REVOKED_MAX / 4 * 3 + 1);
+    CHECK(verifies(u));
+    CHECK(!verifies(t));                                              /* nothing was evicted */
+    CHECK_DONE("token");
+}
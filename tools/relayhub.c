@@ -0,0 +1,229 @@
+/* Stand-in relay hub for running several server instances together.
+
+     ./tools/relayhub unix:/tmp/chat-relay.sock
+     ./tools/relayhub [host:]port
+
+   then start each server with RELAY set to the same address. Every frame
+   an instance sends is passed on unchanged, apart from its hop count, to
+   all the other connected instances, never back to the sender (the frame
+   format is in include/relay.h). An instance that stops reading and falls
+   RELAY_OUT_MAX bytes behind is disconnected; it reconnects by itself.
+   Build with `make tools`. */
+#define _POSIX_C_SOURCE 200809L
+#define _DARWIN_C_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "relay.h"
+
+#define PEERS_MAX 256
+
+typedef struct {
+    unsigned char *p;
+    size_t len, cap;
+} buf;
+
+typedef struct {
+    int fd;
+    buf in, out;
+    size_t out_off;
+    const char *gone;     /* why the peer is to be dropped, NULL while it is fine */
+} peer;
+
+static peer g_peers[PEERS_MAX];
+static int g_npeers = 0;
+static volatile sig_atomic_t g_stop = 0;
+
+static void on_signal(int sig) { (void)sig; g_stop = 1; }
+
+static int buf_reserve(buf *b, size_t need) {
+    if (need <= b->cap) return 0;
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < need) cap *= 2;
+    unsigned char *p = (unsigned char*)realloc(b->p, cap);
+    if (!p) return -1;
+    b->p = p;
+    b->cap = cap;
+    return 0;
+}
+
+static int listen_on(const char *addr) {
+    int fd;
+    if (strncmp(addr, "unix:", 5) == 0) {
+        struct sockaddr_un un;
+        memset(&un, 0, sizeof(un));
+        if (!addr[5] || strlen(addr + 5) >= sizeof(un.sun_path)) return -1;
+        un.sun_family = AF_UNIX;
+        strcpy(un.sun_path, addr + 5);
+        unlink(un.sun_path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr*)&un, sizeof(un)) < 0) { perror("bind"); return -1; }
+    } else {
+        char host[200] = "";
+        const char *port = addr, *colon = strrchr(addr, ':');
+        if (colon) {
+            if ((size_t)(colon - addr) >= sizeof(host)) return -1;
+            memcpy(host, addr, (size_t)(colon - addr));
+            host[colon - addr] = '\0';
+            port = colon + 1;
+        }
+        struct addrinfo hints, *res = NULL;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        if (getaddrinfo(host[0] ? host : NULL, port, &hints, &res) != 0 || !res) return -1;
+        fd = socket(res->ai_family, SOCK_STREAM, 0);
+        int one = 1;
+        if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (fd < 0 || bind(fd, res->ai_addr, res->ai_addrlen) < 0) { perror("bind"); freeaddrinfo(res); return -1; }
+        freeaddrinfo(res);
+    }
+    if (listen(fd, 64) < 0) { perror("listen"); return -1; }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+static void drop_peer(int i, const char *why) {
+    fprintf(stderr, "relayhub: peer fd=%d dropped (%s)\n", g_peers[i].fd, why);
+    close(g_peers[i].fd);
+    free(g_peers[i].in.p);
+    free(g_peers[i].out.p);
+    g_peers[i] = g_peers[--g_npeers];
+}
+
+/* returns -1 if the peer has to go */
+static int flush_peer(peer *p) {
+    while (p->out_off < p->out.len) {
+        ssize_t w = send(p->fd, p->out.p + p->out_off, p->out.len - p->out_off, 0);
+        if (w < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p->out_off += (size_t)w;
+    }
+    p->out.len = p->out_off = 0;
+    return 0;
+}
+
+/* queues a frame for every peer except the sender */
+static void forward(int from, const unsigned char *f, size_t n) {
+    for (int i = 0; i < g_npeers; i++) {
+        peer *p = &g_peers[i];
+        if (i == from || p->gone) continue;
+        if (p->out.len - p->out_off + n > RELAY_OUT_MAX) {
+            p->gone = "too slow";
+            continue;
+        }
+        /* drop the sent prefix first, so the buffer stays about RELAY_OUT_MAX
+           for a peer that is always a little behind */
+        if (p->out_off) {
+            memmove(p->out.p, p->out.p + p->out_off, p->out.len - p->out_off);
+            p->out.len -= p->out_off;
+            p->out_off = 0;
+        }
+        if (buf_reserve(&p->out, p->out.len + n) < 0) {
+            p->gone = "out of memory";
+            continue;
+        }
+        memcpy(p->out.p + p->out.len, f, n);
+        p->out.p[p->out.len + 5]++;   /* hops */
+        p->out.len += n;
+    }
+}
+
+/* reads what is there and forwards every complete frame; -1 if the peer has to go */
+static int read_peer(int i) {
+    peer *p = &g_peers[i];
+    for (;;) {
+        if (buf_reserve(&p->in, p->in.len + 65536) < 0) return -1;
+        ssize_t r = recv(p->fd, p->in.p + p->in.len, p->in.cap - p->in.len, 0);
+        if (r == 0) return -1;
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        p->in.len += (size_t)r;
+        size_t off = 0;
+        while (p->in.len - off >= 4) {
+            const unsigned char *f = p->in.p + off;
+            size_t len = (size_t)f[0] | (size_t)f[1] << 8 | (size_t)f[2] << 16 | (size_t)f[3] << 24;
+            if (len < RELAY_HDR - 4 || len > RELAY_FRAME_MAX - 4) return -1;
+            if (p->in.len - off < 4 + len) break;
+            if (f[5] < RELAY_MAX_HOPS) forward(i, f, 4 + len);
+            off += 4 + len;
+        }
+        memmove(p->in.p, p->in.p + off, p->in.len - off);
+        p->in.len -= off;
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s unix:/path | [host:]port\n", argv[0]);
+        return 2;
+    }
+    int srv = listen_on(argv[1]);
+    if (srv < 0) {
+        fprintf(stderr, "relayhub: cannot listen on %s\n", argv[1]);
+        return 1;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "relayhub: listening on %s\n", argv[1]);
+
+    while (!g_stop) {
+        fd_set rfds, wfds;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        FD_SET(srv, &rfds);
+        int maxfd = srv;
+        for (int i = 0; i < g_npeers; i++) {
+            FD_SET(g_peers[i].fd, &rfds);
+            if (g_peers[i].out_off < g_peers[i].out.len) FD_SET(g_peers[i].fd, &wfds);
+            if (g_peers[i].fd > maxfd) maxfd = g_peers[i].fd;
+        }
+        if (select(maxfd + 1, &rfds, &wfds, NULL, NULL) < 0) {
+            if (errno == EINTR) continue;
+            perror("select");
+            break;
+        }
+        if (FD_ISSET(srv, &rfds)) {
+            int fd = accept(srv, NULL, NULL);
+            if (fd >= 0 && (g_npeers == PEERS_MAX || fd >= FD_SETSIZE)) {
+                close(fd);
+            } else if (fd >= 0) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+                memset(&g_peers[g_npeers], 0, sizeof(peer));
+                g_peers[g_npeers++].fd = fd;
+                fprintf(stderr, "relayhub: peer fd=%d connected (%d total)\n", fd, g_npeers);
+            }
+        }
+        /* peers are only dropped afterwards, so indexes stay put while frames are forwarded */
+        for (int i = 0; i < g_npeers; i++) {
+            peer *p = &g_peers[i];
+            if (!p->gone && FD_ISSET(p->fd, &rfds) && read_peer(i) < 0) p->gone = "closed";
+        }
+        for (int i = g_npeers - 1; i >= 0; i--) {
+            if (!g_peers[i].gone && flush_peer(&g_peers[i]) < 0) g_peers[i].gone = "send failed";
+            if (g_peers[i].gone) drop_peer(i, g_peers[i].gone);
+        }
+    }
+
+    for (int i = g_npeers - 1; i >= 0; i--) drop_peer(i, "shutdown");
+    close(srv);
+    if (strncmp(argv[1], "unix:", 5) == 0) unlink(argv[1] + 5);
+    return 0;
+}